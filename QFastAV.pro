@@ -9,7 +9,28 @@ SOURCES += main.cpp \
     avseeker.cpp \
     avframeprovider.cpp \
     avprovider.cpp \
-    privateutil.cpp
+    privateutil.cpp \
+    avcodeccontextpool.cpp \
+    avloudnessmeter.cpp \
+    avbatchscanner.cpp \
+    avpeakoverview.cpp \
+    avframeref.cpp \
+    avframefanout.cpp \
+    avtailwatcher.cpp \
+    avpresentationclock.cpp \
+    avthreadpolicy.cpp \
+    avsharedframering.cpp \
+    avreversedecoder.cpp \
+    avasyncframesource.cpp \
+    avvideoitem.cpp \
+    avinputcontext.cpp \
+    avpacketreader.cpp \
+    avremuxsink.cpp \
+    avsegmentdecoder.cpp \
+    avdecodertuner.cpp \
+    avaudiomixer.cpp \
+    avspectrumanalyzer.cpp \
+    avmemorysource.cpp
 
 RESOURCES += qml.qrc
 
@@ -45,8 +66,29 @@ HEADERS += \
     avframeprovider.hpp \
     avprovider.hpp \
     privateutil.hpp \
-    publicutil.hpp
+    publicutil.hpp \
+    avcodeccontextpool.hpp \
+    avloudnessmeter.hpp \
+    avbatchscanner.hpp \
+    avpeakoverview.hpp \
+    avframeref.hpp \
+    avframefanout.hpp \
+    avtailwatcher.hpp \
+    avpresentationclock.hpp \
+    avthreadpolicy.hpp \
+    avsharedframering.hpp \
+    avreversedecoder.hpp \
+    avasyncframesource.hpp \
+    avvideoitem.hpp \
+    avinputcontext.hpp \
+    avpacketreader.hpp \
+    avremuxsink.hpp \
+    avsegmentdecoder.hpp \
+    avdecodertuner.hpp \
+    avaudiomixer.hpp \
+    avspectrumanalyzer.hpp \
+    avmemorysource.hpp
 
 INCLUDEPATH += D:/libbase/ffmpeg/include
 DEPENDPATH += D:/libbase/ffmpeg/include
-LIBS += -LD:/libbase/ffmpeg/lib -lavutil -lavformat -lavcodec
+LIBS += -LD:/libbase/ffmpeg/lib -lavutil -lavformat -lavcodec -lswscale
@@ -0,0 +1,112 @@
+#include "avasyncframesource.hpp"
+#include "avframeprovider.hpp"
+#include <QRunnable>
+
+namespace
+{
+  // frames one pump decodes before it queues itself again behind other sources
+  const int g_pumpBatchSize = 8;
+}
+
+class AVAsyncFrameSource::Pump final : public QRunnable
+{
+public:
+  Pump(AVAsyncFrameSource *source)
+  { m_source = source; }
+
+  void run() override
+  { m_source->_pump(); }
+
+private:
+  AVAsyncFrameSource *m_source;
+};
+
+AVAsyncFrameSource::AVAsyncFrameSource(AVFrameProvider *provider, QThreadPool *pool, QObject *parent) : QObject(parent)
+{
+  Q_ASSERT(provider);
+  qRegisterMetaType<AVFrameRef>();
+  m_provider = provider;
+  m_pool = pool ? pool : QThreadPool::globalInstance();
+  m_demand = 0;
+  m_pumpScheduled = false;
+  m_finished = false;
+}
+
+AVAsyncFrameSource::~AVAsyncFrameSource()
+{
+  m_locker.lock();
+  m_demand = 0;
+  while(m_pumpScheduled)
+    m_syncer.wait(&m_locker);
+  m_locker.unlock();
+}
+
+AVFrameProvider *AVAsyncFrameSource::provider() const
+{ return m_provider; }
+
+void AVAsyncFrameSource::request(int n)
+{
+  Q_ASSERT(n > 0);
+  m_locker.lock();
+  m_demand += n;
+  _schedule_lockfree();
+  m_locker.unlock();
+}
+
+void AVAsyncFrameSource::cancel()
+{
+  m_locker.lock();
+  m_demand = 0;
+  m_locker.unlock();
+}
+
+qint64 AVAsyncFrameSource::pendingDemand() const
+{
+  QMutexLocker locker(&m_locker);
+  return m_demand;
+}
+
+bool AVAsyncFrameSource::isFinished() const
+{
+  QMutexLocker locker(&m_locker);
+  return m_finished;
+}
+
+void AVAsyncFrameSource::_schedule_lockfree()
+{
+  if(m_pumpScheduled || m_finished || m_demand <= 0)
+    return;
+  m_pumpScheduled = true;
+  m_pool->start(new Pump(this));
+}
+
+void AVAsyncFrameSource::_pump()
+{
+  int nFrame = 0;
+  m_locker.lock();
+  while(m_demand > 0 && nFrame < g_pumpBatchSize)
+  {
+    --m_demand;
+    m_locker.unlock();
+
+    // signals are emitted from the pool thread and queued to the receivers
+    bool ok = m_provider->nextFrame();
+    if(ok)
+      emit frameReady(m_provider->currentFrameRef());
+    else
+    {
+      m_locker.lock();
+      m_finished = true;
+      m_demand = 0;
+      m_locker.unlock();
+      emit finished();
+    }
+
+    m_locker.lock();
+    ++nFrame;
+  }
+  m_pumpScheduled = false;
+  _schedule_lockfree();
+  m_syncer.wakeAll();
+  m_locker.unlock();
+}
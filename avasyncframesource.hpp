@@ -0,0 +1,51 @@
+#pragma once
+
+#include <QObject>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThreadPool>
+#include "avframeref.hpp"
+
+class AVFrameProvider;
+
+// Event loop friendly front end of an AVFrameProvider. request(n) adds
+// demand for n more frames, which are decoded on a thread pool and
+// delivered through frameReady() in the thread this object lives in, so
+// one thread can drive many sources without blocking. Pumps yield after a
+// few frames to let other sources on the same pool make progress. The
+// provider must not be used elsewhere while frames are requested.
+class AVAsyncFrameSource final : public QObject
+{
+  Q_OBJECT
+
+public:
+  AVAsyncFrameSource(AVFrameProvider *provider, QThreadPool *pool = nullptr, QObject *parent = nullptr);
+  ~AVAsyncFrameSource();
+
+  AVFrameProvider *provider() const;
+
+  void request(int n);
+  void cancel();
+  qint64 pendingDemand() const;
+  bool isFinished() const;
+
+signals:
+  void frameReady(const AVFrameRef &frame);
+  void finished();
+
+private:
+  class Pump;
+
+  void _schedule_lockfree();
+  void _pump();
+
+  AVFrameProvider *m_provider;
+  QThreadPool *m_pool;
+
+  qint64 m_demand;
+  bool m_pumpScheduled;
+  bool m_finished;
+
+  mutable QMutex m_locker;
+  QWaitCondition m_syncer;
+};
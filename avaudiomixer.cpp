@@ -0,0 +1,378 @@
+#include "avaudiomixer.hpp"
+#include "avframeprovider.hpp"
+#include "avprovider.hpp"
+#include "avthreadpolicy.hpp"
+#include "privateutil.hpp"
+#include <QDebug>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define QFASTAV_MIX_AVX2
+#elif defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define QFASTAV_MIX_SSE
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define QFASTAV_MIX_NEON
+#endif
+
+namespace
+{
+  // samples a track buffer holds before the first frame arrives
+  const int g_initialBufferSize = 8192;
+
+  void balanceGains(float gain, float pan, float *pLeft, float *pRight)
+  {
+    *pLeft = gain * std::min(1.0f, 1.0f - pan);
+    *pRight = gain * std::min(1.0f, 1.0f + pan);
+  }
+
+  // pOut[2i] += pLeft[i] * (leftGain + i * leftStep), pOut[2i + 1] likewise from pRight
+  void mixStereo(const float *pLeft, const float *pRight, float *pOut, int n, float leftGain, float rightGain, float leftStep, float rightStep)
+  {
+    int i = 0;
+#if defined(QFASTAV_MIX_AVX2)
+    if(n >= 8)
+    {
+      const __m256 vIndex = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+      __m256 vLeftGain = _mm256_add_ps(_mm256_set1_ps(leftGain), _mm256_mul_ps(vIndex, _mm256_set1_ps(leftStep)));
+      __m256 vRightGain = _mm256_add_ps(_mm256_set1_ps(rightGain), _mm256_mul_ps(vIndex, _mm256_set1_ps(rightStep)));
+      const __m256 vLeftIncrement = _mm256_set1_ps(leftStep * 8.0f);
+      const __m256 vRightIncrement = _mm256_set1_ps(rightStep * 8.0f);
+      for(; i + 8 <= n; i += 8)
+      {
+        __m256 vLeft = _mm256_mul_ps(_mm256_loadu_ps(pLeft + i), vLeftGain);
+        __m256 vRight = _mm256_mul_ps(_mm256_loadu_ps(pRight + i), vRightGain);
+        // unpack interleaves within 128 bit lanes, the permutes put the lanes in order
+        __m256 vLow = _mm256_unpacklo_ps(vLeft, vRight);
+        __m256 vHigh = _mm256_unpackhi_ps(vLeft, vRight);
+        float *pDst = pOut + 2 * i;
+        _mm256_storeu_ps(pDst, _mm256_add_ps(_mm256_loadu_ps(pDst), _mm256_permute2f128_ps(vLow, vHigh, 0x20)));
+        _mm256_storeu_ps(pDst + 8, _mm256_add_ps(_mm256_loadu_ps(pDst + 8), _mm256_permute2f128_ps(vLow, vHigh, 0x31)));
+        vLeftGain = _mm256_add_ps(vLeftGain, vLeftIncrement);
+        vRightGain = _mm256_add_ps(vRightGain, vRightIncrement);
+      }
+    }
+#elif defined(QFASTAV_MIX_SSE)
+    if(n >= 4)
+    {
+      const __m128 vIndex = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+      __m128 vLeftGain = _mm_add_ps(_mm_set1_ps(leftGain), _mm_mul_ps(vIndex, _mm_set1_ps(leftStep)));
+      __m128 vRightGain = _mm_add_ps(_mm_set1_ps(rightGain), _mm_mul_ps(vIndex, _mm_set1_ps(rightStep)));
+      const __m128 vLeftIncrement = _mm_set1_ps(leftStep * 4.0f);
+      const __m128 vRightIncrement = _mm_set1_ps(rightStep * 4.0f);
+      for(; i + 4 <= n; i += 4)
+      {
+        __m128 vLeft = _mm_mul_ps(_mm_loadu_ps(pLeft + i), vLeftGain);
+        __m128 vRight = _mm_mul_ps(_mm_loadu_ps(pRight + i), vRightGain);
+        float *pDst = pOut + 2 * i;
+        _mm_storeu_ps(pDst, _mm_add_ps(_mm_loadu_ps(pDst), _mm_unpacklo_ps(vLeft, vRight)));
+        _mm_storeu_ps(pDst + 4, _mm_add_ps(_mm_loadu_ps(pDst + 4), _mm_unpackhi_ps(vLeft, vRight)));
+        vLeftGain = _mm_add_ps(vLeftGain, vLeftIncrement);
+        vRightGain = _mm_add_ps(vRightGain, vRightIncrement);
+      }
+    }
+#elif defined(QFASTAV_MIX_NEON)
+    if(n >= 4)
+    {
+      const float indexList[4] = {0.0f, 1.0f, 2.0f, 3.0f};
+      const float32x4_t vIndex = vld1q_f32(indexList);
+      float32x4_t vLeftGain = vmlaq_f32(vdupq_n_f32(leftGain), vIndex, vdupq_n_f32(leftStep));
+      float32x4_t vRightGain = vmlaq_f32(vdupq_n_f32(rightGain), vIndex, vdupq_n_f32(rightStep));
+      const float32x4_t vLeftIncrement = vdupq_n_f32(leftStep * 4.0f);
+      const float32x4_t vRightIncrement = vdupq_n_f32(rightStep * 4.0f);
+      for(; i + 4 <= n; i += 4)
+      {
+        // vld2q/vst2q deinterleave and interleave the output on the fly
+        float32x4x2_t vOut = vld2q_f32(pOut + 2 * i);
+        vOut.val[0] = vmlaq_f32(vOut.val[0], vld1q_f32(pLeft + i), vLeftGain);
+        vOut.val[1] = vmlaq_f32(vOut.val[1], vld1q_f32(pRight + i), vRightGain);
+        vst2q_f32(pOut + 2 * i, vOut);
+        vLeftGain = vaddq_f32(vLeftGain, vLeftIncrement);
+        vRightGain = vaddq_f32(vRightGain, vRightIncrement);
+      }
+    }
+#endif
+    for(; i < n; ++i)
+    {
+      pOut[2 * i] += pLeft[i] * (leftGain + static_cast<float>(i) * leftStep);
+      pOut[2 * i + 1] += pRight[i] * (rightGain + static_cast<float>(i) * rightStep);
+    }
+  }
+}
+
+AVAudioMixer::AVAudioMixer(int samprate)
+{
+  Q_ASSERT(samprate > 0);
+  m_samprate = samprate;
+  m_playQueue = nullptr;
+  m_crossfadeDuration = 0.0;
+  m_currentItemTrack = nullptr;
+  m_nextItemTrack = nullptr;
+}
+
+AVAudioMixer::~AVAudioMixer()
+{
+  qDeleteAll(m_trackList);
+  delete m_currentItemTrack;
+  delete m_nextItemTrack;
+}
+
+int AVAudioMixer::samprate() const
+{ return m_samprate; }
+
+int AVAudioMixer::addTrack(AVFrameProvider *provider, float gain, float pan)
+{
+  Q_ASSERT(provider);
+  QMutexLocker locker(&m_locker);
+  m_trackList.append(_createTrack(provider, gain, pan));
+  return m_trackList.size() - 1;
+}
+
+void AVAudioMixer::removeTrack(int iTrack)
+{
+  QMutexLocker locker(&m_locker);
+  delete m_trackList.takeAt(iTrack);
+}
+
+int AVAudioMixer::trackCount() const
+{
+  QMutexLocker locker(&m_locker);
+  return m_trackList.size();
+}
+
+bool AVAudioMixer::isTrackFinished(int iTrack) const
+{
+  QMutexLocker locker(&m_locker);
+  return m_trackList.at(iTrack)->finished;
+}
+
+void AVAudioMixer::setTrackGain(int iTrack, float gain, double rampDuration)
+{
+  QMutexLocker locker(&m_locker);
+  Track *track = m_trackList.at(iTrack);
+  _setTarget(track, gain, track->pan, rampDuration);
+}
+
+float AVAudioMixer::trackGain(int iTrack) const
+{
+  QMutexLocker locker(&m_locker);
+  return m_trackList.at(iTrack)->gain;
+}
+
+void AVAudioMixer::setTrackPan(int iTrack, float pan, double rampDuration)
+{
+  QMutexLocker locker(&m_locker);
+  Track *track = m_trackList.at(iTrack);
+  _setTarget(track, track->gain, pan, rampDuration);
+}
+
+float AVAudioMixer::trackPan(int iTrack) const
+{
+  QMutexLocker locker(&m_locker);
+  return m_trackList.at(iTrack)->pan;
+}
+
+void AVAudioMixer::setPlayQueue(AVProvider *provider, double crossfadeDuration)
+{
+  Q_ASSERT(crossfadeDuration >= 0.0);
+  QMutexLocker locker(&m_locker);
+  delete m_currentItemTrack;
+  delete m_nextItemTrack;
+  m_currentItemTrack = nullptr;
+  m_nextItemTrack = nullptr;
+  m_playQueue = provider;
+  m_crossfadeDuration = crossfadeDuration;
+}
+
+AVProvider *AVAudioMixer::playQueue() const
+{
+  QMutexLocker locker(&m_locker);
+  return m_playQueue;
+}
+
+double AVAudioMixer::crossfadeDuration() const
+{
+  QMutexLocker locker(&m_locker);
+  return m_crossfadeDuration;
+}
+
+int AVAudioMixer::mix(float *pOut, int sampleCount)
+{
+  Q_ASSERT(pOut && sampleCount >= 0);
+  QMutexLocker locker(&m_locker);
+  std::memset(pOut, 0, sizeof(float) * 2 * static_cast<size_t>(sampleCount));
+
+  int producedCount = 0;
+  for(Track *track:m_trackList)
+  {
+    if(!track->finished)
+      producedCount = std::max(producedCount, _mixTrack(track, pOut, sampleCount));
+  }
+
+  // the play queue is mixed in pieces, so the next item continues right where the current one ended
+  if(m_playQueue && m_playQueue->playQueueSize() > 0)
+  {
+    int offset = 0;
+    int nSwitch = 0;
+    while(offset < sampleCount && nSwitch <= m_playQueue->playQueueSize())
+    {
+      if(m_currentItemTrack && m_currentItemTrack->finished)
+      {
+        delete m_currentItemTrack;
+        m_currentItemTrack = m_nextItemTrack;
+        m_nextItemTrack = nullptr;
+        m_playQueue->nextItem();
+        ++nSwitch;
+      }
+      _updatePlayQueue();
+
+      int count = sampleCount - offset;
+      int writtenCount = _mixTrack(m_currentItemTrack, pOut + 2 * offset, count);
+      if(m_nextItemTrack)
+        _mixTrack(m_nextItemTrack, pOut + 2 * offset, writtenCount);
+      offset += writtenCount;
+      if(writtenCount < count && !m_currentItemTrack->finished)
+        break;
+    }
+    producedCount = std::max(producedCount, offset);
+  }
+  return producedCount;
+}
+
+AVAudioMixer::Track *AVAudioMixer::_createTrack(AVFrameProvider *provider, float gain, float pan)
+{
+  if(!provider->hasAudio())
+    throw AudioFormatError("Track has no audio.");
+  if(provider->audioSamprate() != m_samprate)
+  {
+    qCritical("Track sample rate %d differs from mixer sample rate %d.", provider->audioSamprate(), m_samprate);
+    throw AudioFormatError("Sample rate mismatch.");
+  }
+
+  Track *track = new Track;
+  track->provider = provider;
+  track->gain = gain;
+  track->pan = pan;
+  balanceGains(gain, pan, &track->leftGain, &track->rightGain);
+  track->leftStep = 0.0f;
+  track->rightStep = 0.0f;
+  track->rampRemaining = 0;
+  track->leftBuffer.resize(g_initialBufferSize);
+  track->rightBuffer.resize(g_initialBufferSize);
+  track->frameSize = 0;
+  track->frameOffset = 0;
+  track->finished = false;
+  return track;
+}
+
+void AVAudioMixer::_setTarget(Track *track, float gain, float pan, double rampDuration)
+{
+  Q_ASSERT(pan >= -1.0f && pan <= 1.0f);
+  track->gain = gain;
+  track->pan = pan;
+  float leftTarget, rightTarget;
+  balanceGains(gain, pan, &leftTarget, &rightTarget);
+
+  int rampSampleCount = static_cast<int>(std::round(rampDuration * static_cast<double>(m_samprate)));
+  if(rampSampleCount <= 0)
+  {
+    track->leftGain = leftTarget;
+    track->rightGain = rightTarget;
+    track->leftStep = 0.0f;
+    track->rightStep = 0.0f;
+    track->rampRemaining = 0;
+    return;
+  }
+  track->leftStep = (leftTarget - track->leftGain) / static_cast<float>(rampSampleCount);
+  track->rightStep = (rightTarget - track->rightGain) / static_cast<float>(rampSampleCount);
+  track->rampRemaining = rampSampleCount;
+}
+
+bool AVAudioMixer::_fetchFrame(Track *track)
+{
+  if(!track->provider->nextAudioFrame())
+  {
+    track->finished = true;
+    return false;
+  }
+  const AVFrame *pFrame = track->provider->currentAudioFrame();
+  Q_ASSERT(pFrame->sample_rate == m_samprate);
+  int n = pFrame->nb_samples;
+  if(track->leftBuffer.size() < n)
+  {
+    track->leftBuffer.resize(n);
+    track->rightBuffer.resize(n);
+  }
+  readAudioFrameAsFloat(pFrame, 0, track->leftBuffer.data());
+  if(av_frame_get_channels(pFrame) > 1)
+    readAudioFrameAsFloat(pFrame, 1, track->rightBuffer.data());
+  else
+    std::memcpy(track->rightBuffer.data(), track->leftBuffer.constData(), sizeof(float) * static_cast<size_t>(n));
+  track->frameSize = n;
+  track->frameOffset = 0;
+  return true;
+}
+
+int AVAudioMixer::_mixTrack(Track *track, float *pOut, int sampleCount)
+{
+  int writtenCount = 0;
+  while(writtenCount < sampleCount)
+  {
+    if(track->frameOffset >= track->frameSize && !_fetchFrame(track))
+      break;
+    int count = std::min(sampleCount - writtenCount, track->frameSize - track->frameOffset);
+    if(track->rampRemaining > 0)
+      count = std::min(count, track->rampRemaining);
+
+    const float *pLeft = track->leftBuffer.constData() + track->frameOffset;
+    const float *pRight = track->rightBuffer.constData() + track->frameOffset;
+    float *pDst = pOut + 2 * writtenCount;
+    if(track->rampRemaining > 0)
+    {
+      mixStereo(pLeft, pRight, pDst, count, track->leftGain, track->rightGain, track->leftStep, track->rightStep);
+      track->rampRemaining -= count;
+      if(track->rampRemaining == 0)
+        _setTarget(track, track->gain, track->pan, 0.0);
+      else
+      {
+        track->leftGain += track->leftStep * static_cast<float>(count);
+        track->rightGain += track->rightStep * static_cast<float>(count);
+      }
+    }
+    else if(track->leftGain != 0.0f || track->rightGain != 0.0f)
+      mixStereo(pLeft, pRight, pDst, count, track->leftGain, track->rightGain, 0.0f, 0.0f);
+
+    track->frameOffset += count;
+    writtenCount += count;
+  }
+  return writtenCount;
+}
+
+void AVAudioMixer::_updatePlayQueue()
+{
+  if(!m_currentItemTrack)
+    m_currentItemTrack = _createTrack(m_playQueue->currentFrameProvider(), 1.0f, 0.0f);
+  if(m_nextItemTrack || m_crossfadeDuration <= 0.0)
+    return;
+
+  // without a known duration the next item just follows without a fade
+  AVFrameProvider *provider = m_currentItemTrack->provider;
+  if(!provider->hasDuration())
+    return;
+  double position = provider->audioPts() + static_cast<double>(m_currentItemTrack->frameOffset) / static_cast<double>(m_samprate);
+  double remaining = provider->duration() - position;
+  if(!(remaining <= m_crossfadeDuration))
+    return;
+  AVFrameProvider *nextProvider = m_playQueue->peekFrameProvider(1);
+  if(!nextProvider)
+    return;
+  nextProvider->setThreadRole(AVThreadPolicy::PlaybackRole);
+  m_nextItemTrack = _createTrack(nextProvider, 0.0f, 0.0f);
+  remaining = std::max(remaining, 0.0);
+  _setTarget(m_nextItemTrack, 1.0f, 0.0f, remaining);
+  _setTarget(m_currentItemTrack, 0.0f, m_currentItemTrack->pan, remaining);
+}
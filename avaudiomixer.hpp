@@ -0,0 +1,78 @@
+#pragma once
+
+#include <QList>
+#include <QVector>
+#include <QMutex>
+#include <stdexcept>
+#include "publicutil.hpp"
+
+class AVFrameProvider;
+class AVProvider;
+
+DEFINE_EXCEPTION(AudioFormatError, std::runtime_error)
+
+// Mixes the audio of several AVFrameProviders into one interleaved stereo
+// float buffer, pulling every track in lockstep through nextAudioFrame().
+// Gain and pan changes ramp linearly per sample, pan is a balance control
+// (unity at center). Mono tracks feed both sides, tracks with more than
+// two channels contribute their first two. All tracks must already have
+// the mixer's sample rate.
+//
+// A play queue can be mixed as well: the next AVProvider item starts
+// crossfadeDuration seconds before the current one ends and both are
+// ramped across, the finished item is dropped with AVProvider::nextItem().
+class AVAudioMixer final
+{
+public:
+  AVAudioMixer(int samprate);
+  ~AVAudioMixer();
+
+  int samprate() const;
+
+  int addTrack(AVFrameProvider *provider, float gain = 1.0f, float pan = 0.0f);
+  void removeTrack(int iTrack);
+  int trackCount() const;
+  bool isTrackFinished(int iTrack) const;
+
+  void setTrackGain(int iTrack, float gain, double rampDuration = 0.0);
+  float trackGain(int iTrack) const;
+  void setTrackPan(int iTrack, float pan, double rampDuration = 0.0);
+  float trackPan(int iTrack) const;
+
+  void setPlayQueue(AVProvider *provider, double crossfadeDuration = 0.0);
+  AVProvider *playQueue() const;
+  double crossfadeDuration() const;
+
+  // Overwrites pOut with sampleCount interleaved stereo samples and returns
+  // how many of them came from a track, zero once every track is finished.
+  int mix(float *pOut, int sampleCount);
+
+private:
+  struct Track
+  {
+    AVFrameProvider *provider;
+    float gain, pan;
+    float leftGain, rightGain;
+    float leftStep, rightStep;
+    int rampRemaining;
+    // current frame converted to float, only ever grown
+    QVector<float> leftBuffer, rightBuffer;
+    int frameSize, frameOffset;
+    bool finished;
+  };
+
+  Track *_createTrack(AVFrameProvider *provider, float gain, float pan);
+  void _setTarget(Track *track, float gain, float pan, double rampDuration);
+  bool _fetchFrame(Track *track);
+  int _mixTrack(Track *track, float *pOut, int sampleCount);
+  void _updatePlayQueue();
+
+  int m_samprate;
+  QList<Track*> m_trackList;
+
+  AVProvider *m_playQueue;
+  double m_crossfadeDuration;
+  Track *m_currentItemTrack, *m_nextItemTrack;
+
+  mutable QMutex m_locker;
+};
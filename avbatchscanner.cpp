@@ -0,0 +1,156 @@
+#include "avbatchscanner.hpp"
+#include "avframeprovider.hpp"
+#include "avloudnessmeter.hpp"
+#include <QRunnable>
+#include <QScopedPointer>
+#include <cmath>
+#include <limits>
+
+class AVBatchScanner::ScanJob final : public QRunnable
+{
+public:
+  ScanJob(AVBatchScanner *scanner, const QString &path, Analyzers analyzers, const QSharedPointer<std::atomic<bool>> &canceled)
+  {
+    m_scanner = scanner;
+    m_path = path;
+    m_analyzers = analyzers;
+    m_canceled = canceled;
+  }
+
+  // the pool deletes a job either after run() or when clear() drops it unstarted,
+  // so releasing the pending slot here counts every job exactly once
+  ~ScanJob()
+  { m_scanner->_releaseJob(); }
+
+  void run() override
+  { emit m_scanner->resultReady(scanFile(m_path, m_analyzers, m_canceled.data())); }
+
+private:
+  AVBatchScanner *m_scanner;
+  QString m_path;
+  Analyzers m_analyzers;
+  QSharedPointer<std::atomic<bool>> m_canceled;
+};
+
+AVBatchScanner::AVBatchScanner(QObject *parent) : QObject(parent)
+{
+  qRegisterMetaType<AVScanResult>();
+  m_analyzers = NoAnalyzer;
+  m_pendingCount = 0;
+  m_canceled.reset(new std::atomic<bool>(false));
+  m_pool.setMaxThreadCount(QThread::idealThreadCount());
+}
+
+AVBatchScanner::~AVBatchScanner()
+{
+  cancel();
+  m_pool.waitForDone();
+}
+
+void AVBatchScanner::setMaxParallelCount(int v)
+{
+  Q_ASSERT(v > 0);
+  m_pool.setMaxThreadCount(v);
+}
+
+int AVBatchScanner::maxParallelCount() const
+{ return m_pool.maxThreadCount(); }
+
+void AVBatchScanner::setAnalyzers(AVBatchScanner::Analyzers v)
+{ m_analyzers = v; }
+
+AVBatchScanner::Analyzers AVBatchScanner::analyzers() const
+{ return m_analyzers; }
+
+void AVBatchScanner::scan(const QStringList &pathList)
+{
+  // jobs of a canceled batch may still be running, so a new batch gets its own flag
+  if(*m_canceled)
+    m_canceled.reset(new std::atomic<bool>(false));
+  m_pendingCount += pathList.size();
+  for(const QString &path:pathList)
+    m_pool.start(new ScanJob(this, path, m_analyzers, m_canceled));
+}
+
+void AVBatchScanner::cancel()
+{
+  *m_canceled = true;
+  m_pool.clear();
+}
+
+bool AVBatchScanner::waitForFinished(int msecs)
+{ return m_pool.waitForDone(msecs); }
+
+int AVBatchScanner::pendingCount() const
+{ return m_pendingCount; }
+
+AVScanResult AVBatchScanner::scanFile(const QString &path, AVBatchScanner::Analyzers analyzers, const std::atomic<bool> *canceled)
+{
+  const double nan = std::numeric_limits<double>::quiet_NaN();
+  AVScanResult result;
+  result.path = path;
+  result.succeeded = false;
+  result.duration = nan;
+  result.bitRate = 0;
+  result.samprate = 0;
+  result.channelCount = 0;
+  result.sampleFormat = AV_SAMPLE_FMT_NONE;
+  result.integratedLoudness = nan;
+  result.samplePeak = nan;
+  result.replayGain = nan;
+
+  try
+  {
+    // parallelism comes from scanning many files, so keep each decoder single threaded and shallow
+    AVFrameProvider provider(path, true, false, 1);
+    provider.setPacketQueueSize(4);
+
+    result.formatName = provider.formatName();
+    result.duration = provider.duration();
+    result.bitRate = provider.bitRate();
+    result.samprate = provider.audioSamprate();
+    result.channelCount = provider.audioChannelCount();
+    result.sampleFormat = provider.audioSampleFormat();
+
+    if(analyzers != NoAnalyzer)
+    {
+      AVLoudnessMeter meter(result.samprate, result.channelCount, provider.audioChannelLayout());
+      provider.startDecoder(true);
+      while(provider.nextAudioFrame())
+      {
+        if(canceled && *canceled)
+        {
+          result.errorString = QStringLiteral("Canceled.");
+          return result;
+        }
+        meter.addFrame(provider.currentAudioFrame());
+      }
+      if(result.duration <= 0.0 || std::isnan(result.duration))
+        result.duration = static_cast<double>(meter.sampleCount()) / static_cast<double>(result.samprate);
+
+      double loudness = meter.integratedLoudness();
+      if(analyzers & LoudnessAnalyzer)
+      {
+        result.integratedLoudness = loudness;
+        result.samplePeak = meter.samplePeak();
+      }
+      if(analyzers & ReplayGainAnalyzer)
+      {
+        result.replayGain = AVLoudnessMeter::replayGain(loudness);
+        result.samplePeak = meter.samplePeak();
+      }
+    }
+    result.succeeded = true;
+  }
+  catch(const std::exception &e)
+  {
+    result.errorString = QString::fromUtf8(e.what());
+  }
+  return result;
+}
+
+void AVBatchScanner::_releaseJob()
+{
+  if(--m_pendingCount == 0)
+    emit finished();
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <QObject>
+#include <QStringList>
+#include <QThreadPool>
+#include <QMetaType>
+#include <QSharedPointer>
+#include <atomic>
+
+extern "C"
+{
+#include <libavutil/avutil.h>
+#include <libavutil/samplefmt.h>
+}
+
+struct AVScanResult
+{
+  QString path;
+  bool succeeded;
+  QString errorString;
+
+  QString formatName;
+  double duration;
+  qint64 bitRate;
+  int samprate;
+  int channelCount;
+  AVSampleFormat sampleFormat;
+
+  // NaN unless the corresponding analyzer is enabled
+  double integratedLoudness;
+  double samplePeak;
+  double replayGain;
+};
+Q_DECLARE_METATYPE(AVScanResult)
+
+class AVBatchScanner final : public QObject
+{
+  Q_OBJECT
+
+public:
+  enum Analyzer
+  {
+    NoAnalyzer = 0x0,
+    LoudnessAnalyzer = 0x1,
+    ReplayGainAnalyzer = 0x2
+  };
+  Q_DECLARE_FLAGS(Analyzers, Analyzer)
+
+  AVBatchScanner(QObject *parent = nullptr);
+  ~AVBatchScanner();
+
+  void setMaxParallelCount(int v);
+  int maxParallelCount() const;
+
+  void setAnalyzers(Analyzers v);
+  Analyzers analyzers() const;
+
+  void scan(const QStringList &pathList);
+  void cancel();
+  bool waitForFinished(int msecs = -1);
+  int pendingCount() const;
+
+  static AVScanResult scanFile(const QString &path, Analyzers analyzers, const std::atomic<bool> *canceled = nullptr);
+
+signals:
+  void resultReady(const AVScanResult &result);
+  void finished();
+
+private:
+  class ScanJob;
+
+  void _releaseJob();
+
+  Analyzers m_analyzers;
+  std::atomic<int> m_pendingCount;
+  QSharedPointer<std::atomic<bool>> m_canceled;
+  QThreadPool m_pool;
+};
+Q_DECLARE_OPERATORS_FOR_FLAGS(AVBatchScanner::Analyzers)
@@ -0,0 +1,177 @@
+#include "avcodeccontextpool.hpp"
+#include "privateutil.hpp"
+#include <QDataStream>
+#include <algorithm>
+#include <cstring>
+
+AVCodecContextPool *AVCodecContextPool::instance()
+{
+  static AVCodecContextPool pool;
+  return &pool;
+}
+
+AVCodecContextPool::AVCodecContextPool()
+{ m_maxSize = 8; }
+
+AVCodecContextPool::~AVCodecContextPool()
+{ clear(); }
+
+AVCodecContext *AVCodecContextPool::acquire(AVStream *pStream, int threadCount, int threadType, int lowres)
+{
+  Q_ASSERT(pStream);
+  QByteArray key = _makeKey(pStream->codecpar, threadCount, threadType, lowres);
+  AVCodecContext *pCodecCtx = nullptr;
+
+  m_locker.lock();
+  for(int i = m_entryList.size() - 1; i >= 0; --i)
+  {
+    if(m_entryList.at(i).key == key)
+    {
+      pCodecCtx = m_entryList.takeAt(i).pCodecCtx;
+      break;
+    }
+  }
+  m_locker.unlock();
+
+  if(pCodecCtx)
+    av_codec_set_pkt_timebase(pCodecCtx, pStream->time_base);
+  else
+    pCodecCtx = _openContext(pStream, threadCount, threadType, lowres);
+
+  m_locker.lock();
+  m_leasedKeyDict.insert(pCodecCtx, key);
+  m_locker.unlock();
+  return pCodecCtx;
+}
+
+void AVCodecContextPool::release(AVCodecContext *pCodecCtx)
+{
+  Q_ASSERT(pCodecCtx);
+  m_locker.lock();
+  Q_ASSERT(m_leasedKeyDict.contains(pCodecCtx));
+  QByteArray key = m_leasedKeyDict.take(pCodecCtx);
+  if(m_maxSize > 0)
+  {
+    // decoding shortcuts are per user, the next one starts from defaults
+    avcodec_flush_buffers(pCodecCtx);
+    pCodecCtx->skip_frame = AVDISCARD_DEFAULT;
+    pCodecCtx->skip_loop_filter = AVDISCARD_DEFAULT;
+    pCodecCtx->skip_idct = AVDISCARD_DEFAULT;
+    pCodecCtx->flags2 &= ~AV_CODEC_FLAG2_FAST;
+    Entry entry;
+    entry.key = key;
+    entry.pCodecCtx = pCodecCtx;
+    m_entryList.append(entry);
+    _trim_lockfree();
+  }
+  else
+    _freeContext(pCodecCtx);
+  m_locker.unlock();
+}
+
+void AVCodecContextPool::clear()
+{
+  m_locker.lock();
+  for(const Entry &entry:m_entryList)
+    _freeContext(entry.pCodecCtx);
+  m_entryList.clear();
+  m_locker.unlock();
+}
+
+void AVCodecContextPool::setMaxSize(int v)
+{
+  Q_ASSERT(v >= 0);
+  m_locker.lock();
+  m_maxSize = v;
+  _trim_lockfree();
+  m_locker.unlock();
+}
+
+int AVCodecContextPool::maxSize() const
+{
+  QMutexLocker locker(&m_locker);
+  return m_maxSize;
+}
+
+QByteArray AVCodecContextPool::_makeKey(const AVCodecParameters *pCodecPar, int threadCount, int threadType, int lowres)
+{
+  QByteArray key;
+  QDataStream stream(&key, QIODevice::WriteOnly);
+  stream << static_cast<qint32>(pCodecPar->codec_id) << static_cast<qint32>(pCodecPar->codec_type)
+         << static_cast<qint32>(pCodecPar->format) << static_cast<qint32>(pCodecPar->profile)
+         << static_cast<qint32>(pCodecPar->sample_rate) << static_cast<qint32>(pCodecPar->channels)
+         << static_cast<quint64>(pCodecPar->channel_layout) << static_cast<qint32>(pCodecPar->block_align)
+         << static_cast<qint32>(pCodecPar->bits_per_coded_sample) << static_cast<qint32>(pCodecPar->bits_per_raw_sample)
+         << static_cast<qint32>(pCodecPar->width) << static_cast<qint32>(pCodecPar->height)
+         << static_cast<qint32>(threadCount) << static_cast<qint32>(threadType) << static_cast<qint32>(lowres);
+
+  // FLAC STREAMINFO also carries length and checksum of the track, only its block sizes matter to the decoder
+  // beyond what codecpar already has. It may follow a "fLaC" marker and a metadata block header.
+  if(pCodecPar->codec_id == AV_CODEC_ID_FLAC)
+  {
+    const uint8_t *pStreamInfo = pCodecPar->extradata;
+    int streamInfoSize = pCodecPar->extradata_size;
+    if(streamInfoSize >= 8 && std::memcmp(pStreamInfo, "fLaC", 4) == 0)
+    {
+      pStreamInfo += 8;
+      streamInfoSize -= 8;
+    }
+    if(streamInfoSize >= 4)
+      stream.writeRawData(reinterpret_cast<const char*>(pStreamInfo), 4);
+  }
+  else if(pCodecPar->extradata_size > 0)
+    stream.writeRawData(reinterpret_cast<const char*>(pCodecPar->extradata), pCodecPar->extradata_size);
+  return key;
+}
+
+AVCodecContext *AVCodecContextPool::_openContext(AVStream *pStream, int threadCount, int threadType, int lowres)
+{
+  AVCodecParameters *pCodecPar = pStream->codecpar;
+
+  // find decoder
+  AVCodec *pCodec = avcodec_find_decoder(pCodecPar->codec_id);
+  if(!pCodec)
+  {
+    qCritical("Could not found available codec for stream %d.", pStream->index);
+    throw FFmpegError("Could not found available codec.");
+  }
+
+  // create codec context
+  AVCodecContext *pCodecCtx = avcodec_alloc_context3(pCodec);
+  if(!pCodecCtx)
+  {
+    qCritical("Could not alloc codec context for stream %d.", pStream->index);
+    throw FFmpegError("Could not alloc codec context.");
+  }
+  {
+    int parToCtxResult = avcodec_parameters_to_context(pCodecCtx, pCodecPar);
+    CHECK_AVRESULT(parToCtxResult, parToCtxResult >= 0);
+  }
+
+  // set parameter
+  av_codec_set_pkt_timebase(pCodecCtx, pStream->time_base);
+  pCodecCtx->thread_count = threadCount;
+  pCodecCtx->thread_type = threadType;
+  pCodecCtx->lowres = std::min(lowres, av_codec_get_max_lowres(pCodec));
+
+  // open codec
+  {
+    lockFFmpeg();
+    int codecOpenResult = avcodec_open2(pCodecCtx, pCodec, nullptr);
+    unlockFFmpeg();
+    CHECK_AVRESULT(codecOpenResult, codecOpenResult == 0);
+  }
+  return pCodecCtx;
+}
+
+void AVCodecContextPool::_freeContext(AVCodecContext *pCodecCtx)
+{
+  avcodec_close(pCodecCtx);
+  avcodec_free_context(&pCodecCtx);
+}
+
+void AVCodecContextPool::_trim_lockfree()
+{
+  while(m_entryList.size() > m_maxSize)
+    _freeContext(m_entryList.takeFirst().pCodecCtx);
+}
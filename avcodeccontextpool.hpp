@@ -0,0 +1,49 @@
+#pragma once
+
+#include <QMutex>
+#include <QHash>
+#include <QList>
+#include <QByteArray>
+
+extern "C"
+{
+#include <libavutil/avutil.h>
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+// Keeps opened codec contexts of retired decoders, so the next decoder of a
+// compatible stream skips codec lookup, allocation and opening.
+class AVCodecContextPool final
+{
+public:
+  static AVCodecContextPool *instance();
+
+  AVCodecContextPool();
+  ~AVCodecContextPool();
+
+  AVCodecContext *acquire(AVStream *pStream, int threadCount, int threadType, int lowres = 0);
+  void release(AVCodecContext *pCodecCtx);
+  void clear();
+
+  void setMaxSize(int v);
+  int maxSize() const;
+
+private:
+  struct Entry
+  {
+    QByteArray key;
+    AVCodecContext *pCodecCtx;
+  };
+
+  static QByteArray _makeKey(const AVCodecParameters *pCodecPar, int threadCount, int threadType, int lowres);
+  static AVCodecContext *_openContext(AVStream *pStream, int threadCount, int threadType, int lowres);
+  static void _freeContext(AVCodecContext *pCodecCtx);
+  void _trim_lockfree();
+
+  QList<Entry> m_entryList; // oldest first
+  QHash<AVCodecContext*, QByteArray> m_leasedKeyDict;
+  int m_maxSize;
+
+  mutable QMutex m_locker;
+};
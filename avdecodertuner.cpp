@@ -0,0 +1,346 @@
+#include "avdecodertuner.hpp"
+#include "avpacketreader.hpp"
+#include "avthreadpolicy.hpp"
+#include "privateutil.hpp"
+#include <QRunnable>
+#include <QElapsedTimer>
+#include <QStandardPaths>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QDebug>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace
+{
+  // configurations this close to the fastest count as equally fast
+  const double g_fpsTolerance = 0.95;
+  const int g_maxSamplePacketCount = 2000;
+}
+
+class AVDecoderTuner::TuneJob final : public QRunnable
+{
+public:
+  TuneJob(AVDecoderTuner *tuner, const QString &path, int iStream, const QString &key)
+  {
+    m_tuner = tuner;
+    m_path = path;
+    m_iStream = iStream;
+    m_key = key;
+  }
+
+  void run() override
+  {
+    // trial decodes must not steal time from playback
+    AVThreadPolicy::applyToCurrentThread(AVThreadPolicy::PreloadRole);
+    try
+    {
+      m_tuner->tune(m_path, m_iStream);
+    }
+    catch(const std::exception &e)
+    {
+      qWarning("Failed to tune decoder for %s: %s", qUtf8Printable(m_path), e.what());
+    }
+    m_tuner->m_locker.lock();
+    m_tuner->m_pendingKeySet.remove(m_key);
+    m_tuner->m_locker.unlock();
+  }
+
+private:
+  AVDecoderTuner *m_tuner;
+  QString m_path;
+  int m_iStream;
+  QString m_key;
+};
+
+AVDecoderTuner *AVDecoderTuner::instance()
+{
+  static AVDecoderTuner tuner;
+  return &tuner;
+}
+
+AVDecoderTuner::AVDecoderTuner()
+{
+  m_autoTuneEnabled = false;
+  m_sampleDuration = 3.0;
+  m_profilePath = QDir(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation)).filePath(QStringLiteral("decoder-profiles.json"));
+  m_loaded = false;
+  m_pool.setMaxThreadCount(1);
+}
+
+AVDecoderTuner::~AVDecoderTuner()
+{
+  m_pool.clear();
+  m_pool.waitForDone();
+}
+
+void AVDecoderTuner::setAutoTuneEnabled(bool v)
+{
+  QMutexLocker locker(&m_locker);
+  m_autoTuneEnabled = v;
+}
+
+bool AVDecoderTuner::isAutoTuneEnabled() const
+{
+  QMutexLocker locker(&m_locker);
+  return m_autoTuneEnabled;
+}
+
+void AVDecoderTuner::setSampleDuration(double seconds)
+{
+  Q_ASSERT(seconds > 0.0);
+  QMutexLocker locker(&m_locker);
+  m_sampleDuration = seconds;
+}
+
+double AVDecoderTuner::sampleDuration() const
+{
+  QMutexLocker locker(&m_locker);
+  return m_sampleDuration;
+}
+
+void AVDecoderTuner::setProfilePath(const QString &path)
+{
+  QMutexLocker locker(&m_locker);
+  m_profilePath = path;
+  m_profileDict.clear();
+  m_loaded = false;
+}
+
+QString AVDecoderTuner::profilePath() const
+{
+  QMutexLocker locker(&m_locker);
+  return m_profilePath;
+}
+
+bool AVDecoderTuner::lookup(const AVCodecParameters *pCodecPar, Profile *pOut) const
+{
+  Q_ASSERT(pCodecPar);
+  QMutexLocker locker(&m_locker);
+  _load_lockfree();
+  auto it = m_profileDict.constFind(_makeKey(pCodecPar));
+  if(it == m_profileDict.constEnd())
+    return false;
+  if(pOut)
+    *pOut = it.value();
+  return true;
+}
+
+AVDecoderTuner::Profile AVDecoderTuner::tune(const QString &path, int iStream)
+{
+  AVPacketReader reader(path);
+  if(iStream < 0)
+    iStream = reader.findStream(AVMEDIA_TYPE_VIDEO);
+  if(iStream < 0 || iStream >= static_cast<int>(reader.formatContext()->nb_streams) ||
+     reader.formatContext()->streams[iStream]->codecpar->codec_type != AVMEDIA_TYPE_VIDEO)
+    throw NoStreamError("No video stream available.");
+  reader.selectStreams(QList<int>{iStream});
+  const AVStream *pStream = reader.formatContext()->streams[iStream];
+  double sampleDuration = this->sampleDuration();
+
+  // the sample is decoded from memory, so only decoding is measured
+  QVector<AVPacket*> packetList;
+  double firstTime = std::numeric_limits<double>::quiet_NaN();
+  AVPacket *packet = av_packet_alloc();
+  while(packetList.size() < g_maxSamplePacketCount && reader.readPacket(packet))
+  {
+    double time = reader.packetTime(packet);
+    if(std::isnan(firstTime))
+      firstTime = time;
+    if(time - firstTime > sampleDuration)
+    {
+      av_packet_unref(packet);
+      break;
+    }
+    packetList.append(av_packet_clone(packet));
+    av_packet_unref(packet);
+  }
+  av_packet_free(&packet);
+
+  AVCodec *pCodec = avcodec_find_decoder(pStream->codecpar->codec_id);
+  if(!pCodec)
+  {
+    for(AVPacket *pPacket:packetList)
+      av_packet_free(&pPacket);
+    throw FFmpegError("Could not found available codec.");
+  }
+  QVector<int> threadTypeList;
+  if(pCodec->capabilities & AV_CODEC_CAP_SLICE_THREADS)
+    threadTypeList.append(FF_THREAD_SLICE);
+  if(pCodec->capabilities & AV_CODEC_CAP_FRAME_THREADS)
+    threadTypeList.append(FF_THREAD_FRAME);
+  if(threadTypeList.isEmpty())
+    threadTypeList.append(FF_THREAD_FRAME);
+  QVector<int> threadCountList{1};
+  for(int threadCount = 2; threadCount < av_cpu_count(); threadCount *= 2)
+    threadCountList.append(threadCount);
+  if(av_cpu_count() > 1)
+    threadCountList.append(av_cpu_count());
+
+  // candidates are measured cheapest first: fewer threads, then slice before frame threading
+  QVector<Profile> candidateList;
+  double bestFps = 0.0;
+  try
+  {
+    for(int threadCount:threadCountList)
+    {
+      for(int threadType:threadTypeList)
+      {
+        Profile profile;
+        profile.threadCount = threadCount;
+        profile.threadType = threadType;
+        profile.framesPerSecond = _measure(pStream, packetList, threadCount, threadType);
+        candidateList.append(profile);
+        bestFps = std::max(bestFps, profile.framesPerSecond);
+        if(threadCount == 1)
+          break;
+      }
+    }
+  }
+  catch(...)
+  {
+    for(AVPacket *pPacket:packetList)
+      av_packet_free(&pPacket);
+    throw;
+  }
+  for(AVPacket *pPacket:packetList)
+    av_packet_free(&pPacket);
+
+  Profile chosen = candidateList.first();
+  for(const Profile &profile:candidateList)
+  {
+    if(profile.framesPerSecond >= bestFps * g_fpsTolerance)
+    {
+      chosen = profile;
+      break;
+    }
+  }
+  m_locker.lock();
+  _load_lockfree();
+  m_profileDict.insert(_makeKey(pStream->codecpar), chosen);
+  _save_lockfree();
+  m_locker.unlock();
+  return chosen;
+}
+
+void AVDecoderTuner::requestTune(const QString &path, int iStream, const AVCodecParameters *pCodecPar)
+{
+  Q_ASSERT(iStream >= 0 && pCodecPar);
+  QString key = _makeKey(pCodecPar);
+  QMutexLocker locker(&m_locker);
+  _load_lockfree();
+  if(m_profileDict.contains(key) || m_pendingKeySet.contains(key))
+    return;
+  m_pendingKeySet.insert(key);
+  m_pool.start(new TuneJob(this, path, iStream, key));
+}
+
+bool AVDecoderTuner::waitForDone(int msecs)
+{ return m_pool.waitForDone(msecs); }
+
+void AVDecoderTuner::clear()
+{
+  QMutexLocker locker(&m_locker);
+  m_profileDict.clear();
+  m_loaded = true;
+  _save_lockfree();
+}
+
+QString AVDecoderTuner::_makeKey(const AVCodecParameters *pCodecPar)
+{
+  // pixel format and profile change the decoding cost as much as the size, e.g. 10 bit or 4:4:4 streams
+  return QStringLiteral("%1/%2x%3/%4/%5").arg(QString::fromUtf8(avcodec_get_name(pCodecPar->codec_id))).arg(pCodecPar->width).arg(pCodecPar->height)
+                                         .arg(pCodecPar->format).arg(pCodecPar->profile);
+}
+
+double AVDecoderTuner::_measure(const AVStream *pStream, const QVector<AVPacket*> &packetList, int threadCount, int threadType)
+{
+  AVCodec *pCodec = avcodec_find_decoder(pStream->codecpar->codec_id);
+  AVCodecContext *pCodecCtx = avcodec_alloc_context3(pCodec);
+  if(!pCodecCtx)
+    throw FFmpegError("Could not alloc codec context.");
+  AVFrame *pFrame = av_frame_alloc();
+  qint64 frameCount = 0;
+  QElapsedTimer timer;
+  try
+  {
+    int parToCtxResult = avcodec_parameters_to_context(pCodecCtx, pStream->codecpar);
+    CHECK_AVRESULT(parToCtxResult, parToCtxResult >= 0);
+    av_codec_set_pkt_timebase(pCodecCtx, pStream->time_base);
+    pCodecCtx->thread_count = threadCount;
+    pCodecCtx->thread_type = threadType;
+    lockFFmpeg();
+    int codecOpenResult = avcodec_open2(pCodecCtx, pCodec, nullptr);
+    unlockFFmpeg();
+    CHECK_AVRESULT(codecOpenResult, codecOpenResult == 0);
+
+    timer.start();
+    for(int i = 0; i <= packetList.size(); ++i)
+    {
+      // a null packet at the end drains the frame threads
+      avcodec_send_packet(pCodecCtx, i < packetList.size() ? packetList.at(i) : nullptr);
+      while(avcodec_receive_frame(pCodecCtx, pFrame) == 0)
+      {
+        ++frameCount;
+        av_frame_unref(pFrame);
+      }
+    }
+  }
+  catch(...)
+  {
+    av_frame_free(&pFrame);
+    avcodec_free_context(&pCodecCtx);
+    throw;
+  }
+  qint64 elapsed = timer.nsecsElapsed();
+  av_frame_free(&pFrame);
+  avcodec_close(pCodecCtx);
+  avcodec_free_context(&pCodecCtx);
+  return elapsed > 0 ? static_cast<double>(frameCount) * 1e9 / static_cast<double>(elapsed) : 0.0;
+}
+
+void AVDecoderTuner::_load_lockfree() const
+{
+  if(m_loaded)
+    return;
+  m_loaded = true;
+  QFile file(m_profilePath);
+  if(!file.open(QFile::ReadOnly))
+    return;
+  QJsonObject root = QJsonDocument::fromJson(file.readAll()).object();
+  for(auto it = root.constBegin(); it != root.constEnd(); ++it)
+  {
+    QJsonObject object = it.value().toObject();
+    Profile profile;
+    profile.threadCount = object.value(QStringLiteral("threadCount")).toInt();
+    profile.threadType = object.value(QStringLiteral("threadType")).toString() == QStringLiteral("slice") ? FF_THREAD_SLICE : FF_THREAD_FRAME;
+    profile.framesPerSecond = object.value(QStringLiteral("framesPerSecond")).toDouble();
+    if(profile.threadCount > 0)
+      m_profileDict.insert(it.key(), profile);
+  }
+}
+
+void AVDecoderTuner::_save_lockfree()
+{
+  QJsonObject root;
+  for(auto it = m_profileDict.constBegin(); it != m_profileDict.constEnd(); ++it)
+  {
+    QJsonObject object;
+    object.insert(QStringLiteral("threadCount"), it.value().threadCount);
+    object.insert(QStringLiteral("threadType"), it.value().threadType == FF_THREAD_SLICE ? QStringLiteral("slice") : QStringLiteral("frame"));
+    object.insert(QStringLiteral("framesPerSecond"), it.value().framesPerSecond);
+    root.insert(it.key(), object);
+  }
+  QDir().mkpath(QFileInfo(m_profilePath).absolutePath());
+  QFile file(m_profilePath);
+  if(!file.open(QFile::WriteOnly | QFile::Truncate))
+  {
+    qWarning()<<"Failed to save decoder profiles:"<<m_profilePath;
+    return;
+  }
+  file.write(QJsonDocument(root).toJson());
+}
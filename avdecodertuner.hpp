@@ -0,0 +1,74 @@
+#pragma once
+
+#include <QString>
+#include <QHash>
+#include <QSet>
+#include <QMutex>
+#include <QThreadPool>
+#include <QVector>
+
+extern "C"
+{
+#include <libavutil/avutil.h>
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+// Measured codec threading per video codec and resolution. tune() decodes
+// the first seconds of a file once per candidate thread count and type and
+// keeps the cheapest configuration within a few percent of the fastest, so
+// slice threading (no added latency) and fewer threads win ties. Profiles
+// are stored as JSON and used by every decoder opened with automatic
+// thread count or type afterwards.
+class AVDecoderTuner final
+{
+public:
+  struct Profile
+  {
+    int threadCount;
+    int threadType;  // FF_THREAD_FRAME or FF_THREAD_SLICE
+    double framesPerSecond;
+  };
+
+  static AVDecoderTuner *instance();
+
+  AVDecoderTuner();
+  ~AVDecoderTuner();
+
+  // With auto tuning, opening a video stream without a profile measures one
+  // in the background for the next open.
+  void setAutoTuneEnabled(bool v);
+  bool isAutoTuneEnabled() const;
+
+  void setSampleDuration(double seconds);
+  double sampleDuration() const;
+
+  // defaults to decoder-profiles.json in the application data location
+  void setProfilePath(const QString &path);
+  QString profilePath() const;
+
+  bool lookup(const AVCodecParameters *pCodecPar, Profile *pOut) const;
+  // a negative stream index measures the best video stream of the file
+  Profile tune(const QString &path, int iStream = -1);
+  void requestTune(const QString &path, int iStream, const AVCodecParameters *pCodecPar);
+  bool waitForDone(int msecs = -1);
+  void clear();
+
+private:
+  class TuneJob;
+
+  static QString _makeKey(const AVCodecParameters *pCodecPar);
+  static double _measure(const AVStream *pStream, const QVector<AVPacket*> &packetList, int threadCount, int threadType);
+  void _load_lockfree() const;
+  void _save_lockfree();
+
+  bool m_autoTuneEnabled;
+  double m_sampleDuration;
+  QString m_profilePath;
+  mutable bool m_loaded;
+  mutable QHash<QString, Profile> m_profileDict;
+  QSet<QString> m_pendingKeySet;
+
+  mutable QMutex m_locker;
+  QThreadPool m_pool;
+};
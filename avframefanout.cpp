@@ -0,0 +1,224 @@
+#include "avframefanout.hpp"
+#include "avframeprovider.hpp"
+#include <QElapsedTimer>
+
+bool AVFrameFanout::Consumer::take(AVFrameRef *pOut, int timeout)
+{
+  Q_ASSERT(pOut);
+  QElapsedTimer timer;
+  timer.start();
+
+  QMutexLocker locker(&m_locker);
+  ++m_userCount;
+  while(m_queue.isEmpty() && !m_finished && !m_closed)
+  {
+    if(timeout < 0)
+      m_notEmpty.wait(&m_locker);
+    else
+    {
+      qint64 remaining = timeout - timer.elapsed();
+      if(remaining <= 0 || !m_notEmpty.wait(&m_locker, static_cast<unsigned long>(remaining)))
+        break;
+    }
+  }
+  bool taken = !m_closed && !m_queue.isEmpty();
+  if(taken)
+  {
+    *pOut = m_queue.dequeue();
+    m_notFull.wakeAll();
+  }
+  if(--m_userCount == 0)
+    m_idle.wakeAll();
+  return taken;
+}
+
+bool AVFrameFanout::Consumer::tryTake(AVFrameRef *pOut)
+{ return take(pOut, 0); }
+
+void AVFrameFanout::Consumer::clear()
+{
+  QMutexLocker locker(&m_locker);
+  m_queue.clear();
+  m_notFull.wakeAll();
+}
+
+int AVFrameFanout::Consumer::capacity() const
+{ return m_capacity; }
+
+AVFrameFanout::BackpressurePolicy AVFrameFanout::Consumer::policy() const
+{ return m_policy; }
+
+int AVFrameFanout::Consumer::pendingCount() const
+{
+  QMutexLocker locker(&m_locker);
+  return m_queue.size();
+}
+
+qint64 AVFrameFanout::Consumer::droppedCount() const
+{
+  QMutexLocker locker(&m_locker);
+  return m_droppedCount;
+}
+
+bool AVFrameFanout::Consumer::isFinished() const
+{
+  QMutexLocker locker(&m_locker);
+  return m_finished && m_queue.isEmpty();
+}
+
+AVFrameFanout::Consumer::Consumer(int capacity, AVFrameFanout::BackpressurePolicy policy, bool acceptAudio, bool acceptVideo)
+{
+  Q_ASSERT(capacity > 0);
+  m_capacity = capacity;
+  m_policy = policy;
+  m_acceptAudio = acceptAudio;
+  m_acceptVideo = acceptVideo;
+  m_droppedCount = 0;
+  m_finished = false;
+  m_closed = false;
+  m_userCount = 0;
+}
+
+bool AVFrameFanout::Consumer::_accepts(bool isAudio) const
+{ return isAudio ? m_acceptAudio : m_acceptVideo; }
+
+void AVFrameFanout::Consumer::_push(const AVFrameRef &frame, AVFrameFanout *fanout)
+{
+  QMutexLocker locker(&m_locker);
+  while(m_queue.size() >= m_capacity && !m_closed)
+  {
+    if(m_policy == DropOldest)
+    {
+      m_queue.dequeue();
+      ++m_droppedCount;
+    }
+    else if(m_policy == DropNewest)
+    {
+      ++m_droppedCount;
+      return;
+    }
+    else
+    {
+      // wake up regularly, the fanout may be asked to stop while a consumer stalls
+      m_notFull.wait(&m_locker, 50);
+      if(fanout->isInterruptionRequested())
+        return;
+    }
+  }
+  if(m_closed)
+    return;
+  m_queue.enqueue(frame);
+  m_notEmpty.wakeAll();
+}
+
+void AVFrameFanout::Consumer::_finish()
+{
+  QMutexLocker locker(&m_locker);
+  m_finished = true;
+  m_notEmpty.wakeAll();
+}
+
+void AVFrameFanout::Consumer::_ref()
+{
+  QMutexLocker locker(&m_locker);
+  ++m_userCount;
+}
+
+void AVFrameFanout::Consumer::_unref()
+{
+  QMutexLocker locker(&m_locker);
+  if(--m_userCount == 0)
+    m_idle.wakeAll();
+}
+
+void AVFrameFanout::Consumer::_closeAndWait()
+{
+  QMutexLocker locker(&m_locker);
+  m_closed = true;
+  m_queue.clear();
+  m_notEmpty.wakeAll();
+  m_notFull.wakeAll();
+  while(m_userCount > 0)
+    m_idle.wait(&m_locker);
+}
+
+AVFrameFanout::AVFrameFanout(AVFrameProvider *provider, QObject *parent) : QThread(parent)
+{
+  Q_ASSERT(provider);
+  m_provider = provider;
+}
+
+AVFrameFanout::~AVFrameFanout()
+{
+  requestStop(false);
+  for(Consumer *consumer:m_consumerList)
+  {
+    consumer->_closeAndWait();
+    delete consumer;
+  }
+}
+
+AVFrameFanout::Consumer *AVFrameFanout::addConsumer(int capacity, AVFrameFanout::BackpressurePolicy policy, bool acceptAudio, bool acceptVideo)
+{
+  auto consumer = new Consumer(capacity, policy, acceptAudio, acceptVideo);
+  m_consumerLocker.lock();
+  m_consumerList.append(consumer);
+  m_consumerLocker.unlock();
+  return consumer;
+}
+
+void AVFrameFanout::removeConsumer(AVFrameFanout::Consumer *consumer)
+{
+  m_consumerLocker.lock();
+  bool removed = m_consumerList.removeOne(consumer);
+  m_consumerLocker.unlock();
+  Q_ASSERT(removed);
+  Q_UNUSED(removed);
+  // the producer or a reader may still be inside, they leave once they see it closed
+  consumer->_closeAndWait();
+  delete consumer;
+}
+
+void AVFrameFanout::requestStop(bool async)
+{
+  requestInterruption();
+  if(!async)
+    wait();
+}
+
+void AVFrameFanout::run()
+{
+  if(!m_provider->isDecoderRunning() && !m_provider->isFinished())
+    m_provider->startDecoder(true);
+
+  while(!isInterruptionRequested())
+  {
+    if(!m_provider->nextFrame())
+      break;
+    AVFrameRef frame = m_provider->currentFrameRef();
+    bool isAudio = m_provider->currentFrameType() == AVFrameProvider::AudioFrame;
+
+    // a blocking consumer must not hold the list, so the targets are pinned and pushed to without it
+    QList<Consumer*> targetList;
+    m_consumerLocker.lock();
+    for(Consumer *consumer:m_consumerList)
+    {
+      if(consumer->_accepts(isAudio))
+      {
+        consumer->_ref();
+        targetList.append(consumer);
+      }
+    }
+    m_consumerLocker.unlock();
+    for(Consumer *consumer:targetList)
+    {
+      consumer->_push(frame, this);
+      consumer->_unref();
+    }
+  }
+
+  m_consumerLocker.lock();
+  for(Consumer *consumer:m_consumerList)
+    consumer->_finish();
+  m_consumerLocker.unlock();
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QList>
+#include "avframeref.hpp"
+
+class AVFrameProvider;
+
+// Pulls frames from one AVFrameProvider and hands references of them to
+// several independent consumers, each with its own queue and backpressure policy.
+// removeConsumer() closes the consumer, wakes everyone waiting on it and only
+// deletes it once they have left; it must not be used afterwards.
+class AVFrameFanout final : public QThread
+{
+  Q_OBJECT
+
+public:
+  enum BackpressurePolicy
+  {
+    BlockProducer = 0,
+    DropOldest,
+    DropNewest
+  };
+
+  class Consumer final
+  {
+  public:
+    bool take(AVFrameRef *pOut, int timeout = -1);
+    bool tryTake(AVFrameRef *pOut);
+    void clear();
+
+    int capacity() const;
+    BackpressurePolicy policy() const;
+    int pendingCount() const;
+    qint64 droppedCount() const;
+    bool isFinished() const;
+
+  private:
+    friend class AVFrameFanout;
+
+    Consumer(int capacity, BackpressurePolicy policy, bool acceptAudio, bool acceptVideo);
+    bool _accepts(bool isAudio) const;
+    void _push(const AVFrameRef &frame, AVFrameFanout *fanout);
+    void _finish();
+    void _ref();
+    void _unref();
+    void _closeAndWait();
+
+    int m_capacity;
+    BackpressurePolicy m_policy;
+    bool m_acceptAudio, m_acceptVideo;
+    QQueue<AVFrameRef> m_queue;
+    qint64 m_droppedCount;
+    bool m_finished;
+    bool m_closed;
+    // threads inside take() or _push(), the consumer is deleted only after they left
+    int m_userCount;
+
+    mutable QMutex m_locker;
+    QWaitCondition m_notEmpty, m_notFull, m_idle;
+  };
+
+  AVFrameFanout(AVFrameProvider *provider, QObject *parent = nullptr);
+  ~AVFrameFanout();
+
+  Consumer *addConsumer(int capacity, BackpressurePolicy policy, bool acceptAudio = true, bool acceptVideo = true);
+  void removeConsumer(Consumer *consumer);
+
+  void requestStop(bool async = true);
+
+protected:
+  void run() override;
+
+private:
+  AVFrameProvider *m_provider;
+  QList<Consumer*> m_consumerList;
+
+  QMutex m_consumerLocker;
+};
@@ -2,17 +2,41 @@
 #include "avseeker.hpp"
 #include "avpacketprovider.hpp"
 #include "avpacketdecoder.hpp"
+#include "avpresentationclock.hpp"
+#include "avreversedecoder.hpp"
+#include "avdecodertuner.hpp"
+#include "avspectrumanalyzer.hpp"
 #include "privateutil.hpp"
 #include <QDebug>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
 
-IMPL_EXCEPTION(IOError, std::runtime_error)
-IMPL_EXCEPTION(NoStreamError, std::runtime_error)
+namespace
+{
+  // a GOP decoded backwards should never take longer, a stuck worker must not hang the caller
+  const int g_reverseFrameTimeout = 5000;
+}
 
-AVFrameProvider::AVFrameProvider(const QString &path, bool enableAudio, bool enableVideo)
+AVFrameProvider::AVFrameProvider(const QString &path, bool enableAudio, bool enableVideo, int decoderThreadCount, int decoderThreadType)
 {
-  m_path = path;
+  _initialize(decoderThreadCount, decoderThreadType);
+  _open(new AVInputContext(path), enableAudio, enableVideo);
+
+  if(m_pVideoStream && (decoderThreadCount <= 0 || decoderThreadType <= 0) && AVDecoderTuner::instance()->isAutoTuneEnabled())
+    AVDecoderTuner::instance()->requestTune(path, m_iVideoStream, m_pVideoStream->codecpar);
+}
+
+AVFrameProvider::AVFrameProvider(const AVMemorySource &source, bool enableAudio, bool enableVideo, int decoderThreadCount, int decoderThreadType)
+{
+  _initialize(decoderThreadCount, decoderThreadType);
+  _open(new AVInputContext(source), enableAudio, enableVideo);
+}
 
-  m_pIOCtx = nullptr;
+void AVFrameProvider::_initialize(int decoderThreadCount, int decoderThreadType)
+{
+  m_input = nullptr;
   m_pFormatCtx = nullptr;
   m_iAudioStream = AVERROR_STREAM_NOT_FOUND;
   m_iVideoStream = AVERROR_STREAM_NOT_FOUND;
@@ -22,6 +46,12 @@ AVFrameProvider::AVFrameProvider(const QString &path, bool enableAudio, bool ena
   m_seeker = nullptr;
   m_packetProvider = nullptr;
   m_packetDecoder = nullptr;
+  m_decoderThreadCount = decoderThreadCount;
+  m_decoderThreadType = decoderThreadType;
+  m_decodeMode = AutoDecode;
+  m_decodeQuality = FullQuality;
+  m_threadRole = AVThreadPolicy::PlaybackRole;
+  m_inlineDecoding = false;
 
   m_currentFrameType = UnknownFrame;
   m_currentAudioFrame = nullptr;
@@ -32,156 +62,447 @@ AVFrameProvider::AVFrameProvider(const QString &path, bool enableAudio, bool ena
   m_audioFinished = false;
   m_videoFinished = false;
 
-  m_file.setFileName(path);
-  if(!m_file.open(QFile::ReadOnly))
+  m_clock = nullptr;
+  m_nonReferenceDropLag = 0.1;
+  m_keyframeDropLag = 0.5;
+  m_videoSkipFrame = AVDISCARD_DEFAULT;
+  m_awaitingKeyframe = false;
+  resetDropStatistics();
+
+  m_iAudioHistoryReplay = 0;
+  m_audioHistorySampleCount = 0;
+  m_audioHistoryByteCount = 0;
+  m_audioHistoryMaxDuration = 0.0;
+  m_audioHistoryMaxBytes = 0;
+  m_audioHistoryAtEnd = false;
+
+  m_spectrumAnalyzer = nullptr;
+
+  m_reverseDecoder = nullptr;
+  m_reversePlayback = false;
+  m_reverseCacheSize = 64;
+  m_reversePts = 0.0;
+  m_reverseSeekPts = std::numeric_limits<double>::quiet_NaN();
+
+  m_hibernated = false;
+  m_hibernatedRunning = false;
+  m_hibernatedQueueSize = 0;
+  m_demuxPos = 0;
+  m_deliveredSinceSeek = false;
+}
+
+void AVFrameProvider::_open(AVInputContext *input, bool enableAudio, bool enableVideo)
+{
+  m_input = input;
+  m_pFormatCtx = m_input->formatContext();
+  m_demuxPos = m_pFormatCtx->start_time != AV_NOPTS_VALUE ? m_pFormatCtx->start_time : 0;
+
+  // select first audio and video stream by default
+  QList<int> streamIndexList;
   {
-    qCritical()<<"Failed to open file for reading:"<<path;
-    throw IOError("Failed to open file for reading.");
+    int iVideoStream = enableVideo ? findStream(AVMEDIA_TYPE_VIDEO) : -1;
+    int iAudioStream = enableAudio ? findStream(AVMEDIA_TYPE_AUDIO) : -1;
+    if(iVideoStream >= 0)
+      streamIndexList.append(iVideoStream);
+    if(iAudioStream >= 0)
+      streamIndexList.append(iAudioStream);
   }
 
-  // create io context
+  m_seeker = new AVSeeker(m_pFormatCtx);
+  selectStreams(streamIndexList);
+}
+
+AVFrameProvider::~AVFrameProvider()
+{
+  m_input->setTailAbort(true);
+  if(m_reverseDecoder)
+    delete m_reverseDecoder;
+  if(m_packetDecoder)
   {
-    m_pIOCtx = avio_alloc_context(m_ioBuffer, sizeof(m_ioBuffer), 0, reinterpret_cast<void*>(this), &_ioReadPacket, nullptr, &_ioSeek);
-    if(!m_pIOCtx)
-      throw FFmpegError("Cannot create ffmpeg io context.");
+    m_packetDecoder->locker()->lock();
+    m_packetDecoder->requestInterruption();
+    m_packetDecoder->requestWakeUp_lockfree();
+    m_packetDecoder->locker()->unlock();
+    m_packetDecoder->wait();
+    delete m_packetDecoder;
   }
 
-  // open file
+  if(m_packetProvider)
   {
-    // probe
-    qint64 realReadSize = m_file.read(reinterpret_cast<char*>(m_ioBuffer), sizeof(m_ioBuffer));
-    if(realReadSize < 0)
-    {
-      qCritical("Cannot read file header.");
-      throw IOError("Cannot read file header.");
-    }
-    m_file.seek(0);
+    m_packetProvider->locker()->lock();
+    m_packetProvider->requestInterruption();
+    m_packetProvider->requestWakeUp_lockfree();
+    m_packetProvider->locker()->unlock();
+    m_packetProvider->wait();
+    delete m_packetProvider;
+  }
+  if(m_seeker)
+  {
+    m_seeker->wait();
+    delete m_seeker;
+  }
+  if(m_currentVideoFrame)
+  {
+    av_frame_unref(m_currentVideoFrame);
+    av_frame_free(&m_currentVideoFrame);
+  }
+  if(m_currentAudioFrame)
+  {
+    av_frame_unref(m_currentAudioFrame);
+    av_frame_free(&m_currentAudioFrame);
+  }
+  for(AVFrame *pFrame:m_extraFrameDict)
+    av_frame_free(&pFrame);
+  _clearAudioHistory();
+  _clearPreroll();
+  delete m_input;
+}
 
-    AVProbeData probeData;
-    memset(reinterpret_cast<void*>(&probeData), 0, sizeof(probeData));
-    probeData.buf = m_ioBuffer;
-    probeData.buf_size = realReadSize;
-    probeData.filename = "aaa";
-    AVInputFormat *pInputFormat = av_probe_input_format(&probeData, 1);
-    if(!pInputFormat)
-      throw IOError("Unsupported input format");
+bool AVFrameProvider::warmUp(const QString &path, qint64 headSize, qint64 tailSize, bool probe)
+{ return AVInputContext::warmUp(path, headSize, tailSize, probe); }
 
-    // open context
-    m_pFormatCtx = avformat_alloc_context();
-    if(!m_pFormatCtx)
-      throw FFmpegError("Cannot create ffmpeg format context.");
-    m_pFormatCtx->pb = m_pIOCtx;
-    m_pFormatCtx->iformat = pInputFormat;
-    m_pFormatCtx->flags = AVFMT_FLAG_CUSTOM_IO;
+QString AVFrameProvider::path() const
+{ return m_input->path(); }
 
-    int openFileResult = avformat_open_input(&m_pFormatCtx, "", nullptr, nullptr);
-    CHECK_AVRESULT(openFileResult, openFileResult == 0);
-  }
+QString AVFrameProvider::formatName() const
+{ return QString::fromUtf8(m_pFormatCtx->iformat->name); }
+
+qint64 AVFrameProvider::bitRate() const
+{ return m_pFormatCtx->bit_rate; }
 
-  // initialize stream info
+QVector<AVFrameProvider::StreamInfo> AVFrameProvider::streamInfoList() const
+{
+  QVector<StreamInfo> streamInfoList;
+  for(int i = 0; i < static_cast<int>(m_pFormatCtx->nb_streams); ++i)
   {
-    int findStreamInfoResult = avformat_find_stream_info(m_pFormatCtx, nullptr);
-    CHECK_AVRESULT(findStreamInfoResult, findStreamInfoResult >= 0);
+    AVStream *pStream = m_pFormatCtx->streams[i];
+    StreamInfo info;
+    info.index = i;
+    info.type = pStream->codecpar->codec_type;
+    info.codecId = pStream->codecpar->codec_id;
+    AVDictionaryEntry *pLanguage = av_dict_get(pStream->metadata, "language", nullptr, 0);
+    info.language = pLanguage ? QString::fromUtf8(pLanguage->value) : QString();
+    AVDictionaryEntry *pTitle = av_dict_get(pStream->metadata, "title", nullptr, 0);
+    info.title = pTitle ? QString::fromUtf8(pTitle->value) : QString();
+    info.selected = pStream->discard != AVDISCARD_ALL;
+    streamInfoList.append(info);
   }
+  return streamInfoList;
+}
 
-  // get stream, copy codec context
+int AVFrameProvider::findStream(AVMediaType type, const QString &language) const
+{
   for(int i = 0; i < static_cast<int>(m_pFormatCtx->nb_streams); ++i)
   {
     AVStream *pStream = m_pFormatCtx->streams[i];
+    if(pStream->codecpar->codec_type != type)
+      continue;
+    if(!language.isEmpty())
+    {
+      AVDictionaryEntry *pLanguage = av_dict_get(pStream->metadata, "language", nullptr, 0);
+      if(!pLanguage || language.compare(QString::fromUtf8(pLanguage->value), Qt::CaseInsensitive) != 0)
+        continue;
+    }
+    return i;
+  }
+  return -1;
+}
+
+void AVFrameProvider::selectStreams(const QList<int> &streamIndexList)
+{
+  if(m_packetDecoder && isDecoderRunning())
+  {
+    qWarning("Selecting streams on decoder running.");
+    stopDecoder(false);
+  }
 
-    if(enableVideo && !m_pVideoStream && pStream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+  int queueSize = m_hibernated ? m_hibernatedQueueSize : _destroyPipeline();
+  m_hibernated = false;
+  _clearPreroll();
+  for(AVFrame *pFrame:m_extraFrameDict)
+    av_frame_free(&pFrame);
+  m_extraFrameDict.clear();
+  m_extraFinishedSet.clear();
+  _clearAudioHistory();
+  if(m_reverseDecoder)
+  {
+    delete m_reverseDecoder;
+    m_reverseDecoder = nullptr;
+  }
+
+  // the first audio and video stream become the main streams, further ones are extra streams
+  m_iAudioStream = AVERROR_STREAM_NOT_FOUND;
+  m_iVideoStream = AVERROR_STREAM_NOT_FOUND;
+  m_pAudioStream = nullptr;
+  m_pVideoStream = nullptr;
+  AVPacketProvider::StreamSet streamSet;
+  for(int iStream:streamIndexList)
+  {
+    if(iStream < 0 || iStream >= static_cast<int>(m_pFormatCtx->nb_streams))
     {
-      if(pStream->codecpar)
-      {
-        m_iVideoStream = i;
-        m_pVideoStream = pStream;
-      }
-      else
-        qWarning("Unsupported video codec at stream #%d.", i);
+      qCritical("Invalid stream #%d.", iStream);
+      throw NoStreamError("Invalid stream.");
     }
-    else if(enableAudio && !m_pAudioStream && pStream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+    if(streamSet.contains(iStream))
+      continue;
+    AVStream *pStream = m_pFormatCtx->streams[iStream];
+    AVMediaType type = pStream->codecpar->codec_type;
+    if(type == AVMEDIA_TYPE_VIDEO && !m_pVideoStream)
     {
-      if(pStream->codecpar)
-      {
-        m_iAudioStream = i;
-        m_pAudioStream = pStream;
-      }
-      else
-        qWarning("Unsupported audio codec at stream #%d.", i);
+      m_iVideoStream = iStream;
+      m_pVideoStream = pStream;
+    }
+    else if(type == AVMEDIA_TYPE_AUDIO && !m_pAudioStream)
+    {
+      m_iAudioStream = iStream;
+      m_pAudioStream = pStream;
     }
+    else if(type == AVMEDIA_TYPE_VIDEO || type == AVMEDIA_TYPE_AUDIO)
+      m_extraFrameDict.insert(iStream, av_frame_alloc());
     else
-      qWarning("Unsupported stream #%d.", i);
+    {
+      qCritical("Unsupported stream #%d.", iStream);
+      throw NoStreamError("Unsupported stream.");
+    }
+    streamSet.insert(iStream);
   }
 
   // check stream
   if(!m_pAudioStream && !m_pVideoStream)
     throw NoStreamError("No stream available.");
 
+  // let the demuxer skip everything not selected
+  for(int i = 0; i < static_cast<int>(m_pFormatCtx->nb_streams); ++i)
+    m_pFormatCtx->streams[i]->discard = streamSet.contains(i) ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+
   // alloc frame
-  if(m_pVideoStream)
+  if(m_pVideoStream && !m_currentVideoFrame)
     m_currentVideoFrame = av_frame_alloc();
-  if(m_pAudioStream)
+  else if(!m_pVideoStream && m_currentVideoFrame)
+    av_frame_free(&m_currentVideoFrame);
+  if(m_pAudioStream && !m_currentAudioFrame)
     m_currentAudioFrame = av_frame_alloc();
+  else if(!m_pAudioStream && m_currentAudioFrame)
+    av_frame_free(&m_currentAudioFrame);
+  m_currentFrameType = UnknownFrame;
+  m_audioFinished = false;
+  m_videoFinished = false;
 
-  m_seeker = new AVSeeker(m_pFormatCtx);
+  _createPipeline(queueSize);
+}
+
+QList<int> AVFrameProvider::selectedStreams() const
+{
+  QList<int> streamIndexList;
+  for(int i = 0; i < static_cast<int>(m_pFormatCtx->nb_streams); ++i)
   {
-    AVPacketProvider::StreamSet streamSet;
-    if(m_pVideoStream)
-      streamSet.insert(m_iVideoStream);
-    if(m_pAudioStream)
-      streamSet.insert(m_iAudioStream);
-    m_packetProvider = new AVPacketProvider(m_pFormatCtx, streamSet);
-    m_packetDecoder = new AVPacketDecoder(m_packetProvider, m_pFormatCtx, streamSet);
+    if(m_pFormatCtx->streams[i]->discard != AVDISCARD_ALL)
+      streamIndexList.append(i);
   }
+  return streamIndexList;
 }
 
-AVFrameProvider::~AVFrameProvider()
+void AVFrameProvider::setTailMode(bool enabled, int idleTimeout)
+{ m_input->setTailMode(enabled, idleTimeout); }
+
+bool AVFrameProvider::isTailMode() const
+{ return m_input->isTailMode(); }
+
+int AVFrameProvider::tailIdleTimeout() const
+{ return m_input->tailIdleTimeout(); }
+
+void AVFrameProvider::setPresentationClock(AVPresentationClock *clock)
 {
+  m_clock = clock;
+  if(!m_clock && m_pVideoStream && m_packetDecoder && m_videoSkipFrame != AVDISCARD_DEFAULT)
+  {
+    m_packetDecoder->locker()->lock();
+    m_packetDecoder->setSkipFrame_lockfree(m_iVideoStream, AVDISCARD_DEFAULT);
+    m_packetDecoder->locker()->unlock();
+    m_videoSkipFrame = AVDISCARD_DEFAULT;
+  }
+}
+
+AVPresentationClock *AVFrameProvider::presentationClock() const
+{ return m_clock; }
+
+void AVFrameProvider::setFrameDropThreshold(double nonReferenceLag, double keyframeLag)
+{
+  Q_ASSERT(nonReferenceLag >= 0.0 && keyframeLag >= nonReferenceLag);
+  m_nonReferenceDropLag = nonReferenceLag;
+  m_keyframeDropLag = keyframeLag;
+}
+
+AVFrameProvider::DropStatistics AVFrameProvider::dropStatistics() const
+{
+  DropStatistics statistics = m_dropStatistics;
   if(m_packetDecoder)
   {
     m_packetDecoder->locker()->lock();
-    m_packetDecoder->requestInterruption();
-    m_packetDecoder->requestWakeUp_lockfree();
+    statistics.droppedVideoPacketCount = m_packetDecoder->droppedPacketCount_lockfree(m_iVideoStream);
     m_packetDecoder->locker()->unlock();
-    m_packetDecoder->wait();
-    delete m_packetDecoder;
   }
+  return statistics;
+}
 
-  if(m_packetProvider)
+void AVFrameProvider::resetDropStatistics()
+{
+  memset(&m_dropStatistics, 0, sizeof(m_dropStatistics));
+}
+
+void AVFrameProvider::setDecodeQuality(AVFrameProvider::DecodeQuality v)
+{
+  if(m_decodeQuality != v)
   {
-    m_packetProvider->locker()->lock();
-    m_packetProvider->requestInterruption();
-    m_packetProvider->requestWakeUp_lockfree();
-    m_packetProvider->locker()->unlock();
-    m_packetProvider->wait();
-    delete m_packetProvider;
+    m_decodeQuality = v;
+    _applyDecodeQuality();
   }
-  if(m_seeker)
+}
+
+AVFrameProvider::DecodeQuality AVFrameProvider::decodeQuality() const
+{ return m_decodeQuality; }
+
+void AVFrameProvider::setThreadRole(AVThreadPolicy::Role v)
+{
+  m_threadRole = v;
+  m_seeker->setThreadRole(v == AVThreadPolicy::PlaybackRole ? v : AVThreadPolicy::SeekRole);
+  if(m_hibernated)
+    return;
+  // applied by the threads on their next wakeup, waking them here would end their packet waits early
+  m_packetProvider->setThreadRole(v);
+  m_packetDecoder->setThreadRole(v);
+}
+
+AVThreadPolicy::Role AVFrameProvider::threadRole() const
+{ return m_threadRole; }
+
+void AVFrameProvider::setPacketQueueSize(int v)
+{
+  if(m_hibernated)
   {
-    m_seeker->wait();
-    delete m_seeker;
+    m_hibernatedQueueSize = v;
+    return;
+  }
+  m_packetProvider->locker()->lock();
+  m_packetProvider->setQueueSize_lockfree(v);
+  m_packetProvider->locker()->unlock();
+}
+
+int AVFrameProvider::packetQueueSize() const
+{ return m_hibernated ? m_hibernatedQueueSize : m_packetProvider->queueSize_lockfree(); }
+
+void AVFrameProvider::setAudioHistoryLimit(double maxDuration, qint64 maxBytes)
+{
+  Q_ASSERT(maxDuration >= 0.0 && maxBytes >= 0);
+  m_audioHistoryMaxDuration = maxDuration;
+  m_audioHistoryMaxBytes = maxBytes;
+  if(maxDuration <= 0.0 && maxBytes <= 0)
+    _clearAudioHistory();
+  else
+    _trimAudioHistory();
+}
+
+double AVFrameProvider::audioHistoryDuration() const
+{
+  if(!hasAudio())
+    return 0.0;
+  return static_cast<double>(m_audioHistorySampleCount) / static_cast<double>(audioSamprate());
+}
+
+bool AVFrameProvider::replay(double seconds)
+{
+  Q_ASSERT(seconds >= 0.0);
+  return _seekAudioHistory(std::max(0.0, m_audioPts - seconds));
+}
+
+void AVFrameProvider::setSpectrumAnalyzer(AVSpectrumAnalyzer *analyzer)
+{ m_spectrumAnalyzer = analyzer; }
+
+AVSpectrumAnalyzer *AVFrameProvider::spectrumAnalyzer() const
+{ return m_spectrumAnalyzer; }
+
+void AVFrameProvider::hibernate(double prerollDuration)
+{
+  if(m_hibernated)
+    return;
+  m_hibernatedRunning = isDecoderRunning();
+  if(m_hibernatedRunning)
+    _capturePreroll(prerollDuration);
+
+  // decoder output resumes after the last prerolled or delivered frame
+  m_resumeSkipDict.clear();
+  if(m_pAudioStream)
+  {
+    if(m_prerollDict.contains(m_iAudioStream))
+      m_resumeSkipDict.insert(m_iAudioStream, _calcPts(m_pAudioStream, m_prerollDict.value(m_iAudioStream).last()));
+    else if(m_deliveredSinceSeek && m_currentAudioFrame->buf[0])
+      m_resumeSkipDict.insert(m_iAudioStream, m_audioPts);
   }
   if(m_pVideoStream)
   {
-    av_frame_unref(m_currentVideoFrame);
-    av_frame_free(&m_currentVideoFrame);
+    if(m_prerollDict.contains(m_iVideoStream))
+      m_resumeSkipDict.insert(m_iVideoStream, _calcPts(m_pVideoStream, m_prerollDict.value(m_iVideoStream).last()));
+    else if(m_deliveredSinceSeek && m_currentVideoFrame->buf[0])
+      m_resumeSkipDict.insert(m_iVideoStream, m_videoPts);
   }
-  if(m_pAudioStream)
+
+  // records the demux position from the packet queues before they are dropped
+  stopDecoder(false);
+  _clearAudioHistory();
+  if(m_reverseDecoder)
   {
-    av_frame_unref(m_currentAudioFrame);
-    av_frame_free(&m_currentAudioFrame);
+    delete m_reverseDecoder;
+    m_reverseDecoder = nullptr;
   }
-  if(m_pFormatCtx)
-    avformat_close_input(&m_pFormatCtx);
-  if(m_pIOCtx)
-    av_free(reinterpret_cast<AVIOContext*>(m_pIOCtx));
+  m_hibernatedQueueSize = _destroyPipeline();
+  m_hibernated = true;
 }
 
-QString AVFrameProvider::path() const
-{ return m_path; }
+void AVFrameProvider::resume()
+{
+  if(!m_hibernated)
+    return;
+  _createPipeline(m_hibernatedQueueSize);
+  m_hibernated = false;
+
+  // the demuxer may have read ahead even if nothing was delivered, so always seek back to the
+  // recorded position, or earlier when frames still sat in the decoder
+  qint64 pts = m_demuxPos;
+  if(!m_resumeSkipDict.isEmpty())
+  {
+    double time = *std::min_element(m_resumeSkipDict.cbegin(), m_resumeSkipDict.cend());
+    pts = std::min(pts, static_cast<qint64>(std::round(time * static_cast<double>(AV_TIME_BASE))));
+  }
+  av_seek_frame(m_pFormatCtx, -1, pts, AVSEEK_FLAG_BACKWARD);
+  m_demuxPos = pts;
+  if(m_hibernatedRunning)
+    startDecoder(true);
+}
+
+bool AVFrameProvider::isHibernated() const
+{ return m_hibernated; }
 
 void AVFrameProvider::seek(double time, bool async)
 {
+  // samples from before the seek would smear into the first windows after it
+  if(m_spectrumAnalyzer)
+    m_spectrumAnalyzer->reset();
+  if(_seekAudioHistory(time))
+    return;
+  _clearAudioHistory();
+  _clearPreroll();
+  if(m_hibernated)
+  {
+    _createPipeline(m_hibernatedQueueSize);
+    m_hibernated = false;
+  }
+  if(m_reverseDecoder)
+  {
+    // kept for reuse, the next previousVideoFrame() restarts it at the new position
+    m_reverseDecoder->requestStop(false);
+    m_reversePts = std::numeric_limits<double>::quiet_NaN();
+  }
+  m_reverseSeekPts = time;
   if(isDecoderRunning())
   {
     qWarning("Seeking on decoder running.");
@@ -190,7 +511,10 @@ void AVFrameProvider::seek(double time, bool async)
   m_seeker->wait();
   m_videoFinished = false;
   m_audioFinished = false;
+  m_extraFinishedSet.clear();
   qint64 pts = static_cast<qint64>(std::round(time * static_cast<double>(AV_TIME_BASE)));
+  m_demuxPos = pts;
+  m_deliveredSinceSeek = false;
   if(async)
   {
     m_seeker->setPos_lockfree(pts);
@@ -205,7 +529,28 @@ void AVFrameProvider::waitSeekDone()
 
 void AVFrameProvider::startDecoder(bool async)
 {
+  if(m_hibernated)
+  {
+    m_hibernatedRunning = true;
+    resume();
+    return;
+  }
   waitSeekDone();
+  m_input->setTailAbort(false);
+  if(m_inlineDecoding)
+  {
+    qCritical("Inline decoder is already running.");
+    return;
+  }
+  if(_shouldDecodeInline())
+  {
+    m_packetDecoder->setSingleThreaded(true);
+    m_packetDecoder->flush_inline();
+    m_inlineDecoding = true;
+    return;
+  }
+  if(!m_packetDecoder->isRunning())
+    m_packetDecoder->setSingleThreaded(false);
   if(!m_packetProvider->isRunning())
     m_packetProvider->requestStart();
   else
@@ -227,7 +572,22 @@ void AVFrameProvider::startDecoder(bool async)
 
 void AVFrameProvider::stopDecoder(bool async)
 {
+  if(m_hibernated)
+  {
+    m_hibernatedRunning = false;
+    return;
+  }
   waitSeekDone();
+  m_input->setTailAbort(true);
+  if(m_inlineDecoding)
+  {
+    m_inlineDecoding = false;
+    m_packetProvider->locker()->lock();
+    _recordDemuxPos_lockfree();
+    m_packetProvider->clearQueue_lockfree();
+    m_packetProvider->locker()->unlock();
+    return;
+  }
   m_packetDecoder->locker()->lock();
   m_packetDecoder->requestInterruption();
   m_packetDecoder->requestWakeUp_lockfree();
@@ -236,6 +596,7 @@ void AVFrameProvider::stopDecoder(bool async)
     m_packetDecoder->wait();
   m_packetProvider->locker()->lock();
   m_packetProvider->requestInterruption();
+  _recordDemuxPos_lockfree();
   m_packetProvider->clearQueue_lockfree();
   m_packetProvider->requestWakeUp_lockfree();
   m_packetProvider->locker()->unlock();
@@ -244,7 +605,16 @@ void AVFrameProvider::stopDecoder(bool async)
 }
 
 bool AVFrameProvider::isDecoderRunning() const
-{ return m_packetDecoder->isRunning() || m_packetProvider->isRunning(); }
+{ return !m_hibernated && (m_inlineDecoding || m_packetDecoder->isRunning() || m_packetProvider->isRunning()); }
+
+void AVFrameProvider::setDecodeMode(AVFrameProvider::DecodeMode v)
+{ m_decodeMode = v; }
+
+AVFrameProvider::DecodeMode AVFrameProvider::decodeMode() const
+{ return m_decodeMode; }
+
+bool AVFrameProvider::isInlineDecoding() const
+{ return m_inlineDecoding; }
 
 AVFrameProvider::FrameType AVFrameProvider::currentFrameType() const
 { return m_currentFrameType; }
@@ -265,8 +635,19 @@ const AVFrame *AVFrameProvider::currentAudioFrame() const
 const AVFrame *AVFrameProvider::currentVideoFrame() const
 { return m_currentVideoFrame; }
 
+AVFrameRef AVFrameProvider::currentFrameRef() const
+{ return AVFrameRef(currentFrame()); }
+
+AVFrameRef AVFrameProvider::currentAudioFrameRef() const
+{ return AVFrameRef(m_currentAudioFrame); }
+
+AVFrameRef AVFrameProvider::currentVideoFrameRef() const
+{ return AVFrameRef(m_currentVideoFrame); }
+
 bool AVFrameProvider::nextFrame()
 {
+  if(m_reversePlayback)
+    return previousVideoFrame();
   bool ok = false;
   while(!ok)
   {
@@ -288,28 +669,81 @@ bool AVFrameProvider::nextFrame()
   return true;
 }
 
+bool AVFrameProvider::nextStreamFrame(int iStream)
+{
+  if(iStream == m_iAudioStream)
+    return nextAudioFrame();
+  else if(iStream == m_iVideoStream)
+    return nextVideoFrame();
+
+  Q_ASSERT(m_extraFrameDict.contains(iStream));
+  if(m_extraFinishedSet.contains(iStream))
+    return false;
+  AVFrame *pFrame = m_extraFrameDict.value(iStream);
+  av_frame_unref(pFrame);
+  if(_decodeFrame(iStream, pFrame))
+    return true;
+  m_extraFinishedSet.insert(iStream);
+  return false;
+}
+
+const AVFrame *AVFrameProvider::currentStreamFrame(int iStream) const
+{
+  if(iStream == m_iAudioStream)
+    return m_currentAudioFrame;
+  else if(iStream == m_iVideoStream)
+    return m_currentVideoFrame;
+  else
+    return m_extraFrameDict.value(iStream, nullptr);
+}
+
+bool AVFrameProvider::isStreamFinished(int iStream) const
+{
+  if(iStream == m_iAudioStream)
+    return isAudioFinished();
+  else if(iStream == m_iVideoStream)
+    return isVideoFinished();
+  else
+    return !m_extraFrameDict.contains(iStream) || m_extraFinishedSet.contains(iStream);
+}
+
 bool AVFrameProvider::nextAudioFrame()
 {
   if(isAudioFinished())
     return false;
   av_frame_unref(m_currentAudioFrame);
-  m_audioFinished = !m_packetDecoder->getFrame(m_iAudioStream, m_currentAudioFrame);
+  if(m_iAudioHistoryReplay < m_audioHistory.size())
+  {
+    av_frame_ref(m_currentAudioFrame, m_audioHistory.at(m_iAudioHistoryReplay++));
+    m_currentFrameType = AudioFrame;
+    m_audioPts = _calcPts(m_pAudioStream, m_currentAudioFrame);
+    if(m_spectrumAnalyzer)
+      m_spectrumAnalyzer->push(m_currentAudioFrame);
+    return true;
+  }
+  m_audioFinished = m_audioHistoryAtEnd || !_decodeFrame(m_iAudioStream, m_currentAudioFrame);
   if(m_audioFinished)
     m_currentFrameType = UnknownFrame;
   else
   {
     m_currentFrameType = AudioFrame;
     m_audioPts = _calcPts(m_pAudioStream, m_currentAudioFrame);
+    m_deliveredSinceSeek = true;
+    _recordAudioHistory(m_currentAudioFrame);
+    if(m_spectrumAnalyzer)
+      m_spectrumAnalyzer->push(m_currentAudioFrame);
   }
   return !m_audioFinished;
 }
 
 bool AVFrameProvider::nextVideoFrame()
 {
+  if(m_reversePlayback)
+    return previousVideoFrame();
   if(isVideoFinished())
     return false;
   av_frame_unref(m_currentVideoFrame);
-  m_videoFinished = !m_packetDecoder->getFrame(m_iVideoStream, m_currentVideoFrame);
+  m_videoFinished = !_decodeFrame(m_iVideoStream, m_currentVideoFrame);
 
   if(m_videoFinished)
     m_currentFrameType = UnknownFrame;
@@ -317,10 +751,105 @@ bool AVFrameProvider::nextVideoFrame()
   {
     m_currentFrameType = VideoFrame;
     m_videoPts = _calcPts(m_pVideoStream, m_currentVideoFrame);
+    m_reverseSeekPts = std::numeric_limits<double>::quiet_NaN();
+    m_deliveredSinceSeek = true;
+    ++m_dropStatistics.decodedVideoFrameCount;
+    if(m_clock)
+      _adaptFrameDropping();
   }
   return !m_videoFinished;
 }
 
+bool AVFrameProvider::previousVideoFrame()
+{
+  if(!m_pVideoStream)
+    return false;
+  // the cache only continues backwards from the frame it delivered last, otherwise it restarts on the same file,
+  // from the seek target if no frame was delivered since the last seek
+  double startPts = std::isnan(m_reverseSeekPts) ? m_videoPts : m_reverseSeekPts;
+  if(!m_reverseDecoder)
+  {
+    if(m_input->isInMemory())
+      m_reverseDecoder = new AVReverseDecoder(m_input->memorySource(), m_iVideoStream, startPts, m_reverseCacheSize, m_decoderThreadCount);
+    else
+      m_reverseDecoder = new AVReverseDecoder(path(), m_iVideoStream, startPts, m_reverseCacheSize, m_decoderThreadCount);
+    m_reverseDecoder->start();
+  }
+  else if(m_reversePts != startPts)
+    m_reverseDecoder->restart(startPts);
+
+  av_frame_unref(m_currentVideoFrame);
+  if(!m_reverseDecoder->takeFrame(m_currentVideoFrame, g_reverseFrameTimeout))
+  {
+    if(!m_reverseDecoder->isFinished())
+      qWarning("Timed out waiting for the previous video frame.");
+    m_currentFrameType = UnknownFrame;
+    return false;
+  }
+  m_currentFrameType = VideoFrame;
+  m_videoPts = _calcPts(m_pVideoStream, m_currentVideoFrame);
+  m_reversePts = m_videoPts;
+  m_reverseSeekPts = std::numeric_limits<double>::quiet_NaN();
+  return true;
+}
+
+void AVFrameProvider::setReversePlayback(bool enabled)
+{ m_reversePlayback = enabled; }
+
+bool AVFrameProvider::isReversePlayback() const
+{ return m_reversePlayback; }
+
+void AVFrameProvider::setReverseCacheSize(int frameCount)
+{
+  Q_ASSERT(frameCount > 0);
+  m_reverseCacheSize = frameCount;
+}
+
+int AVFrameProvider::reverseCacheSize() const
+{ return m_reverseCacheSize; }
+
+int AVFrameProvider::takeAudioFrames(AVFrameProvider::FrameList *pOut, int maxFrameCount)
+{
+  if(isAudioFinished())
+    return 0;
+  return _takeFrames(m_iAudioStream, pOut, maxFrameCount, 0);
+}
+
+int AVFrameProvider::takeAudioSamples(AVFrameProvider::FrameList *pOut, qint64 sampleCount)
+{
+  Q_ASSERT(sampleCount > 0);
+  int nFrame = 0;
+  qint64 nSample = 0;
+  while(nSample < sampleCount && !isAudioFinished())
+  {
+    int first = pOut->size();
+    nFrame += _takeFrames(m_iAudioStream, pOut, std::numeric_limits<int>::max(), sampleCount - nSample);
+    for(int i = first; i < pOut->size(); ++i)
+      nSample += pOut->at(i)->nb_samples;
+  }
+  return nFrame;
+}
+
+int AVFrameProvider::takeAudioDuration(AVFrameProvider::FrameList *pOut, double duration)
+{
+  Q_ASSERT(hasAudio());
+  return takeAudioSamples(pOut, std::max(qint64(1), static_cast<qint64>(std::ceil(duration * audioSamprate()))));
+}
+
+int AVFrameProvider::takeVideoFrames(AVFrameProvider::FrameList *pOut, int maxFrameCount)
+{
+  if(isVideoFinished())
+    return 0;
+  return _takeFrames(m_iVideoStream, pOut, maxFrameCount, 0);
+}
+
+void AVFrameProvider::freeFrames(AVFrameProvider::FrameList *pList)
+{
+  for(AVFrame *pFrame:*pList)
+    av_frame_free(&pFrame);
+  pList->clear();
+}
+
 bool AVFrameProvider::isAudioFinished() const
 { return !m_pAudioStream || m_audioFinished; }
 
@@ -339,6 +868,9 @@ double AVFrameProvider::audioPts() const
 double AVFrameProvider::duration() const
 { return static_cast<double>(m_pFormatCtx->duration) / static_cast<double>(AV_TIME_BASE); }
 
+bool AVFrameProvider::hasDuration() const
+{ return m_pFormatCtx->duration != AV_NOPTS_VALUE; }
+
 bool AVFrameProvider::hasVideo() const
 { return m_pVideoStream != nullptr; }
 
@@ -375,61 +907,399 @@ AVSampleFormat AVFrameProvider::audioSampleFormat() const
   return static_cast<AVSampleFormat>(m_pAudioStream->codecpar->format);
 }
 
-int AVFrameProvider::_ioReadPacket(void *opaque, uint8_t *buf, int buf_size)
+int AVFrameProvider::audioChannelCount() const
 {
-  auto provider = reinterpret_cast<AVFrameProvider*>(opaque);
+  Q_ASSERT(hasAudio());
+  return m_pAudioStream->codecpar->channels;
+}
 
-  provider->m_fileLock.lock();
-  int bytesRead = provider->m_file.read(reinterpret_cast<char*>(buf), buf_size);
-  provider->m_fileLock.unlock();
+quint64 AVFrameProvider::audioChannelLayout() const
+{
+  Q_ASSERT(hasAudio());
+  if(m_pAudioStream->codecpar->channel_layout)
+    return m_pAudioStream->codecpar->channel_layout;
+  else
+    return av_get_default_channel_layout(m_pAudioStream->codecpar->channels);
+}
 
-  if(bytesRead == 0)
-    return AVERROR_EOF;
-  else if(bytesRead < 0)
+AVCodecID AVFrameProvider::audioCodecId() const
+{
+  Q_ASSERT(hasAudio());
+  return m_pAudioStream->codecpar->codec_id;
+}
+
+int AVFrameProvider::_takeFrames(int iStream, AVFrameProvider::FrameList *pOut, int maxFrameCount, qint64 maxSampleCount)
+{
+  Q_ASSERT(pOut);
+  bool finished = false;
+  int nFrame = 0;
+  if(m_hibernated)
+    resume();
+
+  // replayed audio is handed out on its own, the caller asks again for more
+  if(iStream == m_iAudioStream && m_iAudioHistoryReplay < m_audioHistory.size())
+  {
+    qint64 nSample = 0;
+    while(m_iAudioHistoryReplay < m_audioHistory.size() && nFrame < maxFrameCount && (maxSampleCount <= 0 || nSample < maxSampleCount))
+    {
+      AVFrame *pFrame = av_frame_clone(m_audioHistory.at(m_iAudioHistoryReplay++));
+      pOut->append(pFrame);
+      nSample += pFrame->nb_samples;
+      ++nFrame;
+    }
+    m_audioPts = _calcPts(m_pAudioStream, pOut->last());
+    return nFrame;
+  }
+  if(iStream == m_iAudioStream && m_audioHistoryAtEnd)
+  {
+    m_audioFinished = true;
+    return 0;
+  }
+
+  int first = pOut->size();
+  if(m_inlineDecoding || m_prerollDict.contains(iStream) || m_resumeSkipDict.contains(iStream))
+  {
+    qint64 nSample = 0;
+    while(nFrame < maxFrameCount && (maxSampleCount <= 0 || nSample < maxSampleCount))
+    {
+      AVFrame *pFrame = av_frame_alloc();
+      if(!_decodeFrame(iStream, pFrame))
+      {
+        av_frame_free(&pFrame);
+        finished = true;
+        break;
+      }
+      pOut->append(pFrame);
+      nSample += pFrame->nb_samples;
+      ++nFrame;
+    }
+  }
+  else
+    nFrame = m_packetDecoder->getFrames(iStream, pOut, maxFrameCount, maxSampleCount, &finished);
+  if(iStream == m_iAudioStream)
   {
-    qWarning("Failed to read buffer.");
-    return -1;
+    m_audioFinished = finished && nFrame == 0;
+    if(nFrame > 0)
+      m_audioPts = _calcPts(m_pAudioStream, pOut->last());
+    for(int i = first; i < pOut->size(); ++i)
+    {
+      _recordAudioHistory(pOut->at(i));
+      if(m_spectrumAnalyzer)
+        m_spectrumAnalyzer->push(pOut->at(i));
+    }
   }
   else
-    return bytesRead;
+  {
+    m_videoFinished = finished && nFrame == 0;
+    if(nFrame > 0)
+    {
+      m_videoPts = _calcPts(m_pVideoStream, pOut->last());
+      m_reverseSeekPts = std::numeric_limits<double>::quiet_NaN();
+    }
+  }
+  return nFrame;
 }
 
-int64_t AVFrameProvider::_ioSeek(void *opaque, int64_t offset, int whence)
+bool AVFrameProvider::_decodeFrame(int iStream, AVFrame *pOut)
 {
-  Q_ASSERT(opaque);
-  whence &= ~AVSEEK_FORCE;
-  auto provider = reinterpret_cast<AVFrameProvider*>(opaque);
+  if(m_hibernated)
+    resume();
 
-  bool seekResult = true;
-  int returnResult;
-  provider->m_fileLock.lock();
-  if(whence == AVSEEK_SIZE)
-    returnResult = provider->m_file.size();
-  else
+  auto itPreroll = m_prerollDict.find(iStream);
+  if(itPreroll != m_prerollDict.end())
   {
-    if(whence == SEEK_SET)
-      seekResult = provider->m_file.seek(offset);
-    else if(whence == SEEK_CUR)
-      seekResult = provider->m_file.seek(provider->m_file.pos() + offset);
-    else if(whence == SEEK_END)
-      seekResult = provider->m_file.seek(provider->m_file.size() + offset);
-    else
+    AVFrame *pFrame = itPreroll->dequeue();
+    if(itPreroll->isEmpty())
+      m_prerollDict.erase(itPreroll);
+    av_frame_move_ref(pOut, pFrame);
+    av_frame_free(&pFrame);
+    return true;
+  }
+
+  while(m_inlineDecoding ? m_packetDecoder->getFrame_inline(iStream, pOut) : m_packetDecoder->getFrame(iStream, pOut))
+  {
+    // after resuming, drop what was already prerolled or delivered
+    auto itSkip = m_resumeSkipDict.find(iStream);
+    if(itSkip == m_resumeSkipDict.end())
+      return true;
+    if(_calcPts(m_pFormatCtx->streams[iStream], pOut) > *itSkip)
     {
-      qFatal("Invalid whence %d", whence);
-      std::abort();
+      m_resumeSkipDict.erase(itSkip);
+      return true;
     }
-    returnResult = provider->m_file.pos();
+    av_frame_unref(pOut);
   }
-  provider->m_fileLock.unlock();
+  return false;
+}
 
-  if(seekResult)
-    return returnResult;
-  else
+bool AVFrameProvider::_shouldDecodeInline() const
+{
+  if(m_decodeMode != AutoDecode)
+    return m_decodeMode == InlineDecode;
+  if(m_pVideoStream)
+    return false;
+  for(int iStream:selectedStreams())
+  {
+    if(!_isLightweightCodec(m_pFormatCtx->streams[iStream]->codecpar->codec_id))
+      return false;
+  }
+  return true;
+}
+
+bool AVFrameProvider::_isLightweightCodec(AVCodecID codecId)
+{
+  if(codecId >= AV_CODEC_ID_FIRST_AUDIO && codecId < AV_CODEC_ID_ADPCM_IMA_QT) // PCM family
+    return true;
+  switch(codecId)
+  {
+  case AV_CODEC_ID_FLAC:
+  case AV_CODEC_ID_ALAC:
+  case AV_CODEC_ID_WAVPACK:
+  case AV_CODEC_ID_TTA:
+    return true;
+  default:
+    return false;
+  }
+}
+
+void AVFrameProvider::_adaptFrameDropping()
+{
+  double lag = m_clock->time() - m_videoPts;
+  m_dropStatistics.maxVideoLag = std::max(m_dropStatistics.maxVideoLag, lag);
+  if(m_awaitingKeyframe && m_currentVideoFrame->key_frame)
+    m_awaitingKeyframe = false;
+
+  AVDiscard skipFrame = lag > m_nonReferenceDropLag ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+  bool skipToKeyframe = lag > m_keyframeDropLag && !m_awaitingKeyframe;
+  if(skipFrame == m_videoSkipFrame && !skipToKeyframe)
+    return;
+
+  m_packetDecoder->locker()->lock();
+  if(skipFrame != m_videoSkipFrame)
+  {
+    m_packetDecoder->setSkipFrame_lockfree(m_iVideoStream, skipFrame);
+    if(skipFrame == AVDISCARD_NONREF)
+      ++m_dropStatistics.nonReferenceSkipCount;
+    m_videoSkipFrame = skipFrame;
+  }
+  // one GOP skip at a time, frames already in the codec are still late until the keyframe shows up
+  if(skipToKeyframe)
+  {
+    m_packetDecoder->requestSkipToKeyframe_lockfree(m_iVideoStream);
+    ++m_dropStatistics.keyframeSkipCount;
+    m_awaitingKeyframe = true;
+  }
+  m_packetDecoder->locker()->unlock();
+}
+
+void AVFrameProvider::_applyDecodeQuality()
+{
+  // a hibernated provider applies it when the pipeline is rebuilt
+  if(!m_packetDecoder)
+    return;
+  int lowres = 0;
+  AVDiscard skipLoopFilter = AVDISCARD_DEFAULT;
+  AVDiscard skipIdct = AVDISCARD_DEFAULT;
+  bool fast = false;
+  switch(m_decodeQuality)
+  {
+  case FullQuality:
+    break;
+  case FastQuality:
+    skipLoopFilter = AVDISCARD_NONREF;
+    fast = true;
+    break;
+  case PreviewQuality:
+    lowres = 1;
+    skipLoopFilter = AVDISCARD_ALL;
+    skipIdct = AVDISCARD_NONREF;
+    fast = true;
+    break;
+  case ThumbnailQuality:
+    lowres = 3;
+    skipLoopFilter = AVDISCARD_ALL;
+    skipIdct = AVDISCARD_BIDIR;
+    fast = true;
+    break;
+  }
+
+  m_packetDecoder->locker()->lock();
+  for(int iStream:selectedStreams())
+  {
+    if(m_pFormatCtx->streams[iStream]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+      m_packetDecoder->setVideoQuality_lockfree(iStream, lowres, skipLoopFilter, skipIdct, fast);
+  }
+  m_packetDecoder->locker()->unlock();
+}
+
+bool AVFrameProvider::_usesAudioHistory() const
+{ return (m_audioHistoryMaxDuration > 0.0 || m_audioHistoryMaxBytes > 0) && m_pAudioStream && !m_pVideoStream && m_extraFrameDict.isEmpty(); }
+
+void AVFrameProvider::_recordAudioHistory(const AVFrame *pFrame)
+{
+  if(!_usesAudioHistory())
+    return;
+  AVFrame *pClone = av_frame_clone(pFrame);
+  if(!pClone)
+  {
+    qWarning("Cannot keep audio frame in history.");
+    return;
+  }
+  m_audioHistory.enqueue(pClone);
+  m_audioHistorySampleCount += pClone->nb_samples;
+  m_audioHistoryByteCount += av_samples_get_buffer_size(nullptr, av_frame_get_channels(pClone), pClone->nb_samples, static_cast<AVSampleFormat>(pClone->format), 1);
+  m_iAudioHistoryReplay = m_audioHistory.size();
+  _trimAudioHistory();
+}
+
+void AVFrameProvider::_trimAudioHistory()
+{
+  qint64 maxSampleCount = 0;
+  if(m_audioHistoryMaxDuration > 0.0 && hasAudio())
+    maxSampleCount = static_cast<qint64>(std::ceil(m_audioHistoryMaxDuration * audioSamprate()));
+  // the newest frame always stays, it is the one replay() starts counting from
+  while(m_audioHistory.size() > 1 &&
+        ((maxSampleCount > 0 && m_audioHistorySampleCount > maxSampleCount) ||
+         (m_audioHistoryMaxBytes > 0 && m_audioHistoryByteCount > m_audioHistoryMaxBytes)))
   {
-    qWarning("Failed to seek.");
-    return -1;
+    AVFrame *pFrame = m_audioHistory.dequeue();
+    m_audioHistorySampleCount -= pFrame->nb_samples;
+    m_audioHistoryByteCount -= av_samples_get_buffer_size(nullptr, av_frame_get_channels(pFrame), pFrame->nb_samples, static_cast<AVSampleFormat>(pFrame->format), 1);
+    av_frame_free(&pFrame);
+    m_iAudioHistoryReplay = std::max(0, m_iAudioHistoryReplay - 1);
   }
 }
 
+void AVFrameProvider::_clearAudioHistory()
+{
+  for(AVFrame *pFrame:m_audioHistory)
+    av_frame_free(&pFrame);
+  m_audioHistory.clear();
+  m_iAudioHistoryReplay = 0;
+  m_audioHistorySampleCount = 0;
+  m_audioHistoryByteCount = 0;
+  m_audioHistoryAtEnd = false;
+}
+
+bool AVFrameProvider::_seekAudioHistory(double time)
+{
+  // a stopped decoder has lost its queued packets, the history would not join up with it anymore
+  if(m_audioHistory.isEmpty() || !_usesAudioHistory() || (!isDecoderRunning() && !m_audioFinished))
+    return false;
+  AVFrame *pLast = m_audioHistory.last();
+  double begin = _calcPts(m_pAudioStream, m_audioHistory.first());
+  double end = _calcPts(m_pAudioStream, pLast) + static_cast<double>(pLast->nb_samples) / static_cast<double>(audioSamprate());
+  if(time < begin || time >= end)
+    return false;
+
+  int i = m_audioHistory.size() - 1;
+  while(i > 0 && _calcPts(m_pAudioStream, m_audioHistory.at(i)) > time)
+    --i;
+  m_iAudioHistoryReplay = i;
+  m_audioHistoryAtEnd = m_audioHistoryAtEnd || m_audioFinished;
+  m_audioFinished = false;
+  m_currentFrameType = UnknownFrame;
+  return true;
+}
+
 double AVFrameProvider::_calcPts(AVStream *pStream, AVFrame *pFrame)
 { return static_cast<double>(pFrame->pts * pStream->time_base.num) / static_cast<double>(pStream->time_base.den); }
+
+void AVFrameProvider::_createPipeline(int queueSize)
+{
+  AVPacketProvider::StreamSet streamSet;
+  for(int iStream:selectedStreams())
+    streamSet.insert(iStream);
+  m_packetProvider = new AVPacketProvider(m_pFormatCtx, streamSet);
+  if(queueSize > 0)
+    m_packetProvider->setQueueSize_lockfree(queueSize);
+  m_packetDecoder = new AVPacketDecoder(m_packetProvider, m_pFormatCtx, streamSet, m_decoderThreadCount, m_decoderThreadType);
+  m_videoSkipFrame = AVDISCARD_DEFAULT;
+  m_awaitingKeyframe = false;
+  m_packetProvider->setThreadRole(m_threadRole);
+  m_packetDecoder->setThreadRole(m_threadRole);
+  if(m_decodeQuality != FullQuality)
+    _applyDecodeQuality();
+}
+
+void AVFrameProvider::_recordDemuxPos_lockfree()
+{
+  // queued packets are about to be dropped, demuxing has to continue at the first of them,
+  // or at the last demuxed packet when everything read was already taken
+  qint64 demuxTime = m_packetProvider->queuedTime_lockfree();
+  if(demuxTime == AV_NOPTS_VALUE)
+    demuxTime = m_packetProvider->demuxedTime_lockfree();
+  if(demuxTime != AV_NOPTS_VALUE)
+    m_demuxPos = demuxTime;
+}
+
+int AVFrameProvider::_destroyPipeline()
+{
+  int queueSize = 0;
+  if(m_packetDecoder)
+  {
+    delete m_packetDecoder;
+    m_packetDecoder = nullptr;
+  }
+  if(m_packetProvider)
+  {
+    queueSize = m_packetProvider->queueSize_lockfree();
+    delete m_packetProvider;
+    m_packetProvider = nullptr;
+  }
+  return queueSize;
+}
+
+void AVFrameProvider::_capturePreroll(double prerollDuration)
+{
+  // pulls frames the way nextFrame() interleaves them, so no packet queue runs full
+  qint64 maxSampleCount = m_pAudioStream ? std::max(qint64(1), static_cast<qint64>(std::ceil(prerollDuration * audioSamprate()))) : 0;
+  int maxVideoFrameCount = m_pVideoStream ? std::max(1, static_cast<int>(std::ceil(prerollDuration * videoFramerate()))) : 0;
+  qint64 nSample = 0;
+  int nVideoFrame = 0;
+  bool audioDone = isAudioFinished(), videoDone = isVideoFinished();
+  double audioPts = m_audioPts, videoPts = m_videoPts;
+  QHash<int, QQueue<AVFrame*>> prerollDict;
+  while(!audioDone || !videoDone)
+  {
+    bool isAudio = !audioDone && (videoDone || audioPts < videoPts);
+    int iStream = isAudio ? m_iAudioStream : m_iVideoStream;
+    AVFrame *pFrame = av_frame_alloc();
+    if(!_decodeFrame(iStream, pFrame))
+    {
+      av_frame_free(&pFrame);
+      if(isAudio)
+        audioDone = true;
+      else
+        videoDone = true;
+      continue;
+    }
+    prerollDict[iStream].enqueue(pFrame);
+    if(isAudio)
+    {
+      audioPts = _calcPts(m_pAudioStream, pFrame);
+      nSample += pFrame->nb_samples;
+      audioDone = nSample >= maxSampleCount;
+    }
+    else
+    {
+      videoPts = _calcPts(m_pVideoStream, pFrame);
+      videoDone = ++nVideoFrame >= maxVideoFrameCount;
+    }
+  }
+  // frames left over from an earlier resume were taken by _decodeFrame above
+  _clearPreroll();
+  m_prerollDict = prerollDict;
+}
+
+void AVFrameProvider::_clearPreroll()
+{
+  for(QQueue<AVFrame*> &queue:m_prerollDict)
+  {
+    for(AVFrame *pFrame:queue)
+      av_frame_free(&pFrame);
+  }
+  m_prerollDict.clear();
+  m_resumeSkipDict.clear();
+}
+
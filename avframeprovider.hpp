@@ -4,7 +4,16 @@
 #include <QSize>
 #include <QFile>
 #include <QMutex>
+#include <QVector>
+#include <QList>
+#include <QHash>
+#include <QSet>
+#include <QQueue>
 #include "publicutil.hpp"
+#include "avframeref.hpp"
+#include "avthreadpolicy.hpp"
+#include "avinputcontext.hpp"
+#include <atomic>
 extern "C"
 {
 #include <libavutil/avutil.h>
@@ -15,9 +24,9 @@ extern "C"
 class AVSeeker;
 class AVPacketProvider;
 class AVPacketDecoder;
-
-DEFINE_EXCEPTION(IOError, std::runtime_error)
-DEFINE_EXCEPTION(NoStreamError, std::runtime_error)
+class AVPresentationClock;
+class AVReverseDecoder;
+class AVSpectrumAnalyzer;
 
 class AVFrameProvider final
 {
@@ -28,11 +37,113 @@ public:
     AudioFrame,
     VideoFrame
   };
+  enum DecodeMode
+  {
+    AutoDecode = 0,
+    ThreadedDecode,
+    InlineDecode
+  };
+  enum DecodeQuality
+  {
+    FullQuality = 0,
+    FastQuality,
+    PreviewQuality,
+    ThumbnailQuality
+  };
+  typedef QVector<AVFrame*> FrameList;
+
+  struct DropStatistics
+  {
+    qint64 decodedVideoFrameCount;
+    qint64 droppedVideoPacketCount;
+    qint64 nonReferenceSkipCount;
+    qint64 keyframeSkipCount;
+    double maxVideoLag;
+  };
 
-  AVFrameProvider(const QString &path, bool enableAudio, bool enableVideo);
+  struct StreamInfo
+  {
+    int index;
+    AVMediaType type;
+    AVCodecID codecId;
+    QString language;
+    QString title;
+    bool selected;
+  };
+
+  // Zero decoderThreadCount or decoderThreadType (FF_THREAD_FRAME/SLICE)
+  // takes the AVDecoderTuner profile of the video codec, or the defaults.
+  AVFrameProvider(const QString &path, bool enableAudio, bool enableVideo, int decoderThreadCount = 0, int decoderThreadType = 0);
+  // Decodes media held in memory without copying it, path() is the source's name.
+  AVFrameProvider(const AVMemorySource &source, bool enableAudio, bool enableVideo, int decoderThreadCount = 0, int decoderThreadType = 0);
   ~AVFrameProvider();
 
+  // Cheap preparation for a later open: asks the OS to read ahead the head
+  // and tail of the file (where containers keep their index) and, with
+  // probe, caches the detected input format for the constructor.
+  static bool warmUp(const QString &path, qint64 headSize = 4 * 1024 * 1024, qint64 tailSize = 1024 * 1024, bool probe = true);
+
   QString path() const;
+  QString formatName() const;
+  qint64 bitRate() const;
+
+  // Streams which are not selected are discarded by the demuxer. The first
+  // selected audio and video stream are the main streams, every further
+  // selected stream must be consumed through nextStreamFrame().
+  QVector<StreamInfo> streamInfoList() const;
+  int findStream(AVMediaType type, const QString &language = QString()) const;
+  void selectStreams(const QList<int> &streamIndexList);
+  QList<int> selectedStreams() const;
+
+  // Tail mode treats end of file as temporary and waits for the file to
+  // grow, until no new data arrived for idleTimeout ms (negative for never).
+  void setTailMode(bool enabled, int idleTimeout = 5000);
+  bool isTailMode() const;
+  int tailIdleTimeout() const;
+
+  // Video frames later than the clock make the decoder skip non-reference
+  // frames, and beyond keyframeLag skip whole GOPs up to the next keyframe.
+  // Audio is never dropped.
+  void setPresentationClock(AVPresentationClock *clock);
+  AVPresentationClock *presentationClock() const;
+  void setFrameDropThreshold(double nonReferenceLag, double keyframeLag);
+  DropStatistics dropStatistics() const;
+  void resetDropStatistics();
+
+  // Trades video quality for decoding speed, can be switched while decoding.
+  // Tiers using lowres reopen the video codec and resume at the next keyframe.
+  void setDecodeQuality(DecodeQuality v);
+  DecodeQuality decodeQuality() const;
+
+  // Role of the demuxing and decoding threads, the seeker follows with
+  // SeekRole unless the provider is playing.
+  void setThreadRole(AVThreadPolicy::Role v);
+  AVThreadPolicy::Role threadRole() const;
+
+  void setPacketQueueSize(int v);
+  int packetQueueSize() const;
+
+  // Keeps the last decoded audio frames, up to maxDuration seconds and/or
+  // maxBytes (zero means unlimited, both zero disables it). Seeking back
+  // into that window and replay() are served from memory without I/O or
+  // decoding. Only used when audio is the sole selected stream.
+  void setAudioHistoryLimit(double maxDuration, qint64 maxBytes = 0);
+  double audioHistoryDuration() const;
+  bool replay(double seconds);
+
+  // Every audio frame handed out is also pushed to the analyzer, which
+  // only copies its samples into a lock-free ring. Not owned.
+  void setSpectrumAnalyzer(AVSpectrumAnalyzer *analyzer);
+  AVSpectrumAnalyzer *spectrumAnalyzer() const;
+
+  // Hibernating keeps about prerollDuration seconds of decoded output and
+  // the position, then releases the decoding threads, codec contexts and
+  // packet queues. resume() rebuilds them, seeks back and continues right
+  // after the last prerolled frame, so playback has no gap. Any frame
+  // request resumes implicitly. Extra streams restart at the seek position.
+  void hibernate(double prerollDuration = 0.5);
+  void resume();
+  bool isHibernated() const;
 
   void seek(double time, bool async = true);
   void waitSeekDone();
@@ -41,13 +152,42 @@ public:
   void stopDecoder(bool async = true);
   bool isDecoderRunning() const;
 
+  // Inline decoding demuxes and decodes on the thread calling nextFrame,
+  // AutoDecode picks it for audio only input of cheap codecs.
+  // Takes effect on the next startDecoder().
+  void setDecodeMode(DecodeMode v);
+  DecodeMode decodeMode() const;
+  bool isInlineDecoding() const;
+
   FrameType currentFrameType() const;
   const AVFrame *currentFrame() const;
   const AVFrame *currentAudioFrame() const;
   const AVFrame *currentVideoFrame() const;
+  AVFrameRef currentFrameRef() const;
+  AVFrameRef currentAudioFrameRef() const;
+  AVFrameRef currentVideoFrameRef() const;
   bool nextFrame();
   bool nextAudioFrame();
   bool nextVideoFrame();
+  bool nextStreamFrame(int iStream);
+  const AVFrame *currentStreamFrame(int iStream) const;
+  bool isStreamFinished(int iStream) const;
+
+  // Steps video backwards, a worker decodes whole GOPs in reverse into a
+  // cache of reverseCacheSize frames so consecutive steps are cheap. With
+  // reverse playback nextFrame() and nextVideoFrame() step backwards too,
+  // audio is not played in reverse. Going forwards again needs a seek.
+  bool previousVideoFrame();
+  void setReversePlayback(bool enabled);
+  bool isReversePlayback() const;
+  void setReverseCacheSize(int frameCount);
+  int reverseCacheSize() const;
+
+  int takeAudioFrames(FrameList *pOut, int maxFrameCount);
+  int takeAudioSamples(FrameList *pOut, qint64 sampleCount);
+  int takeAudioDuration(FrameList *pOut, double duration);
+  int takeVideoFrames(FrameList *pOut, int maxFrameCount);
+  static void freeFrames(FrameList *pList);
   bool isAudioFinished() const;
   bool isVideoFinished() const;
   bool isFinished() const;
@@ -56,6 +196,7 @@ public:
   double audioPts() const;
 
   double duration() const;
+  bool hasDuration() const;
 
   bool hasVideo() const;
   double videoFramerate() const;
@@ -65,18 +206,32 @@ public:
   bool hasAudio() const;
   int audioSamprate() const;
   AVSampleFormat audioSampleFormat() const;
+  int audioChannelCount() const;
+  quint64 audioChannelLayout() const;
+  AVCodecID audioCodecId() const;
 
 private:
-  static int _ioReadPacket(void *opaque, uint8_t *buf, int buf_size);
-  static int64_t _ioSeek(void *opaque, int64_t offset, int whence);
+  void _initialize(int decoderThreadCount, int decoderThreadType);
+  void _open(AVInputContext *input, bool enableAudio, bool enableVideo);
   static double _calcPts(AVStream *pStream, AVFrame *pFrame);
+  void _createPipeline(int queueSize);
+  void _recordDemuxPos_lockfree();
+  int _destroyPipeline();
+  void _capturePreroll(double prerollDuration);
+  void _clearPreroll();
+  int _takeFrames(int iStream, FrameList *pOut, int maxFrameCount, qint64 maxSampleCount);
+  bool _decodeFrame(int iStream, AVFrame *pOut);
+  bool _shouldDecodeInline() const;
+  static bool _isLightweightCodec(AVCodecID codecId);
+  void _adaptFrameDropping();
+  void _applyDecodeQuality();
+  bool _usesAudioHistory() const;
+  void _recordAudioHistory(const AVFrame *pFrame);
+  void _trimAudioHistory();
+  void _clearAudioHistory();
+  bool _seekAudioHistory(double time);
 
-  QString m_path;
-  QMutex m_fileLock;
-  QFile m_file;
-  unsigned char m_ioBuffer[32 * 1024];
-
-  AVIOContext *m_pIOCtx;
+  AVInputContext *m_input;
   AVFormatContext *m_pFormatCtx;
   int m_iAudioStream, m_iVideoStream;
   AVStream *m_pAudioStream, *m_pVideoStream;
@@ -84,10 +239,47 @@ private:
   AVSeeker *m_seeker;
   AVPacketProvider *m_packetProvider;
   AVPacketDecoder *m_packetDecoder;
+  int m_decoderThreadCount, m_decoderThreadType;
+  DecodeMode m_decodeMode;
+  DecodeQuality m_decodeQuality;
+  AVThreadPolicy::Role m_threadRole;
+  bool m_inlineDecoding;
 
   FrameType m_currentFrameType;
   AVFrame *m_currentAudioFrame, *m_currentVideoFrame;
+  QHash<int, AVFrame*> m_extraFrameDict;
+  QSet<int> m_extraFinishedSet;
   double m_videoPts, m_audioPts;
 
   bool m_audioFinished, m_videoFinished;
+
+  AVPresentationClock *m_clock;
+  double m_nonReferenceDropLag, m_keyframeDropLag;
+  AVDiscard m_videoSkipFrame;
+  bool m_awaitingKeyframe;
+  DropStatistics m_dropStatistics;
+
+  QQueue<AVFrame*> m_audioHistory;
+  int m_iAudioHistoryReplay;
+  qint64 m_audioHistorySampleCount, m_audioHistoryByteCount;
+  double m_audioHistoryMaxDuration;
+  qint64 m_audioHistoryMaxBytes;
+  bool m_audioHistoryAtEnd;
+
+  AVSpectrumAnalyzer *m_spectrumAnalyzer;
+
+  AVReverseDecoder *m_reverseDecoder;
+  bool m_reversePlayback;
+  int m_reverseCacheSize;
+  double m_reversePts;
+  // where a seek landed, NaN once a video frame was delivered after it
+  double m_reverseSeekPts;
+
+  bool m_hibernated, m_hibernatedRunning;
+  int m_hibernatedQueueSize;
+  // where demuxing continues, recorded at seeks and from the packet provider when stopping
+  qint64 m_demuxPos;
+  bool m_deliveredSinceSeek;
+  QHash<int, QQueue<AVFrame*>> m_prerollDict;
+  QHash<int, double> m_resumeSkipDict;
 };
@@ -0,0 +1,71 @@
+#include "avframeref.hpp"
+#include "privateutil.hpp"
+#include <utility>
+
+AVFrameRef::AVFrameRef()
+{ m_pFrame = nullptr; }
+
+AVFrameRef::AVFrameRef(const AVFrame *pFrame)
+{
+  m_pFrame = nullptr;
+  // an unreferenced frame has no format and nothing to reference
+  if(pFrame && pFrame->format >= 0)
+  {
+    m_pFrame = av_frame_clone(pFrame);
+    if(!m_pFrame)
+      throw FFmpegError("Cannot reference frame.");
+  }
+}
+
+AVFrameRef::AVFrameRef(const AVFrameRef &other) : AVFrameRef(other.m_pFrame)
+{}
+
+AVFrameRef::AVFrameRef(AVFrameRef &&other)
+{
+  m_pFrame = other.m_pFrame;
+  other.m_pFrame = nullptr;
+}
+
+AVFrameRef::~AVFrameRef()
+{ reset(); }
+
+AVFrameRef AVFrameRef::adopt(AVFrame *pFrame)
+{
+  AVFrameRef ref;
+  ref.m_pFrame = pFrame;
+  return ref;
+}
+
+AVFrameRef &AVFrameRef::operator=(const AVFrameRef &other)
+{
+  if(this != &other)
+  {
+    AVFrameRef copy(other);
+    std::swap(m_pFrame, copy.m_pFrame);
+  }
+  return *this;
+}
+
+AVFrameRef &AVFrameRef::operator=(AVFrameRef &&other)
+{
+  std::swap(m_pFrame, other.m_pFrame);
+  return *this;
+}
+
+bool AVFrameRef::isNull() const
+{ return m_pFrame == nullptr; }
+
+void AVFrameRef::reset()
+{
+  if(m_pFrame)
+    av_frame_free(&m_pFrame);
+}
+
+const AVFrame *AVFrameRef::frame() const
+{ return m_pFrame; }
+
+const AVFrame *AVFrameRef::operator->() const
+{
+  Q_ASSERT(m_pFrame);
+  return m_pFrame;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <QMetaType>
+
+extern "C"
+{
+#include <libavutil/avutil.h>
+#include <libavutil/frame.h>
+}
+
+// Owning handle of a reference counted AVFrame. Copies reference the same
+// frame buffers (av_frame_ref), so a frame can be kept or handed to another
+// thread without copying its data.
+class AVFrameRef final
+{
+public:
+  AVFrameRef();
+  explicit AVFrameRef(const AVFrame *pFrame);
+  AVFrameRef(const AVFrameRef &other);
+  AVFrameRef(AVFrameRef &&other);
+  ~AVFrameRef();
+
+  static AVFrameRef adopt(AVFrame *pFrame);
+
+  AVFrameRef &operator=(const AVFrameRef &other);
+  AVFrameRef &operator=(AVFrameRef &&other);
+
+  bool isNull() const;
+  void reset();
+
+  const AVFrame *frame() const;
+  const AVFrame *operator->() const;
+
+private:
+  AVFrame *m_pFrame;
+};
+Q_DECLARE_METATYPE(AVFrameRef)
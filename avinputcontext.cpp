@@ -0,0 +1,383 @@
+#include "avinputcontext.hpp"
+#include "avtailwatcher.hpp"
+#include "privateutil.hpp"
+#include <QDebug>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QHash>
+#include <algorithm>
+#include <cstring>
+
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#endif
+
+IMPL_EXCEPTION(IOError, std::runtime_error)
+IMPL_EXCEPTION(NoStreamError, std::runtime_error)
+
+namespace
+{
+  // input formats detected before, keyed by path and validated by size and modification time
+  struct ProbeCacheEntry
+  {
+    qint64 size;
+    qint64 modified;
+    AVInputFormat *pInputFormat;
+  };
+
+  const int g_maxProbeCacheSize = 256;
+  QMutex g_probeCacheLocker;
+  QHash<QString, ProbeCacheEntry> g_probeCache;
+
+  AVInputFormat *lookupProbeCache(const QFileInfo &info)
+  {
+    QMutexLocker locker(&g_probeCacheLocker);
+    auto it = g_probeCache.constFind(info.absoluteFilePath());
+    if(it == g_probeCache.constEnd() || it->size != info.size() || it->modified != info.lastModified().toMSecsSinceEpoch())
+      return nullptr;
+    return it->pInputFormat;
+  }
+
+  void storeProbeCache(const QFileInfo &info, AVInputFormat *pInputFormat)
+  {
+    QMutexLocker locker(&g_probeCacheLocker);
+    if(g_probeCache.size() >= g_maxProbeCacheSize)
+      g_probeCache.clear();
+    ProbeCacheEntry entry;
+    entry.size = info.size();
+    entry.modified = info.lastModified().toMSecsSinceEpoch();
+    entry.pInputFormat = pInputFormat;
+    g_probeCache.insert(info.absoluteFilePath(), entry);
+  }
+}
+
+AVInputContext::AVInputContext(const QString &path)
+{
+  m_path = path;
+  m_memoryPos = 0;
+  m_inMemory = false;
+
+  m_tailWatcher = nullptr;
+  m_tailMode = false;
+  m_tailAbort = false;
+  m_tailIdleTimeout = 5000;
+
+  m_pIOCtx = nullptr;
+  m_pFormatCtx = nullptr;
+
+  m_file.setFileName(path);
+  if(!m_file.open(QFile::ReadOnly))
+  {
+    qCritical()<<"Failed to open file for reading:"<<path;
+    throw IOError("Failed to open file for reading.");
+  }
+
+  // create io context
+  {
+    m_pIOCtx = avio_alloc_context(m_ioBuffer, sizeof(m_ioBuffer), 0, reinterpret_cast<void*>(this), &_ioReadPacket, nullptr, &_ioSeek);
+    if(!m_pIOCtx)
+      throw FFmpegError("Cannot create ffmpeg io context.");
+  }
+
+  // open file
+  {
+    // probe
+    QFileInfo fileInfo(path);
+    AVInputFormat *pInputFormat = lookupProbeCache(fileInfo);
+    if(!pInputFormat)
+    {
+      pInputFormat = _probeInputFormat(&m_file, m_ioBuffer, sizeof(m_ioBuffer));
+      if(!pInputFormat)
+        throw IOError("Unsupported input format");
+      storeProbeCache(fileInfo, pInputFormat);
+    }
+    _openFormat(pInputFormat);
+  }
+}
+
+AVInputContext::AVInputContext(const AVMemorySource &source)
+{
+  m_path = source.name();
+  m_memorySource = source;
+  m_memoryPos = 0;
+  m_inMemory = true;
+
+  m_tailWatcher = nullptr;
+  m_tailMode = false;
+  m_tailAbort = false;
+  m_tailIdleTimeout = 5000;
+
+  m_pIOCtx = nullptr;
+  m_pFormatCtx = nullptr;
+
+  if(source.isNull())
+  {
+    qCritical()<<"Empty memory source:"<<source.name();
+    throw IOError("Empty memory source.");
+  }
+
+  // create io context
+  {
+    m_pIOCtx = avio_alloc_context(m_ioBuffer, sizeof(m_ioBuffer), 0, reinterpret_cast<void*>(this), &_memoryReadPacket, nullptr, &_memorySeek);
+    if(!m_pIOCtx)
+      throw FFmpegError("Cannot create ffmpeg io context.");
+  }
+
+  // open memory, there is no path to cache the probe result for
+  {
+    qint64 probeSize = source.read(0, reinterpret_cast<char*>(m_ioBuffer), sizeof(m_ioBuffer));
+    AVInputFormat *pInputFormat = _probeInputFormat(m_ioBuffer, static_cast<int>(probeSize));
+    if(!pInputFormat)
+      throw IOError("Unsupported input format");
+    _openFormat(pInputFormat);
+  }
+}
+
+AVInputContext::~AVInputContext()
+{
+  m_tailAbort = true;
+  if(m_pFormatCtx)
+    avformat_close_input(&m_pFormatCtx);
+  if(m_pIOCtx)
+    av_free(reinterpret_cast<AVIOContext*>(m_pIOCtx));
+  if(m_tailWatcher)
+    delete m_tailWatcher;
+}
+
+bool AVInputContext::warmUp(const QString &path, qint64 headSize, qint64 tailSize, bool probe)
+{
+  QFile file(path);
+  if(!file.open(QFile::ReadOnly))
+  {
+    qWarning()<<"Failed to open file for warming up:"<<path;
+    return false;
+  }
+  qint64 size = file.size();
+  headSize = std::min(headSize, size);
+  tailSize = std::min(tailSize, size - headSize);
+
+#ifdef Q_OS_LINUX
+  // only schedules readahead, the page cache fills in the background
+  posix_fadvise(file.handle(), 0, headSize, POSIX_FADV_WILLNEED);
+  if(tailSize > 0)
+    posix_fadvise(file.handle(), size - tailSize, tailSize, POSIX_FADV_WILLNEED);
+#else
+  char buf[64 * 1024];
+  for(qint64 pos = 0; pos < headSize; pos += sizeof(buf))
+  {
+    if(file.read(buf, std::min(static_cast<qint64>(sizeof(buf)), headSize - pos)) <= 0)
+      break;
+  }
+  if(tailSize > 0 && file.seek(size - tailSize))
+  {
+    for(qint64 pos = 0; pos < tailSize; pos += sizeof(buf))
+    {
+      if(file.read(buf, std::min(static_cast<qint64>(sizeof(buf)), tailSize - pos)) <= 0)
+        break;
+    }
+  }
+#endif
+
+  if(probe)
+  {
+    QFileInfo fileInfo(path);
+    if(!lookupProbeCache(fileInfo))
+    {
+      unsigned char probeBuf[32 * 1024];
+      file.seek(0);
+      AVInputFormat *pInputFormat = _probeInputFormat(&file, probeBuf, sizeof(probeBuf));
+      if(!pInputFormat)
+        return false;
+      storeProbeCache(fileInfo, pInputFormat);
+    }
+  }
+  return true;
+}
+
+QString AVInputContext::path() const
+{ return m_path; }
+
+AVFormatContext *AVInputContext::formatContext() const
+{ return m_pFormatCtx; }
+
+bool AVInputContext::isInMemory() const
+{ return m_inMemory; }
+
+AVMemorySource AVInputContext::memorySource() const
+{ return m_memorySource; }
+
+void AVInputContext::setTailMode(bool enabled, int idleTimeout)
+{
+  if(m_inMemory)
+  {
+    qWarning("Tail mode is not available for memory sources.");
+    return;
+  }
+  if(enabled && !m_tailWatcher)
+    m_tailWatcher = new AVTailWatcher(m_path);
+  m_tailIdleTimeout = idleTimeout;
+  m_tailMode = enabled;
+}
+
+bool AVInputContext::isTailMode() const
+{ return m_tailMode; }
+
+int AVInputContext::tailIdleTimeout() const
+{ return m_tailIdleTimeout; }
+
+void AVInputContext::setTailAbort(bool v)
+{ m_tailAbort = v; }
+
+void AVInputContext::_openFormat(AVInputFormat *pInputFormat)
+{
+  // open context
+  m_pFormatCtx = avformat_alloc_context();
+  if(!m_pFormatCtx)
+    throw FFmpegError("Cannot create ffmpeg format context.");
+  m_pFormatCtx->pb = m_pIOCtx;
+  m_pFormatCtx->iformat = pInputFormat;
+  m_pFormatCtx->flags = AVFMT_FLAG_CUSTOM_IO;
+
+  int openFileResult = avformat_open_input(&m_pFormatCtx, "", nullptr, nullptr);
+  CHECK_AVRESULT(openFileResult, openFileResult == 0);
+
+  // initialize stream info
+  int findStreamInfoResult = avformat_find_stream_info(m_pFormatCtx, nullptr);
+  CHECK_AVRESULT(findStreamInfoResult, findStreamInfoResult >= 0);
+}
+
+int AVInputContext::_ioReadPacket(void *opaque, uint8_t *buf, int buf_size)
+{
+  auto input = reinterpret_cast<AVInputContext*>(opaque);
+
+  input->m_fileLock.lock();
+  int bytesRead = input->m_file.read(reinterpret_cast<char*>(buf), buf_size);
+  qint64 pos = input->m_file.pos();
+  input->m_fileLock.unlock();
+
+  // a growing file only ends after it stayed idle for the configured time
+  while(bytesRead == 0 && input->m_tailMode)
+  {
+    if(!input->m_tailWatcher->waitForGrowth(pos, input->m_tailIdleTimeout, &input->m_tailAbort))
+      break;
+    input->m_fileLock.lock();
+    bytesRead = input->m_file.read(reinterpret_cast<char*>(buf), buf_size);
+    pos = input->m_file.pos();
+    input->m_fileLock.unlock();
+  }
+
+  if(bytesRead == 0)
+    return AVERROR_EOF;
+  else if(bytesRead < 0)
+  {
+    qWarning("Failed to read buffer.");
+    return -1;
+  }
+  else
+    return bytesRead;
+}
+
+int64_t AVInputContext::_ioSeek(void *opaque, int64_t offset, int whence)
+{
+  Q_ASSERT(opaque);
+  whence &= ~AVSEEK_FORCE;
+  auto input = reinterpret_cast<AVInputContext*>(opaque);
+
+  bool seekResult = true;
+  int returnResult;
+  input->m_fileLock.lock();
+  if(whence == AVSEEK_SIZE)
+    returnResult = input->m_file.size();
+  else
+  {
+    if(whence == SEEK_SET)
+      seekResult = input->m_file.seek(offset);
+    else if(whence == SEEK_CUR)
+      seekResult = input->m_file.seek(input->m_file.pos() + offset);
+    else if(whence == SEEK_END)
+      seekResult = input->m_file.seek(input->m_file.size() + offset);
+    else
+    {
+      qFatal("Invalid whence %d", whence);
+      std::abort();
+    }
+    returnResult = input->m_file.pos();
+  }
+  input->m_fileLock.unlock();
+
+  if(seekResult)
+    return returnResult;
+  else
+  {
+    qWarning("Failed to seek.");
+    return -1;
+  }
+}
+
+int AVInputContext::_memoryReadPacket(void *opaque, uint8_t *buf, int buf_size)
+{
+  auto input = reinterpret_cast<AVInputContext*>(opaque);
+
+  input->m_fileLock.lock();
+  qint64 bytesRead = input->m_memorySource.read(input->m_memoryPos, reinterpret_cast<char*>(buf), buf_size);
+  input->m_memoryPos += bytesRead;
+  input->m_fileLock.unlock();
+
+  if(bytesRead == 0)
+    return AVERROR_EOF;
+  return static_cast<int>(bytesRead);
+}
+
+int64_t AVInputContext::_memorySeek(void *opaque, int64_t offset, int whence)
+{
+  Q_ASSERT(opaque);
+  whence &= ~AVSEEK_FORCE;
+  auto input = reinterpret_cast<AVInputContext*>(opaque);
+  qint64 size = input->m_memorySource.size();
+  if(whence == AVSEEK_SIZE)
+    return size;
+
+  QMutexLocker locker(&input->m_fileLock);
+  qint64 pos;
+  if(whence == SEEK_SET)
+    pos = offset;
+  else if(whence == SEEK_CUR)
+    pos = input->m_memoryPos + offset;
+  else if(whence == SEEK_END)
+    pos = size + offset;
+  else
+  {
+    qFatal("Invalid whence %d", whence);
+    std::abort();
+  }
+
+  if(pos < 0 || pos > size)
+  {
+    qWarning("Failed to seek.");
+    return -1;
+  }
+  input->m_memoryPos = pos;
+  return pos;
+}
+
+AVInputFormat *AVInputContext::_probeInputFormat(QFile *file, unsigned char *buf, int bufSize)
+{
+  qint64 realReadSize = file->read(reinterpret_cast<char*>(buf), bufSize);
+  if(realReadSize < 0)
+  {
+    qCritical("Cannot read file header.");
+    throw IOError("Cannot read file header.");
+  }
+  file->seek(0);
+  return _probeInputFormat(buf, static_cast<int>(realReadSize));
+}
+
+AVInputFormat *AVInputContext::_probeInputFormat(unsigned char *buf, int size)
+{
+  AVProbeData probeData;
+  memset(reinterpret_cast<void*>(&probeData), 0, sizeof(probeData));
+  probeData.buf = buf;
+  probeData.buf_size = size;
+  probeData.filename = "aaa";
+  return av_probe_input_format(&probeData, 1);
+}
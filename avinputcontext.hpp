@@ -0,0 +1,69 @@
+#pragma once
+
+#include <QString>
+#include <QFile>
+#include <QMutex>
+#include <atomic>
+#include <stdexcept>
+#include "publicutil.hpp"
+#include "avmemorysource.hpp"
+
+extern "C"
+{
+#include <libavutil/avutil.h>
+#include <libavformat/avformat.h>
+}
+
+class AVTailWatcher;
+
+DEFINE_EXCEPTION(IOError, std::runtime_error)
+DEFINE_EXCEPTION(NoStreamError, std::runtime_error)
+
+// Demuxer input of one file, shared by the frame and packet level APIs.
+// Reads through QFile with a custom io context, probes the input format
+// (cached per file) and reads the stream info. A memory source is read
+// straight into FFmpeg's io buffer, or into its destination for large
+// reads, without staging copies.
+class AVInputContext final
+{
+public:
+  AVInputContext(const QString &path);
+  AVInputContext(const AVMemorySource &source);
+  ~AVInputContext();
+
+  static bool warmUp(const QString &path, qint64 headSize, qint64 tailSize, bool probe);
+
+  QString path() const;
+  AVFormatContext *formatContext() const;
+  bool isInMemory() const;
+  AVMemorySource memorySource() const;
+
+  void setTailMode(bool enabled, int idleTimeout);
+  bool isTailMode() const;
+  int tailIdleTimeout() const;
+  // makes a read waiting for the file to grow give up
+  void setTailAbort(bool v);
+
+private:
+  void _openFormat(AVInputFormat *pInputFormat);
+  static int _ioReadPacket(void *opaque, uint8_t *buf, int buf_size);
+  static int64_t _ioSeek(void *opaque, int64_t offset, int whence);
+  static int _memoryReadPacket(void *opaque, uint8_t *buf, int buf_size);
+  static int64_t _memorySeek(void *opaque, int64_t offset, int whence);
+  static AVInputFormat *_probeInputFormat(QFile *file, unsigned char *buf, int bufSize);
+  static AVInputFormat *_probeInputFormat(unsigned char *buf, int size);
+
+  QString m_path;
+  QMutex m_fileLock;
+  QFile m_file;
+  AVMemorySource m_memorySource;
+  qint64 m_memoryPos;
+  bool m_inMemory;
+  unsigned char m_ioBuffer[32 * 1024];
+  AVTailWatcher *m_tailWatcher;
+  std::atomic<bool> m_tailMode, m_tailAbort;
+  std::atomic<int> m_tailIdleTimeout;
+
+  AVIOContext *m_pIOCtx;
+  AVFormatContext *m_pFormatCtx;
+};
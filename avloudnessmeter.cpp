@@ -0,0 +1,182 @@
+#include "avloudnessmeter.hpp"
+#include "privateutil.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+extern "C"
+{
+#include <libavutil/channel_layout.h>
+}
+
+AVLoudnessMeter::AVLoudnessMeter(int samprate, int nChannel, quint64 channelLayout)
+{
+  Q_ASSERT(samprate > 0 && nChannel > 0);
+  m_samprate = samprate;
+  m_subBlockSize = std::max(1, samprate / 10);
+
+  // K-weighting pre-filter, coefficients recalculated for the actual sample rate
+  {
+    double k = std::tan(M_PI * 1681.974450955533 / samprate);
+    double q = 0.7071752369554196;
+    double vh = std::pow(10.0, 3.999843853973347 / 20.0);
+    double vb = std::pow(vh, 0.4996667741545416);
+    double a0 = 1.0 + k / q + k * k;
+    m_shelf.b0 = (vh + vb * k / q + k * k) / a0;
+    m_shelf.b1 = 2.0 * (k * k - vh) / a0;
+    m_shelf.b2 = (vh - vb * k / q + k * k) / a0;
+    m_shelf.a1 = 2.0 * (k * k - 1.0) / a0;
+    m_shelf.a2 = (1.0 - k / q + k * k) / a0;
+  }
+  {
+    double k = std::tan(M_PI * 38.13547087602444 / samprate);
+    double q = 0.5003270373238773;
+    double a0 = 1.0 + k / q + k * k;
+    m_highPass.b0 = 1.0;
+    m_highPass.b1 = -2.0;
+    m_highPass.b2 = 1.0;
+    m_highPass.a1 = 2.0 * (k * k - 1.0) / a0;
+    m_highPass.a2 = (1.0 - k / q + k * k) / a0;
+  }
+
+  if(!channelLayout || av_get_channel_layout_nb_channels(channelLayout) != nChannel)
+    channelLayout = av_get_default_channel_layout(nChannel);
+  m_channelList.resize(nChannel);
+  for(int i = 0; i < nChannel; ++i)
+  {
+    quint64 channel = channelLayout ? av_channel_layout_extract_channel(channelLayout, i) : 0;
+    ChannelState &state = m_channelList[i];
+    if(channel == AV_CH_LOW_FREQUENCY || channel == AV_CH_LOW_FREQUENCY_2)
+      state.weight = 0.0;
+    else if(channel == AV_CH_SIDE_LEFT || channel == AV_CH_SIDE_RIGHT || channel == AV_CH_BACK_LEFT || channel == AV_CH_BACK_RIGHT)
+      state.weight = 1.41;
+    else
+      state.weight = 1.0;
+  }
+  reset();
+}
+
+AVLoudnessMeter::~AVLoudnessMeter()
+{}
+
+void AVLoudnessMeter::addFrame(const AVFrame *pFrame)
+{
+  Q_ASSERT(pFrame);
+  Q_ASSERT(av_frame_get_channels(pFrame) == m_channelList.size());
+  int nChannel = m_channelList.size();
+  int nSample = pFrame->nb_samples;
+  if(m_buffer.size() < nSample * nChannel)
+    m_buffer.resize(nSample * nChannel);
+  for(int iChannel = 0; iChannel < nChannel; ++iChannel)
+    readAudioFrameAsFloat(pFrame, iChannel, m_buffer.data() + iChannel * nSample);
+
+  int iSample = 0;
+  while(iSample < nSample)
+  {
+    int nChunk = std::min(nSample - iSample, m_subBlockSize - m_currentSampleCount);
+    for(int iChannel = 0; iChannel < nChannel; ++iChannel)
+    {
+      ChannelState &state = m_channelList[iChannel];
+      const float *pSample = m_buffer.constData() + iChannel * nSample + iSample;
+      double energy = 0.0;
+      for(int i = 0; i < nChunk; ++i)
+      {
+        float v = pSample[i];
+        m_samplePeak = std::max(m_samplePeak, std::abs(v));
+        double y = _process(m_shelf, v, &state.z1[0], &state.z2[0]);
+        y = _process(m_highPass, y, &state.z1[1], &state.z2[1]);
+        energy += y * y;
+      }
+      m_currentEnergy += energy * state.weight;
+    }
+    m_currentSampleCount += nChunk;
+    iSample += nChunk;
+    if(m_currentSampleCount == m_subBlockSize)
+      _finishSubBlock();
+  }
+  m_sampleCount += nSample;
+}
+
+void AVLoudnessMeter::reset()
+{
+  for(ChannelState &state:m_channelList)
+  {
+    state.z1[0] = state.z1[1] = 0.0;
+    state.z2[0] = state.z2[1] = 0.0;
+  }
+  for(double &energy:m_subBlockEnergy)
+    energy = 0.0;
+  m_nSubBlock = 0;
+  m_currentEnergy = 0.0;
+  m_currentSampleCount = 0;
+  m_blockEnergyList.clear();
+  m_samplePeak = 0.0f;
+  m_sampleCount = 0;
+}
+
+double AVLoudnessMeter::integratedLoudness() const
+{
+  auto toLoudness = [](double energy){ return -0.691 + 10.0 * std::log10(energy); };
+
+  // absolute gate at -70 LUFS
+  double sum = 0.0;
+  int n = 0;
+  for(double energy:m_blockEnergyList)
+  {
+    if(energy > 0.0 && toLoudness(energy) > -70.0)
+    {
+      sum += energy;
+      ++n;
+    }
+  }
+  if(n == 0)
+    return -std::numeric_limits<double>::infinity();
+
+  // relative gate 10 LU below the absolute gated loudness
+  double relativeGate = toLoudness(sum / n) - 10.0;
+  sum = 0.0;
+  n = 0;
+  for(double energy:m_blockEnergyList)
+  {
+    if(energy > 0.0 && toLoudness(energy) > -70.0 && toLoudness(energy) > relativeGate)
+    {
+      sum += energy;
+      ++n;
+    }
+  }
+  if(n == 0)
+    return -std::numeric_limits<double>::infinity();
+  return toLoudness(sum / n);
+}
+
+double AVLoudnessMeter::samplePeak() const
+{ return m_samplePeak; }
+
+qint64 AVLoudnessMeter::sampleCount() const
+{ return m_sampleCount; }
+
+double AVLoudnessMeter::replayGain(double integratedLoudness)
+{
+  // ReplayGain 2.0 reference level
+  return -18.0 - integratedLoudness;
+}
+
+double AVLoudnessMeter::_process(const AVLoudnessMeter::Biquad &filter, double x, double *z1, double *z2)
+{
+  // transposed direct form II
+  double y = filter.b0 * x + *z1;
+  *z1 = filter.b1 * x - filter.a1 * y + *z2;
+  *z2 = filter.b2 * x - filter.a2 * y;
+  return y;
+}
+
+void AVLoudnessMeter::_finishSubBlock()
+{
+  // 400ms gating blocks overlap by 75%, so every 100ms sub-block closes one
+  m_subBlockEnergy[m_nSubBlock % 4] = m_currentEnergy / m_subBlockSize;
+  ++m_nSubBlock;
+  m_currentEnergy = 0.0;
+  m_currentSampleCount = 0;
+  if(m_nSubBlock >= 4)
+    m_blockEnergyList.append((m_subBlockEnergy[0] + m_subBlockEnergy[1] + m_subBlockEnergy[2] + m_subBlockEnergy[3]) / 4.0);
+}
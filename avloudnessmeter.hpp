@@ -0,0 +1,55 @@
+#pragma once
+
+#include <QVector>
+
+extern "C"
+{
+#include <libavutil/avutil.h>
+#include <libavutil/frame.h>
+}
+
+// EBU R128 / ITU-R BS.1770 integrated loudness and sample peak of a decoded audio stream.
+class AVLoudnessMeter final
+{
+public:
+  AVLoudnessMeter(int samprate, int nChannel, quint64 channelLayout = 0);
+  ~AVLoudnessMeter();
+
+  void addFrame(const AVFrame *pFrame);
+  void reset();
+
+  double integratedLoudness() const;
+  double samplePeak() const;
+  qint64 sampleCount() const;
+
+  static double replayGain(double integratedLoudness);
+
+private:
+  struct Biquad
+  {
+    double b0, b1, b2, a1, a2;
+  };
+  struct ChannelState
+  {
+    double weight;
+    double z1[2], z2[2];
+  };
+
+  static double _process(const Biquad &filter, double x, double *z1, double *z2);
+  void _finishSubBlock();
+
+  int m_samprate;
+  int m_subBlockSize;
+  Biquad m_shelf, m_highPass;
+  QVector<ChannelState> m_channelList;
+  QVector<float> m_buffer;
+
+  double m_subBlockEnergy[4];
+  int m_nSubBlock;
+  double m_currentEnergy;
+  int m_currentSampleCount;
+  QVector<double> m_blockEnergyList;
+
+  float m_samplePeak;
+  qint64 m_sampleCount;
+};
@@ -0,0 +1,87 @@
+#include "avmemorysource.hpp"
+#include <algorithm>
+#include <cstring>
+
+AVMemorySource::AVMemorySource()
+{ m_size = 0; }
+
+AVMemorySource::AVMemorySource(const char *pData, qint64 size)
+{
+  m_size = 0;
+  appendChunk(pData, size);
+}
+
+AVMemorySource::AVMemorySource(const QByteArray &data)
+{
+  m_size = 0;
+  appendChunk(data);
+}
+
+AVMemorySource::AVMemorySource(const QList<QByteArray> &chunkList)
+{
+  m_size = 0;
+  for(const QByteArray &data:chunkList)
+    appendChunk(data);
+}
+
+void AVMemorySource::appendChunk(const char *pData, qint64 size)
+{
+  Q_ASSERT(pData || size == 0);
+  Q_ASSERT(size >= 0);
+  if(size == 0)
+    return;
+  Chunk chunk;
+  chunk.pData = pData;
+  chunk.size = size;
+  chunk.offset = m_size;
+  m_chunkList.append(chunk);
+  m_size += size;
+}
+
+void AVMemorySource::appendChunk(const QByteArray &data)
+{
+  if(data.isEmpty())
+    return;
+  appendChunk(data.constData(), data.size());
+  // holding a shallow copy keeps constData() valid
+  m_chunkList.last().holder = data;
+}
+
+void AVMemorySource::setName(const QString &v)
+{ m_name = v; }
+
+QString AVMemorySource::name() const
+{ return m_name; }
+
+bool AVMemorySource::isNull() const
+{ return m_chunkList.isEmpty(); }
+
+qint64 AVMemorySource::size() const
+{ return m_size; }
+
+int AVMemorySource::chunkCount() const
+{ return m_chunkList.size(); }
+
+qint64 AVMemorySource::read(qint64 pos, char *pOut, qint64 maxSize) const
+{
+  Q_ASSERT(pOut);
+  if(pos < 0 || pos >= m_size || maxSize <= 0)
+    return 0;
+  qint64 readSize = 0;
+  for(int iChunk = _findChunk(pos); iChunk < m_chunkList.size() && readSize < maxSize; ++iChunk)
+  {
+    const Chunk &chunk = m_chunkList.at(iChunk);
+    qint64 chunkPos = pos + readSize - chunk.offset;
+    qint64 count = std::min(chunk.size - chunkPos, maxSize - readSize);
+    std::memcpy(pOut + readSize, chunk.pData + chunkPos, static_cast<size_t>(count));
+    readSize += count;
+  }
+  return readSize;
+}
+
+int AVMemorySource::_findChunk(qint64 pos) const
+{
+  // last chunk starting at or before pos
+  auto it = std::upper_bound(m_chunkList.constBegin(), m_chunkList.constEnd(), pos, [](qint64 v, const Chunk &chunk) { return v < chunk.offset; });
+  return static_cast<int>(it - m_chunkList.constBegin()) - 1;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+#include <QVector>
+
+// Media already in memory, as one contiguous region or a chain of chunks.
+// The data is referenced, never copied: raw pointers must stay valid and
+// unchanged as long as any copy of the source is used, QByteArray chunks
+// are kept alive by the source itself. Copies are cheap and share the
+// chunk table, so every reopen of the same media can take the same source.
+class AVMemorySource final
+{
+public:
+  AVMemorySource();
+  AVMemorySource(const char *pData, qint64 size);
+  explicit AVMemorySource(const QByteArray &data);
+  explicit AVMemorySource(const QList<QByteArray> &chunkList);
+
+  void appendChunk(const char *pData, qint64 size);
+  void appendChunk(const QByteArray &data);
+
+  // shown in logs and used as file name hint while probing
+  void setName(const QString &v);
+  QString name() const;
+
+  bool isNull() const;
+  qint64 size() const;
+  int chunkCount() const;
+
+  // copies up to maxSize bytes at pos, returns the count copied
+  qint64 read(qint64 pos, char *pOut, qint64 maxSize) const;
+
+private:
+  struct Chunk
+  {
+    const char *pData;
+    qint64 size;
+    qint64 offset;
+    QByteArray holder;
+  };
+
+  int _findChunk(qint64 pos) const;
+
+  QVector<Chunk> m_chunkList;
+  qint64 m_size;
+  QString m_name;
+};
@@ -1,64 +1,56 @@
 #include "avpacketdecoder.hpp"
 #include "avpacketprovider.hpp"
+#include "avcodeccontextpool.hpp"
+#include "avdecodertuner.hpp"
 #include "privateutil.hpp"
+#include <algorithm>
 
-AVPacketDecoder::AVPacketDecoder(AVPacketProvider *packetProvider, AVFormatContext *pFormatCtx, const StreamSet &streamSet, QObject *parent) : QThread(parent)
+AVPacketDecoder::AVPacketDecoder(AVPacketProvider *packetProvider, AVFormatContext *pFormatCtx, const StreamSet &streamSet, int threadCount, int threadType, QObject *parent) : QThread(parent)
 {
   m_packetProvider = packetProvider;
+  m_pFormatCtx = pFormatCtx;
   for(int iStream:streamSet)
   {
     Q_ASSERT(iStream >= 0 && iStream < static_cast<int>(pFormatCtx->nb_streams));
     AVStream *pStream = pFormatCtx->streams[iStream];
-    AVCodecParameters *pCodecPar = pStream->codecpar;
 
-    // find decoder
-    AVCodec *pCodec = avcodec_find_decoder(pStream->codecpar->codec_id);
-    if(!pCodec)
+    int streamThreadCount = threadCount;
+    int streamThreadType = threadType;
+    AVDecoderTuner::Profile profile;
+    if(pStream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && (streamThreadCount <= 0 || streamThreadType <= 0) && AVDecoderTuner::instance()->lookup(pStream->codecpar, &profile))
     {
-      qCritical("Could not found available codec for stream %d.", iStream);
-      throw FFmpegError("Could not found available codec.");
+      if(streamThreadCount <= 0)
+        streamThreadCount = profile.threadCount;
+      if(streamThreadType <= 0)
+        streamThreadType = profile.threadType;
     }
-
-    // create codec context
-    AVCodecContext *pCodecCtx = avcodec_alloc_context3(pCodec);
-    if(!pCodecCtx)
-    {
-      qCritical("Could not alloc codec context for stream %d.", iStream);
-      throw FFmpegError("Could not alloc codec context.");
-    }
-    {
-      int parToCtxResult = avcodec_parameters_to_context(pCodecCtx, pCodecPar);
-      CHECK_AVRESULT(parToCtxResult, parToCtxResult >= 0);
-    }
-
-    // set parameter
-    av_codec_set_pkt_timebase(pCodecCtx, pStream->time_base);
-    if(pCodecPar->codec_type == AVMEDIA_TYPE_VIDEO)
-      pCodecCtx->thread_count = av_cpu_count();
-    else
-      pCodecCtx->thread_count = av_cpu_count() / 2;
-    pCodecCtx->thread_type = FF_THREAD_FRAME;
-
-    // open codec
+    if(streamThreadType <= 0)
+      streamThreadType = FF_THREAD_FRAME;
+    if(streamThreadCount <= 0)
     {
-      lockFFmpeg();
-      int codecOpenResult = avcodec_open2(pCodecCtx, pCodec, nullptr);
-      unlockFFmpeg();
-      CHECK_AVRESULT(codecOpenResult, codecOpenResult == 0);
+      if(pStream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+        streamThreadCount = av_cpu_count();
+      else
+        streamThreadCount = av_cpu_count() / 2;
     }
+    AVCodecContext *pCodecCtx = AVCodecContextPool::instance()->acquire(pStream, streamThreadCount, streamThreadType);
 
     m_streamDict.insert(iStream, pCodecCtx);
+    m_threadCountDict.insert(iStream, streamThreadCount);
+    m_threadTypeDict.insert(iStream, streamThreadType);
+    // only audio with a thread count the caller left open may be narrowed to one thread
+    if(threadCount <= 0 && pStream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+      m_narrowableSet.insert(iStream);
   }
   m_fullyStarted = false;
+  m_singleThreaded = false;
+  m_threadRole = AVThreadPolicy::PlaybackRole;
 }
 
 AVPacketDecoder::~AVPacketDecoder()
 {
   for(AVCodecContext *pCodecCtx:m_streamDict)
-  {
-    avcodec_close(pCodecCtx);
-    avcodec_free_context(&pCodecCtx);
-  }
+    AVCodecContextPool::instance()->release(pCodecCtx);
 }
 
 QMutex *AVPacketDecoder::locker()
@@ -70,6 +62,43 @@ QWaitCondition *AVPacketDecoder::syncer()
 void AVPacketDecoder::requestFeeding_lockfree()
 { m_syncer.wakeAll(); }
 
+void AVPacketDecoder::setSkipFrame_lockfree(int iStream, AVDiscard v)
+{
+  AVCodecContext *pCodecCtx = m_streamDict.value(iStream, nullptr);
+  Q_ASSERT(pCodecCtx);
+  pCodecCtx->skip_frame = v;
+}
+
+void AVPacketDecoder::requestSkipToKeyframe_lockfree(int iStream)
+{
+  Q_ASSERT(m_streamDict.contains(iStream));
+  m_skipToKeyframeDict.insert(iStream, true);
+}
+
+qint64 AVPacketDecoder::droppedPacketCount_lockfree(int iStream) const
+{ return m_droppedPacketCountDict.value(iStream, 0); }
+
+void AVPacketDecoder::setVideoQuality_lockfree(int iStream, int lowres, AVDiscard skipLoopFilter, AVDiscard skipIdct, bool fast)
+{
+  AVCodecContext *pCodecCtx = m_streamDict.value(iStream, nullptr);
+  Q_ASSERT(pCodecCtx);
+
+  // lowres is only read while opening the codec
+  lowres = std::min(lowres, static_cast<int>(av_codec_get_max_lowres(pCodecCtx->codec)));
+  if(lowres != pCodecCtx->lowres)
+  {
+    _swapContext(iStream, lowres);
+    pCodecCtx = m_streamDict.value(iStream);
+  }
+
+  pCodecCtx->skip_loop_filter = skipLoopFilter;
+  pCodecCtx->skip_idct = skipIdct;
+  if(fast)
+    pCodecCtx->flags2 |= AV_CODEC_FLAG2_FAST;
+  else
+    pCodecCtx->flags2 &= ~AV_CODEC_FLAG2_FAST;
+}
+
 void AVPacketDecoder::requestWakeUp_lockfree()
 { m_syncer.wakeAll(); }
 
@@ -103,6 +132,128 @@ bool AVPacketDecoder::getFrame(int iStream, AVFrame *pOut)
   }
 }
 
+int AVPacketDecoder::getFrames(int iStream, QVector<AVFrame*> *pOut, int maxFrameCount, qint64 maxSampleCount, bool *pFinished)
+{
+  AVCodecContext *pCodecCtx = m_streamDict.value(iStream, nullptr);
+  Q_ASSERT(pCodecCtx);
+  Q_ASSERT(pOut && pFinished);
+  Q_ASSERT(maxFrameCount > 0);
+
+  int nFrame = 0;
+  qint64 nSample = 0;
+  int receiveFrameResult = 0;
+  AVFrame *pFrame = av_frame_alloc();
+  *pFinished = false;
+
+  m_locker.lock();
+  waitUntilFullyStarted_lockfree();
+  while(nFrame < maxFrameCount && (maxSampleCount <= 0 || nSample < maxSampleCount))
+  {
+    receiveFrameResult = avcodec_receive_frame(pCodecCtx, pFrame);
+    if(receiveFrameResult >= 0)
+    {
+      pOut->append(pFrame);
+      ++nFrame;
+      nSample += pFrame->nb_samples;
+      pFrame = av_frame_alloc();
+    }
+    else if(receiveFrameResult == AVERROR_EOF)
+    {
+      *pFinished = true;
+      break;
+    }
+    else if(receiveFrameResult == AVERROR(EAGAIN))
+    {
+      // hand out what is ready instead of waiting for a full batch
+      if(nFrame > 0)
+        break;
+      else if(!isRunning())
+      {
+        qWarning("EOF is not seen.");
+        *pFinished = true;
+        break;
+      }
+      m_syncer.wakeAll();
+      m_syncer.wait(&m_locker, 10);
+    }
+    else
+      break;
+  }
+  m_syncer.wakeAll();
+  m_locker.unlock();
+  av_frame_free(&pFrame);
+
+  if(receiveFrameResult < 0 && receiveFrameResult != AVERROR_EOF && receiveFrameResult != AVERROR(EAGAIN))
+    CHECK_AVRESULT(receiveFrameResult, false);
+  return nFrame;
+}
+
+bool AVPacketDecoder::getFrame_inline(int iStream, AVFrame *pOut)
+{
+  Q_ASSERT(!isRunning());
+  AVCodecContext *pCodecCtx = m_streamDict.value(iStream, nullptr);
+  Q_ASSERT(pCodecCtx);
+
+  while(true)
+  {
+    int receiveFrameResult = avcodec_receive_frame(pCodecCtx, pOut);
+    if(receiveFrameResult >= 0)
+      return true;
+    else if(receiveFrameResult == AVERROR_EOF)
+      return false;
+    else if(receiveFrameResult != AVERROR(EAGAIN))
+      CHECK_AVRESULT(receiveFrameResult, false);
+
+    if(m_drainingSet.contains(iStream))
+    {
+      qWarning("EOF is not seen.");
+      return false;
+    }
+
+    AVPacket *packet = m_packetProvider->readPacket_inline(iStream);
+    if(_dropUntilKeyframe(iStream, packet))
+      continue;
+    int sendPacketResult = avcodec_send_packet(pCodecCtx, packet);
+    if(!packet) // meet eof, drain codec
+      m_drainingSet.insert(iStream);
+    else if(sendPacketResult == AVERROR(EAGAIN))
+      m_packetProvider->returnPacket_lockfree(iStream, packet);
+    else
+    {
+      av_packet_unref(packet);
+      av_packet_free(&packet);
+      if(sendPacketResult == AVERROR_EOF)
+        qWarning("Stream %d EOF too early", iStream);
+      else if(sendPacketResult < 0)
+        CHECK_AVRESULT(sendPacketResult, false);
+    }
+  }
+}
+
+void AVPacketDecoder::flush_inline()
+{
+  Q_ASSERT(!isRunning());
+  for(AVCodecContext *pCodecCtx:m_streamDict)
+    avcodec_flush_buffers(pCodecCtx);
+  m_drainingSet.clear();
+}
+
+void AVPacketDecoder::setSingleThreaded(bool v)
+{
+  Q_ASSERT(!isRunning());
+  if(v == m_singleThreaded)
+    return;
+  m_singleThreaded = v;
+  for(int iStream:m_narrowableSet)
+  {
+    if(m_threadCountDict.value(iStream) != 1)
+      _swapContext(iStream, m_streamDict.value(iStream)->lowres);
+  }
+}
+
+bool AVPacketDecoder::isSingleThreaded() const
+{ return m_singleThreaded; }
+
 void AVPacketDecoder::waitUntilFullyStarted_lockfree()
 {
   if(!m_fullyStarted && isRunning())
@@ -116,8 +267,51 @@ void AVPacketDecoder::requestStart()
   start();
 }
 
+void AVPacketDecoder::_swapContext(int iStream, int lowres)
+{
+  AVCodecContext *pCodecCtx = m_streamDict.value(iStream, nullptr);
+  Q_ASSERT(pCodecCtx);
+  int threadCount = m_singleThreaded && m_narrowableSet.contains(iStream) ? 1 : m_threadCountDict.value(iStream);
+  AVCodecContext *pNewCodecCtx = AVCodecContextPool::instance()->acquire(m_pFormatCtx->streams[iStream], threadCount, m_threadTypeDict.value(iStream), lowres);
+
+  // frame dropping and quality set on the old context have to survive the swap
+  pNewCodecCtx->skip_frame = pCodecCtx->skip_frame;
+  pNewCodecCtx->skip_loop_filter = pCodecCtx->skip_loop_filter;
+  pNewCodecCtx->skip_idct = pCodecCtx->skip_idct;
+  pNewCodecCtx->flags2 = (pNewCodecCtx->flags2 & ~AV_CODEC_FLAG2_FAST) | (pCodecCtx->flags2 & AV_CODEC_FLAG2_FAST);
+  AVCodecContextPool::instance()->release(pCodecCtx);
+  m_streamDict.insert(iStream, pNewCodecCtx);
+  m_drainingSet.remove(iStream);
+  // a requested skip that is still pending keeps being counted
+  if(!m_skipToKeyframeDict.contains(iStream))
+    m_skipToKeyframeDict.insert(iStream, false);
+}
+
+bool AVPacketDecoder::_dropUntilKeyframe(int iStream, AVPacket *packet)
+{
+  if(!packet || !m_skipToKeyframeDict.contains(iStream))
+    return false;
+  if(packet->flags & AV_PKT_FLAG_KEY)
+  {
+    m_skipToKeyframeDict.remove(iStream);
+    return false;
+  }
+  av_packet_unref(packet);
+  av_packet_free(&packet);
+  if(m_skipToKeyframeDict.value(iStream))
+    ++m_droppedPacketCountDict[iStream];
+  return true;
+}
+
+void AVPacketDecoder::setThreadRole(AVThreadPolicy::Role v)
+{ m_threadRole = v; }
+
+AVThreadPolicy::Role AVPacketDecoder::threadRole() const
+{ return static_cast<AVThreadPolicy::Role>(m_threadRole.load()); }
+
 void AVPacketDecoder::run()
 {
+  int appliedRole = -1;
   m_locker.lock();
 
   auto end = m_streamDict.cend();
@@ -133,6 +327,12 @@ void AVPacketDecoder::run()
   packetLocker->unlock();
   while(!isInterruptionRequested())
   {
+    if(appliedRole != m_threadRole)
+    {
+      appliedRole = m_threadRole;
+      AVThreadPolicy::applyToCurrentThread(static_cast<AVThreadPolicy::Role>(appliedRole));
+    }
+
     int nEOF = 0;
     packetLocker->lock();
     {
@@ -145,6 +345,8 @@ void AVPacketDecoder::run()
         while(true)
         {
           AVPacket *packet = m_packetProvider->getPacket_lockfree(iStream);
+          if(_dropUntilKeyframe(iStream, packet))
+            continue;
           int sendPacketResult = avcodec_send_packet(pCodecCtx, packet);
 
           if(!packet) // meet eof
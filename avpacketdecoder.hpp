@@ -3,7 +3,11 @@
 #include <QThread>
 #include <QMutex>
 #include <QWaitCondition>
+#include <atomic>
+#include "avthreadpolicy.hpp"
 #include <QHash>
+#include <QVector>
+#include <QSet>
 
 extern "C"
 {
@@ -23,26 +27,60 @@ private:
 public:
   typedef QSet<int> StreamSet;
 
-  AVPacketDecoder(AVPacketProvider *packetProvider, AVFormatContext *pFormatCtx, const StreamSet &streamSet, QObject *parent = nullptr);
+  AVPacketDecoder(AVPacketProvider *packetProvider, AVFormatContext *pFormatCtx, const StreamSet &streamSet, int threadCount = 0, int threadType = 0, QObject *parent = nullptr);
   ~AVPacketDecoder();
 
   QMutex *locker();
   QWaitCondition *syncer();
 
   void requestFeeding_lockfree();
+  void setSkipFrame_lockfree(int iStream, AVDiscard v);
+  void requestSkipToKeyframe_lockfree(int iStream);
+  // packets dropped by requestSkipToKeyframe_lockfree(), not by the skip after a context swap
+  qint64 droppedPacketCount_lockfree(int iStream) const;
+  // reopens the codec context when lowres changes, decoding resumes at the next keyframe
+  void setVideoQuality_lockfree(int iStream, int lowres, AVDiscard skipLoopFilter, AVDiscard skipIdct, bool fast);
   void requestWakeUp_lockfree();
 
   bool getFrame(int iStream, AVFrame *pOut);
+  int getFrames(int iStream, QVector<AVFrame*> *pOut, int maxFrameCount, qint64 maxSampleCount, bool *pFinished);
   void waitUntilFullyStarted_lockfree();
   void requestStart();
 
+  void setThreadRole(AVThreadPolicy::Role v);
+  AVThreadPolicy::Role threadRole() const;
+
+  // decode on the calling thread, only valid while neither thread is running
+  bool getFrame_inline(int iStream, AVFrame *pOut);
+  void flush_inline();
+  // Inline decoding feeds one packet at a time, where frame threads of audio
+  // codecs only add latency. Narrows audio streams whose thread count was left
+  // automatic to one thread, explicit counts and video keep their threads.
+  void setSingleThreaded(bool v);
+  bool isSingleThreaded() const;
+
 protected:
   void run() override;
 
+private:
+  bool _dropUntilKeyframe(int iStream, AVPacket *packet);
+  void _swapContext(int iStream, int lowres);
+
 private:
   AVPacketProvider *m_packetProvider;
+  AVFormatContext *m_pFormatCtx;
   StreamDict m_streamDict;
+  QHash<int, int> m_threadCountDict;
+  QHash<int, int> m_threadTypeDict;
   bool m_fullyStarted;
+  bool m_singleThreaded;
+  QSet<int> m_narrowableSet;
+  QSet<int> m_drainingSet;
+  // streams waiting for a keyframe, true if the drops were requested and are counted
+  QHash<int, bool> m_skipToKeyframeDict;
+  QHash<int, qint64> m_droppedPacketCountDict;
+
+  std::atomic<int> m_threadRole;
 
   QMutex m_locker;
   QWaitCondition m_syncer;
@@ -16,6 +16,9 @@ AVPacketProvider::AVPacketProvider(AVFormatContext *pFormatCtx, const AVPacketPr
     m_streamQueueDict.insert(iStream, queue);
   }
   m_fullyStarted = false;
+  m_demuxFinished = false;
+  m_demuxedTime = AV_NOPTS_VALUE;
+  m_threadRole = AVThreadPolicy::PlaybackRole;
 }
 
 AVPacketProvider::~AVPacketProvider()
@@ -57,20 +60,15 @@ AVPacket *AVPacketProvider::getPacket_lockfree(int iStream)
   PacketQueue *queue = m_streamQueueDict.value(iStream, nullptr);
   Q_ASSERT(queue);
 
-  if(queue->isEmpty())
+  // wakeups also come for packets of other streams, only a finished demuxer means the stream ended
+  while(queue->isEmpty())
   {
-    if(isRunning())
-    {
-      m_syncer.wakeAll();
-      m_syncer.wait(&m_locker);
-    }
-    else
+    if(!isRunning() || m_demuxFinished || QThread::currentThread()->isInterruptionRequested())
       return nullptr;
+    m_syncer.wakeAll();
+    m_syncer.wait(&m_locker);
   }
-  if(queue->isEmpty())
-    return nullptr;
-  else
-    return queue->dequeue();
+  return queue->dequeue();
 }
 
 void AVPacketProvider::returnPacket_lockfree(int iStream, AVPacket *packet)
@@ -92,26 +90,123 @@ void AVPacketProvider::clearQueue_lockfree()
     }
     queue->clear();
   }
+  m_demuxedTime = AV_NOPTS_VALUE;
+}
+
+qint64 AVPacketProvider::queuedTime_lockfree() const
+{
+  qint64 minTime = AV_NOPTS_VALUE;
+  for(auto it = m_streamQueueDict.cbegin(); it != m_streamQueueDict.cend(); ++it)
+  {
+    if(it.value()->isEmpty())
+      continue;
+    const AVPacket *packet = it.value()->first();
+    qint64 ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+    if(ts == AV_NOPTS_VALUE)
+      continue;
+    qint64 time = av_rescale_q(ts, m_pFormatCtx->streams[it.key()]->time_base, AV_TIME_BASE_Q);
+    if(minTime == AV_NOPTS_VALUE || time < minTime)
+      minTime = time;
+  }
+  return minTime;
+}
+
+qint64 AVPacketProvider::demuxedTime_lockfree() const
+{ return m_demuxedTime; }
+
+AVPacket *AVPacketProvider::readPacket_inline(int iStream)
+{
+  Q_ASSERT(!isRunning());
+  PacketQueue *queue = m_streamQueueDict.value(iStream, nullptr);
+  Q_ASSERT(queue);
+
+  while(queue->isEmpty())
+  {
+    AVPacket *packet = av_packet_alloc();
+    av_init_packet(packet);
+
+    int packetReadingResult = av_read_frame(m_pFormatCtx, packet);
+    PacketQueue *targetQueue = m_streamQueueDict.value(packet->stream_index, nullptr);
+    if(packetReadingResult < 0 || !targetQueue)
+    {
+      av_packet_unref(packet);
+      av_packet_free(&packet);
+      if(packetReadingResult == AVERROR_EOF)
+        return nullptr;
+      else if(packetReadingResult < 0)
+        CHECK_AVRESULT(packetReadingResult, false);
+    }
+    else
+    {
+      _recordDemuxed(packet);
+      targetQueue->enqueue(packet);
+    }
+  }
+  return queue->dequeue();
+}
+
+AVPacket *AVPacketProvider::readAnyPacket_inline()
+{
+  Q_ASSERT(!isRunning());
+  for(PacketQueue *queue:m_streamQueueDict)
+  {
+    if(!queue->isEmpty())
+      return queue->dequeue();
+  }
+
+  while(true)
+  {
+    AVPacket *packet = av_packet_alloc();
+    av_init_packet(packet);
+
+    int packetReadingResult = av_read_frame(m_pFormatCtx, packet);
+    if(packetReadingResult >= 0 && m_streamQueueDict.contains(packet->stream_index))
+    {
+      _recordDemuxed(packet);
+      return packet;
+    }
+    av_packet_unref(packet);
+    av_packet_free(&packet);
+    if(packetReadingResult == AVERROR_EOF)
+      return nullptr;
+    else if(packetReadingResult < 0)
+      CHECK_AVRESULT(packetReadingResult, false);
+  }
 }
 
 void AVPacketProvider::requestStart()
 {
   Q_ASSERT(!isRunning());
   m_fullyStarted = false;
+  m_demuxFinished = false;
   start();
 }
 
 void AVPacketProvider::waitUntilFullyStarted_lockfree()
 {
-  if(!m_fullyStarted && isRunning())
+  // packets arriving wake the syncer too
+  while(!m_fullyStarted && isRunning())
     m_syncer.wait(&m_locker);
 }
 
+void AVPacketProvider::setThreadRole(AVThreadPolicy::Role v)
+{ m_threadRole = v; }
+
+AVThreadPolicy::Role AVPacketProvider::threadRole() const
+{ return static_cast<AVThreadPolicy::Role>(m_threadRole.load()); }
+
 void AVPacketProvider::run()
 {
+  int appliedRole = -1;
   m_locker.lock();
   while(!isInterruptionRequested())
   {
+    if(appliedRole != m_threadRole)
+    {
+      appliedRole = m_threadRole;
+      AVThreadPolicy::applyToCurrentThread(static_cast<AVThreadPolicy::Role>(appliedRole));
+    }
+
     int minPacketQueueSize = std::numeric_limits<int>::max();
     auto calcMinPacketQueueSize = [&](){
       minPacketQueueSize = std::numeric_limits<int>::max();
@@ -129,9 +224,18 @@ void AVPacketProvider::run()
       AVPacket *packet = av_packet_alloc();
       av_init_packet(packet);
 
-      // demux and enqueue packet
+      // demux and enqueue packet, reading may block in tail mode so consumers keep the lock meanwhile
       {
+        m_locker.unlock();
         int packetReadingResult = av_read_frame(m_pFormatCtx, packet);
+        m_locker.lock();
+        if(isInterruptionRequested())
+        {
+          // the queues were cleared while reading, the packet must not follow them
+          av_packet_unref(packet);
+          av_packet_free(&packet);
+          goto cleanUp;
+        }
         int iStream = packet->stream_index;
         if(packetReadingResult < 0 || !m_streamQueueDict.contains(iStream))
         {
@@ -146,7 +250,12 @@ void AVPacketProvider::run()
         {
           PacketQueue *queue = m_streamQueueDict.value(iStream, nullptr);
           if(queue)
+          {
+            _recordDemuxed(packet);
             queue->enqueue(packet);
+            if(queue->size() == 1)
+              m_syncer.wakeAll();
+          }
           else
           {
             av_packet_unref(packet);
@@ -163,7 +272,15 @@ void AVPacketProvider::run()
   }
 cleanUp:
   m_fullyStarted = true;
+  m_demuxFinished = true;
   m_syncer.wakeAll();
   m_locker.unlock();
   exit();
 }
+
+void AVPacketProvider::_recordDemuxed(const AVPacket *packet)
+{
+  qint64 ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+  if(ts != AV_NOPTS_VALUE)
+    m_demuxedTime = av_rescale_q(ts, m_pFormatCtx->streams[packet->stream_index]->time_base, AV_TIME_BASE_Q);
+}
@@ -3,6 +3,8 @@
 #include <QThread>
 #include <QMutex>
 #include <QWaitCondition>
+#include <atomic>
+#include "avthreadpolicy.hpp"
 #include <QSet>
 #include <QHash>
 #include <QQueue>
@@ -36,20 +38,39 @@ public:
   AVPacket *getPacket_lockfree(int iStream);
   void returnPacket_lockfree(int iStream, AVPacket *packet);
   void clearQueue_lockfree();
+  // earliest timestamp of the packets read but not yet taken, in AV_TIME_BASE units, AV_NOPTS_VALUE if none
+  qint64 queuedTime_lockfree() const;
+  // timestamp of the last packet demuxed for a selected stream, taken or not, AV_NOPTS_VALUE after clearing
+  qint64 demuxedTime_lockfree() const;
+
+  // demux on the calling thread, only valid while the provider thread is not running
+  AVPacket *readPacket_inline(int iStream);
+  // next packet of any stream in file order, packets queued before go first
+  AVPacket *readAnyPacket_inline();
 
   void requestStart();
+
+  void setThreadRole(AVThreadPolicy::Role v);
+  AVThreadPolicy::Role threadRole() const;
   void waitUntilFullyStarted_lockfree();
 
 protected:
   void run() override;
 
 private:
+  void _recordDemuxed(const AVPacket *packet);
+
   AVFormatContext *m_pFormatCtx;
 
   StreamDict m_streamQueueDict;
   int m_queueSize;
 
   bool m_fullyStarted;
+  // set once run() ended at EOF or on interruption, readers stop waiting then
+  bool m_demuxFinished;
+  qint64 m_demuxedTime;
+
+  std::atomic<int> m_threadRole;
 
   QMutex m_locker;
   QWaitCondition m_syncer;
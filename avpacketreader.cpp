@@ -0,0 +1,119 @@
+#include "avpacketreader.hpp"
+#include "avpacketprovider.hpp"
+#include "privateutil.hpp"
+#include <cmath>
+#include <limits>
+
+AVPacketReader::AVPacketReader(const QString &path)
+{
+  m_input = new AVInputContext(path);
+  _initialize();
+}
+
+AVPacketReader::AVPacketReader(const AVMemorySource &source)
+{
+  m_input = new AVInputContext(source);
+  _initialize();
+}
+
+void AVPacketReader::_initialize()
+{
+  m_pFormatCtx = m_input->formatContext();
+  m_packetProvider = nullptr;
+
+  QList<int> streamIndexList;
+  for(int i = 0; i < static_cast<int>(m_pFormatCtx->nb_streams); ++i)
+  {
+    AVMediaType type = m_pFormatCtx->streams[i]->codecpar->codec_type;
+    if(type == AVMEDIA_TYPE_AUDIO || type == AVMEDIA_TYPE_VIDEO || type == AVMEDIA_TYPE_SUBTITLE)
+      streamIndexList.append(i);
+  }
+  selectStreams(streamIndexList);
+}
+
+AVPacketReader::~AVPacketReader()
+{
+  if(m_packetProvider)
+    delete m_packetProvider;
+  delete m_input;
+}
+
+QString AVPacketReader::path() const
+{ return m_input->path(); }
+
+AVFormatContext *AVPacketReader::formatContext() const
+{ return m_pFormatCtx; }
+
+double AVPacketReader::duration() const
+{ return static_cast<double>(m_pFormatCtx->duration) / static_cast<double>(AV_TIME_BASE); }
+
+int AVPacketReader::findStream(AVMediaType type) const
+{
+  for(int i = 0; i < static_cast<int>(m_pFormatCtx->nb_streams); ++i)
+  {
+    if(m_pFormatCtx->streams[i]->codecpar->codec_type == type)
+      return i;
+  }
+  return -1;
+}
+
+void AVPacketReader::selectStreams(const QList<int> &streamIndexList)
+{
+  AVPacketProvider::StreamSet streamSet;
+  for(int iStream:streamIndexList)
+  {
+    if(iStream < 0 || iStream >= static_cast<int>(m_pFormatCtx->nb_streams))
+    {
+      qCritical("Invalid stream #%d.", iStream);
+      throw NoStreamError("Invalid stream.");
+    }
+    streamSet.insert(iStream);
+  }
+  if(streamSet.isEmpty())
+    throw NoStreamError("No stream available.");
+
+  for(int i = 0; i < static_cast<int>(m_pFormatCtx->nb_streams); ++i)
+    m_pFormatCtx->streams[i]->discard = streamSet.contains(i) ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+
+  if(m_packetProvider)
+    delete m_packetProvider;
+  m_packetProvider = new AVPacketProvider(m_pFormatCtx, streamSet);
+}
+
+QList<int> AVPacketReader::selectedStreams() const
+{
+  QList<int> streamIndexList;
+  for(int i = 0; i < static_cast<int>(m_pFormatCtx->nb_streams); ++i)
+  {
+    if(m_pFormatCtx->streams[i]->discard != AVDISCARD_ALL)
+      streamIndexList.append(i);
+  }
+  return streamIndexList;
+}
+
+void AVPacketReader::seek(double time)
+{
+  m_packetProvider->clearQueue_lockfree();
+  qint64 pts = static_cast<qint64>(std::round(time * static_cast<double>(AV_TIME_BASE)));
+  int seekResult = av_seek_frame(m_pFormatCtx, -1, pts, AVSEEK_FLAG_BACKWARD);
+  CHECK_AVRESULT(seekResult, seekResult >= 0);
+}
+
+bool AVPacketReader::readPacket(AVPacket *pOut)
+{
+  Q_ASSERT(pOut);
+  AVPacket *packet = m_packetProvider->readAnyPacket_inline();
+  if(!packet)
+    return false;
+  av_packet_move_ref(pOut, packet);
+  av_packet_free(&packet);
+  return true;
+}
+
+double AVPacketReader::packetTime(const AVPacket *packet) const
+{
+  int64_t ts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+  if(ts == AV_NOPTS_VALUE)
+    return std::numeric_limits<double>::quiet_NaN();
+  return static_cast<double>(ts) * av_q2d(m_pFormatCtx->streams[packet->stream_index]->time_base);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <QString>
+#include <QList>
+#include "avinputcontext.hpp"
+
+extern "C"
+{
+#include <libavutil/avutil.h>
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+class AVPacketProvider;
+
+// Compressed packets of the selected streams in file order, without any
+// decoding, for remuxing and lossless cutting. Packets keep the timestamps
+// of their stream time base and AV_PKT_FLAG_KEY marks keyframes. All audio,
+// video and subtitle streams are selected by default.
+class AVPacketReader final
+{
+public:
+  AVPacketReader(const QString &path);
+  AVPacketReader(const AVMemorySource &source);
+  ~AVPacketReader();
+
+  QString path() const;
+  AVFormatContext *formatContext() const;
+  double duration() const;
+
+  int findStream(AVMediaType type) const;
+  void selectStreams(const QList<int> &streamIndexList);
+  QList<int> selectedStreams() const;
+
+  // continues at the keyframe at or before time
+  void seek(double time);
+
+  bool readPacket(AVPacket *pOut);
+  double packetTime(const AVPacket *packet) const;
+
+private:
+  void _initialize();
+
+  AVInputContext *m_input;
+  AVFormatContext *m_pFormatCtx;
+  AVPacketProvider *m_packetProvider;
+};
@@ -0,0 +1,494 @@
+#include "avpeakoverview.hpp"
+#include "avframeprovider.hpp"
+#include "privateutil.hpp"
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QDebug>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define QFASTAV_PEAK_SSE
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define QFASTAV_PEAK_NEON
+#endif
+
+namespace
+{
+  const char g_sidecarMagic[8] = {'Q', 'F', 'A', 'V', 'P', 'E', 'A', 'K'};
+  const quint32 g_sidecarVersion = 1;
+  // every level halves the bucket count, so 63 levels already cover any 64 bit sample count
+  const quint32 g_maxSidecarLevelCount = 63;
+
+  struct SidecarHeader
+  {
+    char magic[8];
+    quint32 version;
+    quint32 nChannel;
+    quint32 samprate;
+    quint32 baseBucketSize;
+    quint32 levelCount;
+    quint32 reserved;
+    qint64 sourceSize;
+    qint64 sourceModifiedTime;
+    qint64 sampleCount;
+  };
+
+  struct SidecarLevel
+  {
+    qint64 offset;
+    qint64 bucketCount;
+  };
+
+  AVPeakOverview::Peak mergePeak(const AVPeakOverview::Peak &a, const AVPeakOverview::Peak &b)
+  {
+    AVPeakOverview::Peak peak;
+    peak.min = std::min(a.min, b.min);
+    peak.max = std::max(a.max, b.max);
+    return peak;
+  }
+
+  qint16 toPeakValue(float v)
+  { return static_cast<qint16>(std::lround(std::max(-1.0f, std::min(1.0f, v)) * 32767.0f)); }
+}
+
+AVPeakOverview::AVPeakOverview()
+{
+  m_nChannel = 0;
+  m_samprate = 0;
+  m_baseBucketSize = 0;
+  m_sampleCount = 0;
+}
+
+AVPeakOverview::AVPeakOverview(int nChannel, int samprate, int baseBucketSize)
+{
+  Q_ASSERT(nChannel > 0 && samprate > 0 && baseBucketSize > 0);
+  m_nChannel = nChannel;
+  m_samprate = samprate;
+  m_baseBucketSize = baseBucketSize;
+  m_sampleCount = 0;
+  m_levelList.resize(1);
+}
+
+AVPeakOverview::~AVPeakOverview()
+{}
+
+bool AVPeakOverview::load(const QString &sidecarPath, const QString &sourcePath)
+{
+  QSharedPointer<QFile> file(new QFile(sidecarPath));
+  if(!file->open(QFile::ReadOnly))
+    return false;
+
+  qint64 fileSize = file->size();
+  if(fileSize < static_cast<qint64>(sizeof(SidecarHeader)))
+    return false;
+  const uchar *pMap = file->map(0, fileSize);
+  if(!pMap)
+  {
+    qWarning()<<"Failed to map peak sidecar:"<<sidecarPath;
+    return false;
+  }
+
+  SidecarHeader header;
+  memcpy(&header, pMap, sizeof(header));
+  if(memcmp(header.magic, g_sidecarMagic, sizeof(g_sidecarMagic)) != 0 || header.version != g_sidecarVersion)
+    return false;
+  if(header.nChannel == 0 || header.baseBucketSize == 0 || header.levelCount == 0 || header.levelCount >= g_maxSidecarLevelCount)
+    return false;
+  if(static_cast<qint64>(sizeof(SidecarHeader) + sizeof(SidecarLevel) * header.levelCount) > fileSize)
+    return false;
+
+  // a sidecar is only valid for the exact source it was generated from
+  if(!sourcePath.isEmpty())
+  {
+    QFileInfo sourceInfo(sourcePath);
+    if(sourceInfo.size() != header.sourceSize || sourceInfo.lastModified().toMSecsSinceEpoch() != header.sourceModifiedTime)
+      return false;
+  }
+
+  QVector<const Peak*> levelList;
+  QVector<qint64> bucketCountList;
+  for(quint32 i = 0; i < header.levelCount; ++i)
+  {
+    SidecarLevel level;
+    memcpy(&level, pMap + sizeof(SidecarHeader) + sizeof(SidecarLevel) * i, sizeof(level));
+    // compared by division, a forged bucket count must not overflow the size
+    if(level.offset < 0 || level.offset > fileSize || level.bucketCount < 0 || level.offset % alignof(Peak) != 0 ||
+       level.bucketCount > (fileSize - level.offset) / static_cast<qint64>(header.nChannel * sizeof(Peak)))
+      return false;
+    levelList.append(reinterpret_cast<const Peak*>(pMap + level.offset));
+    bucketCountList.append(level.bucketCount);
+  }
+
+  m_nChannel = static_cast<int>(header.nChannel);
+  m_samprate = static_cast<int>(header.samprate);
+  m_baseBucketSize = static_cast<int>(header.baseBucketSize);
+  m_sampleCount = header.sampleCount;
+  m_levelList.clear();
+  m_mappedFile = file;
+  m_mappedLevelList = levelList;
+  m_mappedBucketCountList = bucketCountList;
+  return true;
+}
+
+bool AVPeakOverview::save(const QString &sidecarPath, const QString &sourcePath) const
+{
+  Q_ASSERT(isValid());
+  QFileInfo sourceInfo(sourcePath);
+  int nLevel = levelCount();
+
+  SidecarHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, g_sidecarMagic, sizeof(g_sidecarMagic));
+  header.version = g_sidecarVersion;
+  header.nChannel = static_cast<quint32>(m_nChannel);
+  header.samprate = static_cast<quint32>(m_samprate);
+  header.baseBucketSize = static_cast<quint32>(m_baseBucketSize);
+  header.levelCount = static_cast<quint32>(nLevel);
+  header.sourceSize = sourceInfo.size();
+  header.sourceModifiedTime = sourceInfo.lastModified().toMSecsSinceEpoch();
+  header.sampleCount = m_sampleCount;
+
+  QVector<SidecarLevel> levelList(nLevel);
+  qint64 offset = sizeof(SidecarHeader) + sizeof(SidecarLevel) * nLevel;
+  for(int i = 0; i < nLevel; ++i)
+  {
+    levelList[i].offset = offset;
+    levelList[i].bucketCount = bucketCount(i);
+    offset += bucketCount(i) * m_nChannel * static_cast<qint64>(sizeof(Peak));
+  }
+
+  // write to a temporary file first so a reader never maps a half written sidecar
+  QString tempPath = sidecarPath + QStringLiteral(".part");
+  {
+    QFile file(tempPath);
+    if(!file.open(QFile::WriteOnly | QFile::Truncate))
+    {
+      qWarning()<<"Failed to open peak sidecar for writing:"<<tempPath;
+      return false;
+    }
+    bool ok = file.write(reinterpret_cast<const char*>(&header), sizeof(header)) == sizeof(header);
+    ok = ok && file.write(reinterpret_cast<const char*>(levelList.constData()), sizeof(SidecarLevel) * nLevel) == static_cast<qint64>(sizeof(SidecarLevel) * nLevel);
+    for(int i = 0; ok && i < nLevel; ++i)
+    {
+      qint64 levelSize = bucketCount(i) * m_nChannel * static_cast<qint64>(sizeof(Peak));
+      ok = file.write(reinterpret_cast<const char*>(levelData(i)), levelSize) == levelSize;
+    }
+    if(!ok)
+    {
+      qWarning()<<"Failed to write peak sidecar:"<<tempPath;
+      file.remove();
+      return false;
+    }
+  }
+  QFile::remove(sidecarPath);
+  return QFile::rename(tempPath, sidecarPath);
+}
+
+bool AVPeakOverview::isValid() const
+{ return m_nChannel > 0 && levelCount() > 0; }
+
+int AVPeakOverview::channelCount() const
+{ return m_nChannel; }
+
+int AVPeakOverview::samprate() const
+{ return m_samprate; }
+
+int AVPeakOverview::baseBucketSize() const
+{ return m_baseBucketSize; }
+
+qint64 AVPeakOverview::sampleCount() const
+{ return m_sampleCount; }
+
+int AVPeakOverview::levelCount() const
+{ return m_mappedFile ? m_mappedLevelList.size() : m_levelList.size(); }
+
+qint64 AVPeakOverview::bucketCount(int level) const
+{
+  Q_ASSERT(level >= 0 && level < levelCount());
+  if(m_mappedFile)
+    return m_mappedBucketCountList.at(level);
+  else
+    return m_levelList.at(level).size() / m_nChannel;
+}
+
+qint64 AVPeakOverview::samplesPerBucket(int level) const
+{
+  Q_ASSERT(level >= 0 && level < levelCount());
+  return static_cast<qint64>(m_baseBucketSize) << level;
+}
+
+int AVPeakOverview::levelForBucketCount(qint64 maxBucketCount) const
+{
+  int nLevel = levelCount();
+  for(int i = 0; i < nLevel; ++i)
+  {
+    if(bucketCount(i) <= maxBucketCount)
+      return i;
+  }
+  return nLevel - 1;
+}
+
+const AVPeakOverview::Peak *AVPeakOverview::levelData(int level) const
+{
+  Q_ASSERT(level >= 0 && level < levelCount());
+  if(m_mappedFile)
+    return m_mappedLevelList.at(level);
+  else
+    return m_levelList.at(level).constData();
+}
+
+AVPeakOverview::Peak AVPeakOverview::peak(int level, int iChannel, qint64 iBucket) const
+{
+  Q_ASSERT(iChannel >= 0 && iChannel < m_nChannel);
+  Q_ASSERT(iBucket >= 0 && iBucket < bucketCount(level));
+  return levelData(level)[iBucket * m_nChannel + iChannel];
+}
+
+void AVPeakOverview::_appendBaseBucket(const AVPeakOverview::Peak *pPeakList)
+{
+  Q_ASSERT(!m_mappedFile);
+  QVector<Peak> &baseLevel = m_levelList[0];
+  for(int i = 0; i < m_nChannel; ++i)
+    baseLevel.append(pPeakList[i]);
+
+  // every second bucket completes one bucket of the next level
+  for(int level = 0; bucketCount(level) % 2 == 0; ++level)
+  {
+    const Peak *pLast = m_levelList.at(level).constData() + (bucketCount(level) - 1) * m_nChannel;
+    _appendMerged(level + 1, pLast - m_nChannel, pLast);
+  }
+}
+
+void AVPeakOverview::_finish(qint64 sampleCount)
+{
+  Q_ASSERT(!m_mappedFile);
+  m_sampleCount = sampleCount;
+
+  // merge the pairs the scan left open, level by level until one bucket covers everything
+  for(int level = 0; bucketCount(level) > 1; ++level)
+  {
+    qint64 nBucket = bucketCount(level);
+    qint64 nMerged = level + 1 < m_levelList.size() ? bucketCount(level + 1) : 0;
+    for(qint64 i = nMerged * 2; i < nBucket; i += 2)
+    {
+      const Peak *pA = m_levelList.at(level).constData() + i * m_nChannel;
+      _appendMerged(level + 1, pA, i + 1 < nBucket ? pA + m_nChannel : pA);
+    }
+  }
+}
+
+void AVPeakOverview::_appendMerged(int level, const AVPeakOverview::Peak *pA, const AVPeakOverview::Peak *pB)
+{
+  if(m_levelList.size() <= level)
+    m_levelList.resize(level + 1);
+  QVector<Peak> &target = m_levelList[level];
+  // pA/pB may point into a lower level, which is never reallocated here
+  for(int i = 0; i < m_nChannel; ++i)
+    target.append(mergePeak(pA[i], pB[i]));
+}
+
+AVPeakGenerator::AVPeakGenerator(const QString &sourcePath, const QString &sidecarPath, int baseBucketSize, QObject *parent) : QThread(parent)
+{
+  Q_ASSERT(baseBucketSize > 0);
+  m_sourcePath = sourcePath;
+  m_sidecarPath = sidecarPath;
+  m_baseBucketSize = baseBucketSize;
+  m_succeeded = false;
+}
+
+AVPeakGenerator::~AVPeakGenerator()
+{ requestStop(false); }
+
+QString AVPeakGenerator::defaultSidecarPath(const QString &sourcePath)
+{ return sourcePath + QStringLiteral(".qfpeak"); }
+
+QString AVPeakGenerator::sourcePath() const
+{ return m_sourcePath; }
+
+QString AVPeakGenerator::sidecarPath() const
+{ return m_sidecarPath; }
+
+void AVPeakGenerator::requestStop(bool async)
+{
+  requestInterruption();
+  if(!async)
+    wait();
+}
+
+bool AVPeakGenerator::isSucceeded() const
+{ return m_succeeded; }
+
+AVPeakOverview AVPeakGenerator::overview() const
+{
+  QMutexLocker locker(&m_locker);
+  return m_overview;
+}
+
+qint64 AVPeakGenerator::readyBucketCount() const
+{
+  QMutexLocker locker(&m_locker);
+  return m_overview.isValid() ? m_overview.bucketCount(0) : 0;
+}
+
+void AVPeakGenerator::run()
+{
+  m_succeeded = false;
+  // a sidecar still matching the source makes decoding unnecessary
+  AVPeakOverview cached;
+  if(!m_sidecarPath.isEmpty() && cached.load(m_sidecarPath, m_sourcePath))
+  {
+    m_locker.lock();
+    m_overview = cached;
+    qint64 ready = m_overview.bucketCount(0);
+    m_locker.unlock();
+    m_succeeded = true;
+    emit progress(ready, ready);
+    emit done(true);
+    return;
+  }
+
+  try
+  {
+    AVFrameProvider provider(m_sourcePath, true, false);
+    int nChannel = provider.audioChannelCount();
+    int samprate = provider.audioSamprate();
+    qint64 estimatedBucketCount = std::max(qint64(0), static_cast<qint64>(provider.duration() * samprate) / m_baseBucketSize);
+
+    m_locker.lock();
+    m_overview = AVPeakOverview(nChannel, samprate, m_baseBucketSize);
+    m_locker.unlock();
+
+    QVector<float> buffer;
+    // seeded empty, a bucket of only positive or only negative samples must not include 0
+    const float infinity = std::numeric_limits<float>::infinity();
+    QVector<float> bucketMin(nChannel, infinity), bucketMax(nChannel, -infinity);
+    QVector<AVPeakOverview::Peak> bucket(nChannel);
+    int bucketFill = 0;
+    qint64 sampleCount = 0;
+    qint64 lastReported = 0;
+
+    auto flushBucket = [&](){
+      for(int i = 0; i < nChannel; ++i)
+      {
+        bucket[i].min = toPeakValue(bucketMin[i]);
+        bucket[i].max = toPeakValue(bucketMax[i]);
+        bucketMin[i] = infinity;
+        bucketMax[i] = -infinity;
+      }
+      m_locker.lock();
+      m_overview._appendBaseBucket(bucket.constData());
+      m_locker.unlock();
+      bucketFill = 0;
+    };
+
+    provider.startDecoder(true);
+    while(!isInterruptionRequested() && provider.nextAudioFrame())
+    {
+      const AVFrame *pFrame = provider.currentAudioFrame();
+      int nSample = pFrame->nb_samples;
+      if(buffer.size() < nSample * nChannel)
+        buffer.resize(nSample * nChannel);
+      for(int i = 0; i < nChannel; ++i)
+        readAudioFrameAsFloat(pFrame, i, buffer.data() + i * nSample);
+
+      int iSample = 0;
+      while(iSample < nSample)
+      {
+        int nChunk = std::min(nSample - iSample, m_baseBucketSize - bucketFill);
+        for(int i = 0; i < nChannel; ++i)
+          _minMax(buffer.constData() + i * nSample + iSample, nChunk, &bucketMin[i], &bucketMax[i]);
+        bucketFill += nChunk;
+        iSample += nChunk;
+        if(bucketFill == m_baseBucketSize)
+          flushBucket();
+      }
+      sampleCount += nSample;
+
+      qint64 ready = sampleCount / m_baseBucketSize;
+      if(ready - lastReported >= 1024)
+      {
+        lastReported = ready;
+        emit progress(ready, std::max(ready, estimatedBucketCount));
+      }
+    }
+    if(!isInterruptionRequested())
+    {
+      if(bucketFill > 0)
+        flushBucket();
+
+      m_locker.lock();
+      m_overview._finish(sampleCount);
+      qint64 ready = m_overview.bucketCount(0);
+      bool saved = m_sidecarPath.isEmpty() || m_overview.save(m_sidecarPath, m_sourcePath);
+      m_locker.unlock();
+      if(!saved)
+        qWarning()<<"Failed to save peak sidecar:"<<m_sidecarPath;
+
+      m_succeeded = true;
+      emit progress(ready, ready);
+    }
+  }
+  catch(const std::exception &e)
+  {
+    qCritical()<<"Failed to generate peak overview:"<<e.what();
+  }
+  emit done(m_succeeded);
+}
+
+void AVPeakGenerator::_minMax(const float *pData, int n, float *pMin, float *pMax)
+{
+  float minValue = *pMin, maxValue = *pMax;
+  int i = 0;
+#if defined(QFASTAV_PEAK_SSE)
+  if(n >= 4)
+  {
+    __m128 vMin = _mm_set1_ps(minValue), vMax = _mm_set1_ps(maxValue);
+    for(; i + 4 <= n; i += 4)
+    {
+      __m128 v = _mm_loadu_ps(pData + i);
+      vMin = _mm_min_ps(vMin, v);
+      vMax = _mm_max_ps(vMax, v);
+    }
+    alignas(16) float minList[4], maxList[4];
+    _mm_store_ps(minList, vMin);
+    _mm_store_ps(maxList, vMax);
+    for(int j = 0; j < 4; ++j)
+    {
+      minValue = std::min(minValue, minList[j]);
+      maxValue = std::max(maxValue, maxList[j]);
+    }
+  }
+#elif defined(QFASTAV_PEAK_NEON)
+  if(n >= 4)
+  {
+    float32x4_t vMin = vdupq_n_f32(minValue), vMax = vdupq_n_f32(maxValue);
+    for(; i + 4 <= n; i += 4)
+    {
+      float32x4_t v = vld1q_f32(pData + i);
+      vMin = vminq_f32(vMin, v);
+      vMax = vmaxq_f32(vMax, v);
+    }
+    float minList[4], maxList[4];
+    vst1q_f32(minList, vMin);
+    vst1q_f32(maxList, vMax);
+    for(int j = 0; j < 4; ++j)
+    {
+      minValue = std::min(minValue, minList[j]);
+      maxValue = std::max(maxValue, maxList[j]);
+    }
+  }
+#endif
+  for(; i < n; ++i)
+  {
+    minValue = std::min(minValue, pData[i]);
+    maxValue = std::max(maxValue, pData[i]);
+  }
+  *pMin = minValue;
+  *pMax = maxValue;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <QThread>
+#include <QMutex>
+#include <QString>
+#include <QVector>
+#include <QSharedPointer>
+#include <atomic>
+
+class QFile;
+
+// Multi-resolution min/max overview of an audio stream. Level 0 buckets cover
+// baseBucketSize() samples, every further level halves the bucket count.
+class AVPeakOverview final
+{
+public:
+  struct Peak
+  {
+    qint16 min, max;
+  };
+
+  AVPeakOverview();
+  AVPeakOverview(int nChannel, int samprate, int baseBucketSize);
+  ~AVPeakOverview();
+
+  bool load(const QString &sidecarPath, const QString &sourcePath = QString());
+  bool save(const QString &sidecarPath, const QString &sourcePath) const;
+
+  bool isValid() const;
+  int channelCount() const;
+  int samprate() const;
+  int baseBucketSize() const;
+  qint64 sampleCount() const;
+
+  int levelCount() const;
+  qint64 bucketCount(int level) const;
+  qint64 samplesPerBucket(int level) const;
+  int levelForBucketCount(qint64 maxBucketCount) const;
+
+  // peaks of one level, interleaved by channel
+  const Peak *levelData(int level) const;
+  Peak peak(int level, int iChannel, qint64 iBucket) const;
+
+private:
+  friend class AVPeakGenerator;
+
+  void _appendBaseBucket(const Peak *pPeakList);
+  void _finish(qint64 sampleCount);
+  void _appendMerged(int level, const Peak *pA, const Peak *pB);
+
+  int m_nChannel, m_samprate, m_baseBucketSize;
+  qint64 m_sampleCount;
+
+  // either built in memory or mapped from a sidecar file
+  QVector<QVector<Peak>> m_levelList;
+  QSharedPointer<QFile> m_mappedFile;
+  QVector<const Peak*> m_mappedLevelList;
+  QVector<qint64> m_mappedBucketCountList;
+};
+
+class AVPeakGenerator final : public QThread
+{
+  Q_OBJECT
+
+public:
+  AVPeakGenerator(const QString &sourcePath, const QString &sidecarPath = QString(), int baseBucketSize = 256, QObject *parent = nullptr);
+  ~AVPeakGenerator();
+
+  static QString defaultSidecarPath(const QString &sourcePath);
+
+  QString sourcePath() const;
+  QString sidecarPath() const;
+
+  void requestStop(bool async = true);
+  bool isSucceeded() const;
+
+  AVPeakOverview overview() const;
+  qint64 readyBucketCount() const;
+
+signals:
+  void progress(qint64 readyBucketCount, qint64 estimatedBucketCount);
+  void done(bool succeeded);
+
+protected:
+  void run() override;
+
+private:
+  static void _minMax(const float *pData, int n, float *pMin, float *pMax);
+
+  QString m_sourcePath, m_sidecarPath;
+  int m_baseBucketSize;
+  std::atomic<bool> m_succeeded;
+
+  AVPeakOverview m_overview;
+  mutable QMutex m_locker;
+};
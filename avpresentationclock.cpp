@@ -0,0 +1,58 @@
+#include "avpresentationclock.hpp"
+
+AVPresentationClock::AVPresentationClock()
+{
+  m_baseTime = 0.0;
+  m_running = false;
+}
+
+void AVPresentationClock::start(double time)
+{
+  QMutexLocker locker(&m_locker);
+  m_baseTime = time;
+  m_timer.start();
+  m_running = true;
+}
+
+void AVPresentationClock::pause()
+{
+  QMutexLocker locker(&m_locker);
+  if(m_running)
+  {
+    m_baseTime += static_cast<double>(m_timer.nsecsElapsed()) / 1e9;
+    m_running = false;
+  }
+}
+
+void AVPresentationClock::resume()
+{
+  QMutexLocker locker(&m_locker);
+  if(!m_running)
+  {
+    m_timer.start();
+    m_running = true;
+  }
+}
+
+void AVPresentationClock::setTime(double time)
+{
+  QMutexLocker locker(&m_locker);
+  m_baseTime = time;
+  if(m_running)
+    m_timer.start();
+}
+
+double AVPresentationClock::time() const
+{
+  QMutexLocker locker(&m_locker);
+  if(m_running)
+    return m_baseTime + static_cast<double>(m_timer.nsecsElapsed()) / 1e9;
+  else
+    return m_baseTime;
+}
+
+bool AVPresentationClock::isRunning() const
+{
+  QMutexLocker locker(&m_locker);
+  return m_running;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <QMutex>
+#include <QElapsedTimer>
+
+// Wall clock driven presentation time in seconds, shared between the thread
+// presenting frames and the providers adapting to it.
+class AVPresentationClock final
+{
+public:
+  AVPresentationClock();
+
+  void start(double time = 0.0);
+  void pause();
+  void resume();
+  void setTime(double time);
+
+  double time() const;
+  bool isRunning() const;
+
+private:
+  mutable QMutex m_locker;
+  QElapsedTimer m_timer;
+  double m_baseTime;
+  bool m_running;
+};
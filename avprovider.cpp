@@ -1,98 +1,193 @@
 #include "avprovider.hpp"
 #include "avframeprovider.hpp"
+#include "avthreadpolicy.hpp"
 #include <QThread>
+#include <QThreadPool>
+#include <QRunnable>
 #include <QMutex>
 #include <QWaitCondition>
 #include <QVarLengthArray>
+#include <QDebug>
+#include <algorithm>
+#include <atomic>
 
 struct Ticket
 {
   QString path;
   AVFrameProvider* provider;
+  // wanted state and the pending updates applying it, stateLocker serializes them
+  std::atomic<bool> hot;
+  std::atomic<int> pendingCount;
+  QMutex stateLocker;
 };
 
-class TicketProvider final : public QThread
+class TicketProvider final
 {
 public:
-  TicketProvider(bool enableAudio, bool enableVideo, QObject *parent = nullptr) : QThread(parent)
+  TicketProvider(bool enableAudio, bool enableVideo)
   {
     m_enableAudio = enableAudio;
     m_enableVideo = enableVideo;
+    m_openerPool.setMaxThreadCount(QThread::idealThreadCount());
   }
 
   ~TicketProvider()
-  {
-    requestInterruption();
-    m_syncer.wakeAll();
-    wait();
-    for(Ticket *ticket:m_ticketQueue)
-    {
-      if(ticket->provider)
-        delete ticket->provider;
-      delete ticket;
-    }
-  }
+  { requestStop(false); }
 
-  Ticket *createTicket(const QString &path)
+  Ticket *createTicket(const QString &path, bool hot)
   {
     auto ticket = new Ticket;
     ticket->path = path;
     ticket->provider = nullptr;
+    ticket->hot = hot;
+    ticket->pendingCount = 0;
 
-    m_locker.lock();
-    m_ticketQueue.append(ticket);
-    m_locker.unlock();
-    m_syncer.wakeAll();
+    m_openerPool.start(new TicketOpener(this, ticket));
 
     return ticket;
   }
 
   void ensureTicket(Ticket *ticket)
   {
-    volatile AVFrameProvider *provider = ticket->provider;
     m_locker.lock();
-    while(!provider)
-    {
-      m_syncer.wakeAll();
+    while(!ticket->provider)
       m_syncer.wait(&m_locker);
-      provider = ticket->provider;
-    }
     m_locker.unlock();
     Q_ASSERT(ticket->provider);
   }
 
+  // waits for the provider and all pending updates, for deleting the ticket
+  void settleTicket(Ticket *ticket)
+  {
+    m_locker.lock();
+    while(!ticket->provider || ticket->pendingCount > 0)
+      m_syncer.wait(&m_locker);
+    m_locker.unlock();
+  }
+
+  // the provider is only touched under stateLocker while updates may be pending
+  void ensureAwake(Ticket *ticket)
+  {
+    ensureTicket(ticket);
+    ticket->hot = true;
+    ticket->stateLocker.lock();
+    if(ticket->provider->isHibernated())
+      ticket->provider->resume();
+    ticket->stateLocker.unlock();
+  }
+
+  void stopTicket(Ticket *ticket)
+  {
+    ensureTicket(ticket);
+    ticket->stateLocker.lock();
+    ticket->provider->stopDecoder(true);
+    ticket->stateLocker.unlock();
+  }
+
+  void setTicketHot(Ticket *ticket, bool hot)
+  {
+    if(ticket->hot == hot)
+      return;
+    ticket->hot = hot;
+    ++ticket->pendingCount;
+    m_openerPool.start(new TicketUpdater(this, ticket));
+  }
+
+  void setMaxConcurrentOpenCount(int v)
+  {
+    Q_ASSERT(v > 0);
+    m_openerPool.setMaxThreadCount(v);
+  }
+
+  int maxConcurrentOpenCount() const
+  { return m_openerPool.maxThreadCount(); }
+
   void requestStop(bool async = true)
   {
-    requestInterruption();
-    m_syncer.wakeAll();
+    // tickets which are not started yet will never be ensured after stop
+    m_openerPool.clear();
     if(!async)
-      wait();
+      m_openerPool.waitForDone();
   }
 
-protected:
-  void run() override
+private:
+  class TicketOpener final : public QRunnable
   {
-    m_locker.lock();
-    while(!isInterruptionRequested())
+  public:
+    TicketOpener(TicketProvider *provider, Ticket *ticket)
     {
-      for(Ticket *ticket:m_ticketQueue)
-      {
-        Q_ASSERT(!ticket->provider);
-        ticket->provider = new AVFrameProvider(ticket->path, m_enableAudio, m_enableVideo);
-        ticket->provider->startDecoder(true);
-        m_syncer.wakeAll();
-      }
-      m_ticketQueue.clear();
+      m_provider = provider;
+      m_ticket = ticket;
+    }
 
-      m_syncer.wakeAll();
-      m_syncer.wait(&m_locker);
+    void run() override
+    { m_provider->_openTicket(m_ticket); }
+
+  private:
+    TicketProvider *m_provider;
+    Ticket *m_ticket;
+  };
+
+  class TicketUpdater final : public QRunnable
+  {
+  public:
+    TicketUpdater(TicketProvider *provider, Ticket *ticket)
+    {
+      m_provider = provider;
+      m_ticket = ticket;
     }
+
+    // also runs for updates dropped by requestStop(), so settleTicket() never hangs
+    ~TicketUpdater()
+    { m_provider->_finishUpdate(m_ticket); }
+
+    void run() override
+    { m_provider->_updateTicket(m_ticket); }
+
+  private:
+    TicketProvider *m_provider;
+    Ticket *m_ticket;
+  };
+
+  void _updateTicket(Ticket *ticket)
+  {
+    ensureTicket(ticket);
+    ticket->stateLocker.lock();
+    if(ticket->hot && ticket->provider->isHibernated())
+      ticket->provider->resume();
+    else if(!ticket->hot && !ticket->provider->isHibernated())
+      ticket->provider->hibernate();
+    ticket->stateLocker.unlock();
+  }
+
+  void _finishUpdate(Ticket *ticket)
+  {
+    m_locker.lock();
+    --ticket->pendingCount;
+    m_syncer.wakeAll();
+    m_locker.unlock();
+  }
+
+  void _openTicket(Ticket *ticket)
+  {
+    Q_ASSERT(!ticket->provider);
+    AVThreadPolicy::applyToCurrentThread(AVThreadPolicy::OpenRole);
+    auto provider = new AVFrameProvider(ticket->path, m_enableAudio, m_enableVideo);
+    provider->setThreadRole(AVThreadPolicy::PreloadRole);
+    provider->startDecoder(true);
+    ticket->stateLocker.lock();
+    if(!ticket->hot)
+      provider->hibernate();
+    ticket->stateLocker.unlock();
+
+    m_locker.lock();
+    ticket->provider = provider;
+    m_syncer.wakeAll();
     m_locker.unlock();
   }
 
-private:
   bool m_enableAudio, m_enableVideo;
-  QVarLengthArray<Ticket*, 128> m_ticketQueue;
+  QThreadPool m_openerPool;
 
   QMutex m_locker;
   QWaitCondition m_syncer;
@@ -111,14 +206,14 @@ public:
     requestStop(false);
     for(Ticket *ticket:m_workQueue)
     {
-      m_provider->ensureTicket(ticket);
+      m_provider->settleTicket(ticket);
       if(ticket->provider)
         delete ticket->provider;
       delete ticket;
     }
     for(Ticket *ticket:m_mainQueue)
     {
-      m_provider->ensureTicket(ticket);
+      m_provider->settleTicket(ticket);
       if(ticket->provider)
         delete ticket->provider;
       delete ticket;
@@ -144,6 +239,7 @@ public:
 protected:
   void run() override
   {
+    AVThreadPolicy::applyToCurrentThread(AVThreadPolicy::TeardownRole);
     m_syncLocker.lock();
     while(!isInterruptionRequested())
     {
@@ -154,7 +250,7 @@ protected:
 
       for(Ticket *ticket:m_workQueue)
       {
-        m_provider->ensureTicket(ticket);
+        m_provider->settleTicket(ticket);
         if(ticket->provider)
           delete ticket->provider;
         delete ticket;
@@ -176,11 +272,35 @@ private:
   QWaitCondition m_syncer;
 };
 
+class FileWarmer final : public QRunnable
+{
+public:
+  FileWarmer(const QString &path)
+  { m_path = path; }
+
+  void run() override
+  {
+    AVThreadPolicy::applyToCurrentThread(AVThreadPolicy::PreloadRole);
+    try
+    {
+      AVFrameProvider::warmUp(m_path);
+    }
+    catch(const std::exception &e)
+    {
+      qWarning()<<"Failed to warm up"<<m_path<<e.what();
+    }
+  }
+
+private:
+  QString m_path;
+};
+
 struct PlayQueueItem
 {
   QString path;
   QQueue<Ticket*> providerQueue;
   int availableProvider;
+  bool warmedUp;
 };
 
 
@@ -188,18 +308,27 @@ AVProvider::AVProvider(bool enableVideo, bool enableAudio)
 {
   Q_ASSERT(enableVideo || enableAudio);
   m_maxPreloadCount = 3;
+  m_maxWarmupCount = 16;
+  m_maxHotCount = 2;
   m_enableVideo = enableVideo;
   m_enableAudio = enableAudio;
   m_ticketProvider = new TicketProvider(enableAudio, enableVideo);
   m_ticketDeleter = new TicketDeleter(m_ticketProvider);
+  m_warmerPool = new QThreadPool;
+  m_warmerPool->setMaxThreadCount(2);
   m_iCurrentPlaying = 0;
 
-  m_ticketProvider->start();
   m_ticketDeleter->start();
 }
 
 AVProvider::~AVProvider()
 {
+  if(m_warmerPool)
+  {
+    m_warmerPool->clear();
+    m_warmerPool->waitForDone();
+    delete m_warmerPool;
+  }
   if(m_ticketDeleter)
     delete m_ticketDeleter;
   if(m_ticketProvider)
@@ -217,6 +346,7 @@ void AVProvider::insertToPlayQueue(int before, const QString &path)
   PlayQueueItem *item = new PlayQueueItem;
   item->path = path;
   item->availableProvider = 0;
+  item->warmedUp = false;
   m_playQueue.insert(before, item);
   _preload();
 }
@@ -226,10 +356,7 @@ void AVProvider::deleteFromPlayQueue(int i)
   PlayQueueItem *item = m_playQueue.at(i);
 
   for(auto ticket:item->providerQueue)
-  {
-    m_ticketProvider->ensureTicket(ticket);
-    ticket->provider->stopDecoder(true);
-  }
+    m_ticketProvider->stopTicket(ticket);
   for(auto ticket:item->providerQueue)
     m_ticketDeleter->deleteTicket(ticket);
 }
@@ -255,6 +382,38 @@ void AVProvider::setMaxPreloadCount(int v)
 int AVProvider::maxPreloadCount() const
 { return m_maxPreloadCount; }
 
+void AVProvider::setMaxWarmupCount(int v)
+{
+  Q_ASSERT(v >= 0);
+  if(m_maxWarmupCount != v)
+  {
+    m_maxWarmupCount = v;
+    _preload();
+  }
+}
+
+int AVProvider::maxWarmupCount() const
+{ return m_maxWarmupCount; }
+
+void AVProvider::setMaxHotCount(int v)
+{
+  Q_ASSERT(v > 0);
+  if(m_maxHotCount != v)
+  {
+    m_maxHotCount = v;
+    _preload();
+  }
+}
+
+int AVProvider::maxHotCount() const
+{ return m_maxHotCount; }
+
+void AVProvider::setMaxConcurrentOpenCount(int v)
+{ m_ticketProvider->setMaxConcurrentOpenCount(v); }
+
+int AVProvider::maxConcurrentOpenCount() const
+{ return m_ticketProvider->maxConcurrentOpenCount(); }
+
 bool AVProvider::enableVideo() const
 { return m_enableVideo; }
 
@@ -264,7 +423,9 @@ bool AVProvider::enableAudio() const
 AVFrameProvider *AVProvider::currentFrameProvider()
 {
   auto ticket = m_playQueue.at(m_iCurrentPlaying)->providerQueue.first();
-  m_ticketProvider->ensureTicket(ticket);
+  m_ticketProvider->ensureAwake(ticket);
+  if(ticket->provider->threadRole() != AVThreadPolicy::PlaybackRole)
+    ticket->provider->setThreadRole(AVThreadPolicy::PlaybackRole);
   return ticket->provider;
 }
 
@@ -272,16 +433,37 @@ bool AVProvider::nextFrame()
 {
   int result = currentFrameProvider()->nextFrame();
   if(!result)
-  {
-    auto ticket = m_playQueue.at(m_iCurrentPlaying)->providerQueue.dequeue();
-    m_ticketDeleter->deleteTicket(ticket);
-    m_iCurrentPlaying = (m_iCurrentPlaying + 1) % m_playQueue.size();
-
-    _preload();
-  }
+    nextItem();
   return result;
 }
 
+AVFrameProvider *AVProvider::peekFrameProvider(int offset)
+{
+  Q_ASSERT(offset >= 0);
+  if(offset == 0)
+    return currentFrameProvider();
+  if(offset >= m_maxPreloadCount || m_playQueue.isEmpty())
+    return nullptr;
+
+  // a short queue repeats inside the preload window, every repetition has its own ticket
+  PlayQueueItem *item = m_playQueue.at((m_iCurrentPlaying + offset) % m_playQueue.size());
+  int iTicket = offset / m_playQueue.size();
+  if(iTicket >= item->providerQueue.size())
+    return nullptr;
+  auto ticket = item->providerQueue.at(iTicket);
+  m_ticketProvider->ensureAwake(ticket);
+  return ticket->provider;
+}
+
+void AVProvider::nextItem()
+{
+  auto ticket = m_playQueue.at(m_iCurrentPlaying)->providerQueue.dequeue();
+  m_ticketDeleter->deleteTicket(ticket);
+  m_iCurrentPlaying = (m_iCurrentPlaying + 1) % m_playQueue.size();
+
+  _preload();
+}
+
 void AVProvider::_preload()
 {
   int preloaded = 0;
@@ -291,18 +473,42 @@ void AVProvider::_preload()
     item->availableProvider = 0;
 
   // keep provider
+  int i = m_iCurrentPlaying;
+  while(preloaded < m_maxPreloadCount)
   {
-    int i = m_iCurrentPlaying;
-    while(preloaded < m_maxPreloadCount)
-    {
-      PlayQueueItem *item = m_playQueue.at(i);
+    PlayQueueItem *item = m_playQueue.at(i);
+    bool hot = preloaded < m_maxHotCount;
 
-      if(item->providerQueue.size() < ++item->availableProvider)
-        item->providerQueue.enqueue(m_ticketProvider->createTicket(item->path));
+    if(item->providerQueue.size() < ++item->availableProvider)
+      item->providerQueue.enqueue(m_ticketProvider->createTicket(item->path, hot));
+    else
+      m_ticketProvider->setTicketHot(item->providerQueue.at(item->availableProvider - 1), hot);
+
+    ++preloaded;
+    i = (i + 1) % m_playQueue.size();
+  }
 
-      ++preloaded;
+  // warm up files further ahead, items leaving the window may need it again later
+  {
+    QVarLengthArray<PlayQueueItem*, 128> warmupList;
+    for(int nWarmup = 0; nWarmup < std::min(m_maxWarmupCount, m_playQueue.size()); ++nWarmup)
+    {
+      warmupList.append(m_playQueue.at(i));
       i = (i + 1) % m_playQueue.size();
     }
+    for(PlayQueueItem *item:m_playQueue)
+    {
+      if(item->availableProvider == 0 && !warmupList.contains(item))
+        item->warmedUp = false;
+    }
+    for(PlayQueueItem *item:warmupList)
+    {
+      if(item->availableProvider == 0 && !item->warmedUp)
+      {
+        item->warmedUp = true;
+        m_warmerPool->start(new FileWarmer(item->path));
+      }
+    }
   }
 
   // request stop unused
@@ -311,9 +517,7 @@ void AVProvider::_preload()
     auto end = item->providerQueue.end();
     for(auto it = item->providerQueue.begin() + item->availableProvider; it < end; ++it)
     {
-      auto ticket = *it;
-      m_ticketProvider->ensureTicket(ticket);
-      ticket->provider->stopDecoder(true);
+      m_ticketProvider->stopTicket(*it);
     }
   }
 
@@ -3,6 +3,7 @@
 #include <QQueue>
 #include <QString>
 
+class QThreadPool;
 class AVFrameProvider;
 class TicketProvider;
 class TicketDeleter;
@@ -21,24 +22,47 @@ public:
   int currentPlayingIndex() const;
   QString pathAt(int i) const;
 
+  // Items right after the current one get a running decoder, the next
+  // maxWarmupCount items beyond those only have their files warmed up.
   void setMaxPreloadCount(int v);
   int maxPreloadCount() const;
 
+  void setMaxWarmupCount(int v);
+  int maxWarmupCount() const;
+
+  // Only the first maxHotCount preloaded items keep their decoders, the
+  // others are hibernated after prerolling and resumed once they move up.
+  void setMaxHotCount(int v);
+  int maxHotCount() const;
+
+  void setMaxConcurrentOpenCount(int v);
+  int maxConcurrentOpenCount() const;
+
   bool enableVideo() const;
   bool enableAudio() const;
 
   AVFrameProvider *currentFrameProvider();
   bool nextFrame();
 
+  // Provider of the item offset places after the current one, while it is
+  // within the preload window (nullptr beyond it). Lets a consumer such as
+  // AVAudioMixer start the next item early, nextItem() then drops the
+  // current one.
+  AVFrameProvider *peekFrameProvider(int offset);
+  void nextItem();
+
 private:
   void _preload();
 
   int m_maxPreloadCount;
+  int m_maxWarmupCount;
+  int m_maxHotCount;
   bool m_enableVideo, m_enableAudio;
 
   QQueue<PlayQueueItem *> m_playQueue;
 
   TicketProvider *m_ticketProvider;
   TicketDeleter *m_ticketDeleter;
+  QThreadPool *m_warmerPool;
   int m_iCurrentPlaying;
 };
@@ -0,0 +1,222 @@
+#include "avremuxsink.hpp"
+#include "avpacketreader.hpp"
+#include "privateutil.hpp"
+#include <QDebug>
+#include <QSet>
+
+namespace
+{
+  const int g_ioBufferSize = 64 * 1024;
+}
+
+AVRemuxSink::AVRemuxSink(const QString &path, const QString &formatName)
+{
+  m_pIOCtx = nullptr;
+  m_pFormatCtx = nullptr;
+  m_headerWritten = false;
+  m_finished = false;
+
+  m_file.setFileName(path);
+  if(!m_file.open(QFile::WriteOnly | QFile::Truncate))
+  {
+    qCritical()<<"Failed to open file for writing:"<<path;
+    throw IOError("Failed to open file for writing.");
+  }
+
+  QByteArray formatNameUtf8 = formatName.toUtf8();
+  QByteArray pathUtf8 = path.toUtf8();
+  int allocResult = avformat_alloc_output_context2(&m_pFormatCtx, nullptr, formatName.isEmpty() ? nullptr : formatNameUtf8.constData(), pathUtf8.constData());
+  CHECK_AVRESULT(allocResult, allocResult >= 0 && m_pFormatCtx);
+
+  // the muxer owns nothing of the io context, it is freed here
+  unsigned char *ioBuffer = reinterpret_cast<unsigned char*>(av_malloc(g_ioBufferSize));
+  m_pIOCtx = avio_alloc_context(ioBuffer, g_ioBufferSize, 1, reinterpret_cast<void*>(this), nullptr, &_ioWritePacket, &_ioSeek);
+  if(!m_pIOCtx)
+  {
+    av_free(ioBuffer);
+    throw FFmpegError("Cannot create ffmpeg io context.");
+  }
+  m_pFormatCtx->pb = m_pIOCtx;
+  m_pFormatCtx->flags |= AVFMT_FLAG_CUSTOM_IO;
+}
+
+AVRemuxSink::~AVRemuxSink()
+{
+  if(m_headerWritten && !m_finished)
+  {
+    av_write_trailer(m_pFormatCtx);
+    avio_flush(m_pIOCtx);
+  }
+  if(m_pFormatCtx)
+    avformat_free_context(m_pFormatCtx);
+  if(m_pIOCtx)
+  {
+    av_freep(&m_pIOCtx->buffer);
+    av_free(m_pIOCtx);
+  }
+}
+
+bool AVRemuxSink::supportsCodec(AVCodecID codecId) const
+{ return avformat_query_codec(m_pFormatCtx->oformat, codecId, FF_COMPLIANCE_NORMAL) != 0; }
+
+int AVRemuxSink::addStream(const AVStream *pInputStream)
+{
+  Q_ASSERT(!m_headerWritten);
+  AVStream *pStream = avformat_new_stream(m_pFormatCtx, nullptr);
+  if(!pStream)
+    throw FFmpegError("Cannot create ffmpeg stream.");
+  int copyResult = avcodec_parameters_copy(pStream->codecpar, pInputStream->codecpar);
+  CHECK_AVRESULT(copyResult, copyResult >= 0);
+  // tags of the input container may be invalid in the output one
+  pStream->codecpar->codec_tag = 0;
+  pStream->time_base = pInputStream->time_base;
+  av_dict_copy(&pStream->metadata, pInputStream->metadata, 0);
+  return pStream->index;
+}
+
+void AVRemuxSink::writePacket(AVPacket *packet, int iOutputStream, AVRational inputTimeBase)
+{
+  Q_ASSERT(!m_finished);
+  Q_ASSERT(iOutputStream >= 0 && iOutputStream < static_cast<int>(m_pFormatCtx->nb_streams));
+  if(!m_headerWritten)
+    _writeHeader();
+  av_packet_rescale_ts(packet, inputTimeBase, m_pFormatCtx->streams[iOutputStream]->time_base);
+  packet->stream_index = iOutputStream;
+  packet->pos = -1;
+  int writeResult = av_interleaved_write_frame(m_pFormatCtx, packet);
+  CHECK_AVRESULT(writeResult, writeResult >= 0);
+}
+
+void AVRemuxSink::finish()
+{
+  if(m_finished)
+    return;
+  if(!m_headerWritten)
+    _writeHeader();
+  int trailerResult = av_write_trailer(m_pFormatCtx);
+  CHECK_AVRESULT(trailerResult, trailerResult >= 0);
+  avio_flush(m_pIOCtx);
+  m_file.flush();
+  m_finished = true;
+}
+
+void AVRemuxSink::trim(const QString &inputPath, const QString &outputPath, double begin, double end, const QList<int> &streamIndexList)
+{
+  Q_ASSERT(end > begin);
+  AVPacketReader reader(inputPath);
+  AVFormatContext *pInputFormatCtx = reader.formatContext();
+  AVRemuxSink sink(outputPath);
+  if(!streamIndexList.isEmpty())
+    reader.selectStreams(streamIndexList);
+  else
+  {
+    // streams the output can't carry are left out instead of failing the header
+    QList<int> supportedList;
+    for(int iStream:reader.selectedStreams())
+    {
+      if(sink.supportsCodec(pInputFormatCtx->streams[iStream]->codecpar->codec_id))
+        supportedList.append(iStream);
+    }
+    reader.selectStreams(supportedList);
+  }
+
+  QHash<int, int> outputStreamDict;
+  QSet<int> denseSet;
+  for(int iStream:reader.selectedStreams())
+  {
+    outputStreamDict.insert(iStream, sink.addStream(pInputFormatCtx->streams[iStream]));
+    AVMediaType type = pInputFormatCtx->streams[iStream]->codecpar->codec_type;
+    if(type == AVMEDIA_TYPE_AUDIO || type == AVMEDIA_TYPE_VIDEO)
+      denseSet.insert(iStream);
+  }
+  // a sparse stream may have no packet past end, it only decides when nothing else is selected
+  if(denseSet.isEmpty())
+    denseSet = outputStreamDict.keys().toSet();
+
+  reader.seek(begin);
+  // one shift for all streams keeps them in sync, taken from the first packet
+  bool shiftKnown = false;
+  int64_t shift = 0;
+  QSet<int> endedSet;
+  int nEndedDense = 0;
+  AVPacket *packet = av_packet_alloc();
+  while(nEndedDense < denseSet.size() && reader.readPacket(packet))
+  {
+    int iStream = packet->stream_index;
+    AVRational timeBase = pInputFormatCtx->streams[iStream]->time_base;
+    int64_t dts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+    if(endedSet.contains(iStream) || (dts != AV_NOPTS_VALUE && static_cast<double>(dts) * av_q2d(timeBase) >= end))
+    {
+      if(!endedSet.contains(iStream))
+      {
+        endedSet.insert(iStream);
+        if(denseSet.contains(iStream))
+          ++nEndedDense;
+      }
+      av_packet_unref(packet);
+      continue;
+    }
+    if(!shiftKnown && dts != AV_NOPTS_VALUE)
+    {
+      shift = av_rescale_q(dts, timeBase, AV_TIME_BASE_Q);
+      shiftKnown = true;
+    }
+    int64_t streamShift = av_rescale_q(shift, AV_TIME_BASE_Q, timeBase);
+    if(packet->pts != AV_NOPTS_VALUE)
+      packet->pts -= streamShift;
+    if(packet->dts != AV_NOPTS_VALUE)
+      packet->dts -= streamShift;
+    sink.writePacket(packet, outputStreamDict.value(iStream), timeBase);
+  }
+  av_packet_free(&packet);
+  sink.finish();
+}
+
+int AVRemuxSink::_ioWritePacket(void *opaque, uint8_t *buf, int buf_size)
+{
+  auto sink = reinterpret_cast<AVRemuxSink*>(opaque);
+  qint64 bytesWritten = sink->m_file.write(reinterpret_cast<const char*>(buf), buf_size);
+  if(bytesWritten != buf_size)
+  {
+    qWarning("Failed to write buffer.");
+    return AVERROR(EIO);
+  }
+  return buf_size;
+}
+
+int64_t AVRemuxSink::_ioSeek(void *opaque, int64_t offset, int whence)
+{
+  Q_ASSERT(opaque);
+  whence &= ~AVSEEK_FORCE;
+  auto sink = reinterpret_cast<AVRemuxSink*>(opaque);
+
+  bool seekResult = true;
+  if(whence == AVSEEK_SIZE)
+    return sink->m_file.size();
+  else if(whence == SEEK_SET)
+    seekResult = sink->m_file.seek(offset);
+  else if(whence == SEEK_CUR)
+    seekResult = sink->m_file.seek(sink->m_file.pos() + offset);
+  else if(whence == SEEK_END)
+    seekResult = sink->m_file.seek(sink->m_file.size() + offset);
+  else
+  {
+    qFatal("Invalid whence %d", whence);
+    std::abort();
+  }
+
+  if(seekResult)
+    return sink->m_file.pos();
+  else
+  {
+    qWarning("Failed to seek.");
+    return -1;
+  }
+}
+
+void AVRemuxSink::_writeHeader()
+{
+  int headerResult = avformat_write_header(m_pFormatCtx, nullptr);
+  CHECK_AVRESULT(headerResult, headerResult >= 0);
+  m_headerWritten = true;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <QString>
+#include <QFile>
+#include <QList>
+#include <QHash>
+
+extern "C"
+{
+#include <libavutil/avutil.h>
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+// Writes compressed packets into a new container without re-encoding. The
+// format is guessed from the file name unless formatName is given. Packets
+// are interleaved by the muxer, so they can come in file order.
+class AVRemuxSink final
+{
+public:
+  AVRemuxSink(const QString &path, const QString &formatName = QString());
+  ~AVRemuxSink();
+
+  // whether the output format can carry the codec, unknown counts as supported
+  bool supportsCodec(AVCodecID codecId) const;
+  // copies the codec parameters, returns the output stream index
+  int addStream(const AVStream *pInputStream);
+
+  // takes the packet's reference, timestamps are rescaled from inputTimeBase
+  void writePacket(AVPacket *packet, int iOutputStream, AVRational inputTimeBase);
+  void finish();
+
+  // Lossless cut of [begin, end) seconds of the given streams (all audio,
+  // video and subtitle streams the output format supports if empty).
+  // Starts at the keyframe at or before begin, the output timeline starts
+  // at zero. Reading stops once every audio and video stream passed end,
+  // sparse streams such as subtitles don't keep it going.
+  static void trim(const QString &inputPath, const QString &outputPath, double begin, double end, const QList<int> &streamIndexList = QList<int>());
+
+private:
+  static int _ioWritePacket(void *opaque, uint8_t *buf, int buf_size);
+  static int64_t _ioSeek(void *opaque, int64_t offset, int whence);
+  void _writeHeader();
+
+  QFile m_file;
+  AVIOContext *m_pIOCtx;
+  AVFormatContext *m_pFormatCtx;
+  bool m_headerWritten, m_finished;
+};
@@ -0,0 +1,180 @@
+#include "avreversedecoder.hpp"
+#include "avframeprovider.hpp"
+#include <QElapsedTimer>
+#include <QVector>
+#include <algorithm>
+
+AVReverseDecoder::AVReverseDecoder(const QString &path, int iVideoStream, double startTime, int maxCachedFrames, int decoderThreadCount, QObject *parent) : QThread(parent)
+{
+  m_provider = new AVFrameProvider(path, false, true, decoderThreadCount);
+  _initialize(iVideoStream, startTime, maxCachedFrames);
+}
+
+AVReverseDecoder::AVReverseDecoder(const AVMemorySource &source, int iVideoStream, double startTime, int maxCachedFrames, int decoderThreadCount, QObject *parent) : QThread(parent)
+{
+  m_provider = new AVFrameProvider(source, false, true, decoderThreadCount);
+  _initialize(iVideoStream, startTime, maxCachedFrames);
+}
+
+void AVReverseDecoder::_initialize(int iVideoStream, double startTime, int maxCachedFrames)
+{
+  Q_ASSERT(maxCachedFrames > 0);
+  if(m_provider->selectedStreams() != QList<int>{iVideoStream})
+    m_provider->selectStreams(QList<int>{iVideoStream});
+  m_provider->setDecodeMode(AVFrameProvider::InlineDecode);
+  m_startTime = startTime;
+  m_maxCachedFrames = maxCachedFrames;
+  m_finished = false;
+}
+
+AVReverseDecoder::~AVReverseDecoder()
+{
+  requestStop(false);
+  for(AVFrame *pFrame:m_frameQueue)
+    av_frame_free(&pFrame);
+  delete m_provider;
+}
+
+double AVReverseDecoder::startTime() const
+{ return m_startTime; }
+
+int AVReverseDecoder::maxCachedFrames() const
+{ return m_maxCachedFrames; }
+
+bool AVReverseDecoder::takeFrame(AVFrame *pOut, int timeout)
+{
+  Q_ASSERT(pOut);
+  QElapsedTimer timer;
+  timer.start();
+
+  QMutexLocker locker(&m_locker);
+  while(m_frameQueue.isEmpty() && !m_finished)
+  {
+    if(timeout < 0)
+      m_syncer.wait(&m_locker);
+    else
+    {
+      qint64 remaining = timeout - timer.elapsed();
+      if(remaining <= 0 || !m_syncer.wait(&m_locker, static_cast<unsigned long>(remaining)))
+        break;
+    }
+  }
+  if(m_frameQueue.isEmpty())
+    return false;
+  AVFrame *pFrame = m_frameQueue.dequeue();
+  av_frame_move_ref(pOut, pFrame);
+  av_frame_free(&pFrame);
+  m_syncer.wakeAll();
+  return true;
+}
+
+bool AVReverseDecoder::isFinished_lockfree() const
+{ return m_finished && m_frameQueue.isEmpty(); }
+
+void AVReverseDecoder::restart(double startTime)
+{
+  requestStop(false);
+  m_locker.lock();
+  for(AVFrame *pFrame:m_frameQueue)
+    av_frame_free(&pFrame);
+  m_frameQueue.clear();
+  m_startTime = startTime;
+  m_finished = false;
+  m_locker.unlock();
+  start();
+}
+
+void AVReverseDecoder::requestStop(bool async)
+{
+  m_locker.lock();
+  requestInterruption();
+  m_syncer.wakeAll();
+  m_locker.unlock();
+  if(!async)
+    wait();
+}
+
+void AVReverseDecoder::run()
+{
+  try
+  {
+    _decodeBackwards();
+  }
+  catch(const std::exception &e)
+  {
+    qWarning("Failed to decode backwards: %s", e.what());
+  }
+
+  m_locker.lock();
+  m_finished = true;
+  m_syncer.wakeAll();
+  m_locker.unlock();
+}
+
+void AVReverseDecoder::_decodeBackwards()
+{
+  double chunkEnd = m_startTime;
+  double backoff = 0.0;
+  while(!isInterruptionRequested())
+  {
+    // wait for room before decoding the next chunk
+    m_locker.lock();
+    while(m_frameQueue.size() >= m_maxCachedFrames && !isInterruptionRequested())
+      m_syncer.wait(&m_locker);
+    int room = m_maxCachedFrames - m_frameQueue.size();
+    m_locker.unlock();
+    if(isInterruptionRequested())
+      break;
+
+    double chunkBegin = std::max(0.0, chunkEnd - backoff);
+    QVector<AVFrame*> frameList;
+    QVector<double> ptsList;
+    _decodeChunk(chunkBegin, chunkEnd, room, &frameList, &ptsList);
+    if(isInterruptionRequested())
+    {
+      for(AVFrame *pFrame:frameList)
+        av_frame_free(&pFrame);
+      break;
+    }
+
+    if(frameList.isEmpty())
+    {
+      // the seek landed on the keyframe at chunkEnd itself, look further back
+      if(chunkBegin <= 0.0)
+        break;
+      backoff = backoff > 0.0 ? backoff * 2.0 : 0.5;
+      continue;
+    }
+    // GOPs tend to have the same length, so the span just decoded is a good guess for the previous one
+    backoff = chunkEnd - ptsList.first();
+    chunkEnd = ptsList.first();
+
+    m_locker.lock();
+    for(int i = frameList.size() - 1; i >= 0; --i)
+      m_frameQueue.enqueue(frameList.at(i));
+    m_syncer.wakeAll();
+    m_locker.unlock();
+  }
+}
+
+void AVReverseDecoder::_decodeChunk(double chunkBegin, double chunkEnd, int maxFrameCount, QVector<AVFrame*> *pFrameList, QVector<double> *pPtsList)
+{
+  m_provider->seek(chunkBegin, false);
+  m_provider->startDecoder(false);
+  while(!isInterruptionRequested() && m_provider->nextVideoFrame())
+  {
+    double pts = m_provider->videoPts();
+    if(pts >= chunkEnd)
+      break;
+    pFrameList->append(av_frame_clone(m_provider->currentVideoFrame()));
+    pPtsList->append(pts);
+    // only the frames closest to chunkEnd are kept, earlier ones are decoded again by a later chunk
+    if(pFrameList->size() > maxFrameCount)
+    {
+      av_frame_free(&pFrameList->first());
+      pFrameList->removeFirst();
+      pPtsList->removeFirst();
+    }
+  }
+  m_provider->stopDecoder(false);
+}
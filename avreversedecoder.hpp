@@ -0,0 +1,59 @@
+#pragma once
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QString>
+#include <QVector>
+
+extern "C"
+{
+#include <libavutil/avutil.h>
+#include <libavutil/frame.h>
+}
+
+class AVFrameProvider;
+class AVMemorySource;
+
+// Produces the video frames before a start time in descending pts order.
+// The worker seeks back GOP by GOP on its own inline decoding provider,
+// decodes each GOP forwards and queues its frames reversed, keeping at
+// most maxCachedFrames decoded. GOPs longer than that are decoded again
+// in several chunks. restart() moves it to another start time while
+// keeping the provider, so the file is only opened once.
+class AVReverseDecoder final : public QThread
+{
+  Q_OBJECT
+public:
+  AVReverseDecoder(const QString &path, int iVideoStream, double startTime, int maxCachedFrames = 64, int decoderThreadCount = 0, QObject *parent = nullptr);
+  AVReverseDecoder(const AVMemorySource &source, int iVideoStream, double startTime, int maxCachedFrames = 64, int decoderThreadCount = 0, QObject *parent = nullptr);
+  ~AVReverseDecoder();
+
+  double startTime() const;
+  int maxCachedFrames() const;
+
+  bool takeFrame(AVFrame *pOut, int timeout = -1);
+  bool isFinished_lockfree() const;
+
+  void restart(double startTime);
+  void requestStop(bool async = true);
+
+protected:
+  void run() override;
+
+private:
+  void _initialize(int iVideoStream, double startTime, int maxCachedFrames);
+  void _decodeBackwards();
+  void _decodeChunk(double chunkBegin, double chunkEnd, int maxFrameCount, QVector<AVFrame*> *pFrameList, QVector<double> *pPtsList);
+
+  AVFrameProvider *m_provider;
+  double m_startTime;
+  int m_maxCachedFrames;
+
+  QQueue<AVFrame*> m_frameQueue;
+  bool m_finished;
+
+  mutable QMutex m_locker;
+  QWaitCondition m_syncer;
+};
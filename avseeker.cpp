@@ -6,6 +6,7 @@ AVSeeker::AVSeeker(AVFormatContext *pFormatCtx, QObject *parent) : QThread(paren
   Q_ASSERT(pFormatCtx);
   m_pFormatCtx = pFormatCtx;
   m_pos = 0;
+  m_threadRole = AVThreadPolicy::SeekRole;
 }
 
 AVSeeker::~AVSeeker()
@@ -17,8 +18,15 @@ void AVSeeker::setPos_lockfree(qint64 v)
 qint64 AVSeeker::pos_lockfree() const
 { return m_pos; }
 
+void AVSeeker::setThreadRole(AVThreadPolicy::Role v)
+{ m_threadRole = v; }
+
+AVThreadPolicy::Role AVSeeker::threadRole() const
+{ return static_cast<AVThreadPolicy::Role>(m_threadRole.load()); }
+
 void AVSeeker::run()
 {
+  AVThreadPolicy::applyToCurrentThread(threadRole());
   int seekResult = av_seek_frame(m_pFormatCtx, -1, m_pos, AVSEEK_FLAG_BACKWARD);
   CHECK_AVRESULT(seekResult, seekResult >= 0);
   exit();
@@ -2,6 +2,7 @@
 
 #include <QThread>
 #include <atomic>
+#include "avthreadpolicy.hpp"
 
 extern "C"
 {
@@ -19,10 +20,14 @@ public:
   void setPos_lockfree(qint64 v);
   qint64 pos_lockfree() const;
 
+  void setThreadRole(AVThreadPolicy::Role v);
+  AVThreadPolicy::Role threadRole() const;
+
 protected:
   void run() override;
 
 private:
   AVFormatContext *m_pFormatCtx;
   qint64 m_pos;
+  std::atomic<int> m_threadRole;
 };
@@ -0,0 +1,318 @@
+#include "avsegmentdecoder.hpp"
+#include "avpacketreader.hpp"
+#include <QRunnable>
+#include <QThread>
+#include <QScopedPointer>
+#include <limits>
+
+namespace
+{
+  // keyframes closer than this to the previous boundary don't start a new segment
+  const double g_minSegmentDuration = 1.0;
+}
+
+class AVSegmentDecoder::SegmentJob final : public QRunnable
+{
+public:
+  SegmentJob(AVSegmentDecoder *decoder, int iSegment)
+  {
+    m_decoder = decoder;
+    m_iSegment = iSegment;
+  }
+
+  void run() override
+  { m_decoder->_decodeSegment(m_iSegment); }
+
+private:
+  AVSegmentDecoder *m_decoder;
+  int m_iSegment;
+};
+
+AVSegmentDecoder::AVSegmentDecoder(const QString &path, bool enableAudio, bool enableVideo, int segmentCount)
+{
+  m_path = path;
+  _initialize(enableAudio, enableVideo, segmentCount);
+}
+
+AVSegmentDecoder::AVSegmentDecoder(const AVMemorySource &source, bool enableAudio, bool enableVideo, int segmentCount)
+{
+  // every segment reads the same memory through its own io context
+  m_path = source.name();
+  m_memorySource = source;
+  _initialize(enableAudio, enableVideo, segmentCount);
+}
+
+void AVSegmentDecoder::_initialize(bool enableAudio, bool enableVideo, int segmentCount)
+{
+  Q_ASSERT(enableAudio || enableVideo);
+  Q_ASSERT(segmentCount >= 0);
+  m_enableAudio = enableAudio;
+  m_enableVideo = enableVideo;
+  m_segmentQueueSize = 16;
+  m_iOrderedSegment = 0;
+  m_canceled = false;
+  m_pool.setMaxThreadCount(QThread::idealThreadCount());
+  _findSegments(segmentCount > 0 ? segmentCount : QThread::idealThreadCount());
+}
+
+AVSegmentDecoder::~AVSegmentDecoder()
+{
+  cancel();
+  _clearQueues();
+}
+
+QString AVSegmentDecoder::path() const
+{ return m_path; }
+
+QVector<AVSegmentDecoder::Segment> AVSegmentDecoder::segments() const
+{ return m_segmentList; }
+
+void AVSegmentDecoder::setMaxParallelCount(int v)
+{
+  Q_ASSERT(v > 0);
+  QMutexLocker locker(&m_locker);
+  m_pool.setMaxThreadCount(v);
+  m_syncer.wakeAll();
+}
+
+int AVSegmentDecoder::maxParallelCount() const
+{ return m_pool.maxThreadCount(); }
+
+void AVSegmentDecoder::setSegmentQueueSize(int frameCount)
+{
+  Q_ASSERT(frameCount > 0);
+  QMutexLocker locker(&m_locker);
+  m_segmentQueueSize = frameCount;
+  m_syncer.wakeAll();
+}
+
+int AVSegmentDecoder::segmentQueueSize() const
+{
+  QMutexLocker locker(&m_locker);
+  return m_segmentQueueSize;
+}
+
+bool AVSegmentDecoder::run(const FrameCallback &callback)
+{
+  Q_ASSERT(callback);
+  cancel();
+  m_callback = callback;
+  _startJobs();
+  m_pool.waitForDone();
+  m_callback = FrameCallback();
+  return !m_canceled;
+}
+
+void AVSegmentDecoder::start()
+{
+  cancel();
+  m_callback = FrameCallback();
+  _startJobs();
+}
+
+bool AVSegmentDecoder::nextFrame(AVFrameRef *pOut, AVFrameProvider::FrameType *pType)
+{
+  Q_ASSERT(pOut);
+  QMutexLocker locker(&m_locker);
+  while(m_iOrderedSegment < m_queueList.size())
+  {
+    SegmentQueue &queue = m_queueList[m_iOrderedSegment];
+    if(!queue.frameQueue.isEmpty())
+    {
+      QueuedFrame queuedFrame = queue.frameQueue.dequeue();
+      *pOut = AVFrameRef::adopt(queuedFrame.pFrame);
+      if(pType)
+        *pType = queuedFrame.type;
+      m_syncer.wakeAll();
+      return true;
+    }
+    if(queue.finished)
+    {
+      // the window moved, the next segment may start and the new head becomes bounded
+      ++m_iOrderedSegment;
+      m_syncer.wakeAll();
+      continue;
+    }
+    if(m_canceled)
+      break;
+    m_syncer.wait(&m_locker);
+  }
+  pOut->reset();
+  return false;
+}
+
+void AVSegmentDecoder::cancel()
+{
+  m_locker.lock();
+  m_canceled = true;
+  m_syncer.wakeAll();
+  m_locker.unlock();
+  m_pool.clear();
+  m_pool.waitForDone();
+}
+
+QString AVSegmentDecoder::errorString() const
+{
+  QMutexLocker locker(&m_locker);
+  return m_errorString;
+}
+
+AVFrameProvider *AVSegmentDecoder::_openProvider() const
+{
+  if(m_memorySource.isNull())
+    return new AVFrameProvider(m_path, m_enableAudio, m_enableVideo, 1);
+  return new AVFrameProvider(m_memorySource, m_enableAudio, m_enableVideo, 1);
+}
+
+void AVSegmentDecoder::_findSegments(int segmentCount)
+{
+  const double infinity = std::numeric_limits<double>::infinity();
+  QVector<double> boundaryList;
+
+  // boundaries are keyframes of the main stream, so every segment starts decoding where its seek lands
+  QScopedPointer<AVPacketReader> readerHolder(m_memorySource.isNull() ? new AVPacketReader(m_path) : new AVPacketReader(m_memorySource));
+  AVPacketReader &reader = *readerHolder;
+  int iStream = m_enableVideo ? reader.findStream(AVMEDIA_TYPE_VIDEO) : -1;
+  if(iStream < 0)
+    iStream = reader.findStream(AVMEDIA_TYPE_AUDIO);
+  AVFormatContext *pFormatCtx = reader.formatContext();
+  double duration = reader.duration();
+  if(iStream >= 0 && pFormatCtx->duration != AV_NOPTS_VALUE && duration > 0.0)
+  {
+    reader.selectStreams(QList<int>{iStream});
+    double startTime = pFormatCtx->start_time != AV_NOPTS_VALUE ? static_cast<double>(pFormatCtx->start_time) / static_cast<double>(AV_TIME_BASE) : 0.0;
+    double lastBoundary = startTime;
+    AVPacket *packet = av_packet_alloc();
+    for(int i = 1; i < segmentCount; ++i)
+    {
+      reader.seek(startTime + duration * static_cast<double>(i) / static_cast<double>(segmentCount));
+      double keyframeTime = std::numeric_limits<double>::quiet_NaN();
+      while(reader.readPacket(packet))
+      {
+        bool isKey = packet->flags & AV_PKT_FLAG_KEY;
+        if(isKey)
+          keyframeTime = reader.packetTime(packet);
+        av_packet_unref(packet);
+        if(isKey)
+          break;
+      }
+      if(keyframeTime - lastBoundary >= g_minSegmentDuration)
+      {
+        boundaryList.append(keyframeTime);
+        lastBoundary = keyframeTime;
+      }
+    }
+    av_packet_free(&packet);
+  }
+
+  m_segmentList.clear();
+  double begin = -infinity;
+  for(double boundary:boundaryList)
+  {
+    m_segmentList.append(Segment{begin, boundary});
+    begin = boundary;
+  }
+  m_segmentList.append(Segment{begin, infinity});
+}
+
+void AVSegmentDecoder::_startJobs()
+{
+  m_pool.waitForDone();
+  _clearQueues();
+  m_locker.lock();
+  m_queueList.resize(m_segmentList.size());
+  for(SegmentQueue &queue:m_queueList)
+    queue.finished = false;
+  m_iOrderedSegment = 0;
+  m_canceled = false;
+  m_errorString.clear();
+  m_locker.unlock();
+  // the pool runs jobs in order, so the segment the reader waits for is never starved
+  for(int i = 0; i < m_segmentList.size(); ++i)
+    m_pool.start(new SegmentJob(this, i));
+}
+
+void AVSegmentDecoder::_decodeSegment(int iSegment)
+{
+  const Segment segment = m_segmentList.at(iSegment);
+  if(!m_callback)
+  {
+    // jobs start in order, so the segments inside the window are already running
+    QMutexLocker locker(&m_locker);
+    while(iSegment >= m_iOrderedSegment + m_pool.maxThreadCount() && !m_canceled)
+      m_syncer.wait(&m_locker);
+  }
+  try
+  {
+    // parallelism comes from the segments, so each decoder runs single threaded on the pool thread
+    QScopedPointer<AVFrameProvider> providerHolder(_openProvider());
+    AVFrameProvider &provider = *providerHolder;
+    provider.setDecodeMode(AVFrameProvider::InlineDecode);
+    if(iSegment > 0)
+      provider.seek(segment.begin, false);
+    provider.startDecoder(false);
+
+    bool audioEnded = !provider.hasAudio();
+    bool videoEnded = !provider.hasVideo();
+    while(!m_canceled && !(audioEnded && videoEnded) && provider.nextFrame())
+    {
+      AVFrameProvider::FrameType type = provider.currentFrameType();
+      double pts = type == AVFrameProvider::AudioFrame ? provider.audioPts() : provider.videoPts();
+      // frames before the keyframe (open GOP leading pictures) belong to the previous segment
+      if(pts < segment.begin)
+        continue;
+      if(pts >= segment.end)
+      {
+        if(type == AVFrameProvider::AudioFrame)
+          audioEnded = true;
+        else
+          videoEnded = true;
+        continue;
+      }
+      if(m_callback)
+        m_callback(iSegment, provider.currentFrame(), type);
+      else if(!_enqueueFrame(iSegment, provider.currentFrame(), type))
+        break;
+    }
+    provider.stopDecoder(false);
+  }
+  catch(const std::exception &e)
+  {
+    qWarning("Failed to decode segment %d: %s", iSegment, e.what());
+    m_locker.lock();
+    if(m_errorString.isEmpty())
+      m_errorString = QString::fromUtf8(e.what());
+    m_canceled = true;
+    m_locker.unlock();
+  }
+
+  m_locker.lock();
+  m_queueList[iSegment].finished = true;
+  m_syncer.wakeAll();
+  m_locker.unlock();
+}
+
+bool AVSegmentDecoder::_enqueueFrame(int iSegment, const AVFrame *pFrame, AVFrameProvider::FrameType type)
+{
+  // segments ahead of the reader buffer everything, waiting here would serialize them
+  QMutexLocker locker(&m_locker);
+  while(iSegment == m_iOrderedSegment && m_queueList.at(iSegment).frameQueue.size() >= m_segmentQueueSize && !m_canceled)
+    m_syncer.wait(&m_locker);
+  if(m_canceled)
+    return false;
+  m_queueList[iSegment].frameQueue.enqueue(QueuedFrame{av_frame_clone(pFrame), type});
+  m_syncer.wakeAll();
+  return true;
+}
+
+void AVSegmentDecoder::_clearQueues()
+{
+  QMutexLocker locker(&m_locker);
+  for(SegmentQueue &queue:m_queueList)
+  {
+    for(QueuedFrame &queuedFrame:queue.frameQueue)
+      av_frame_free(&queuedFrame.pFrame);
+    queue.frameQueue.clear();
+  }
+  m_queueList.clear();
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <QString>
+#include <QVector>
+#include <QQueue>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThreadPool>
+#include <functional>
+#include <atomic>
+#include "avframeprovider.hpp"
+#include "avframeref.hpp"
+
+// Offline decoding of a single file split at video keyframes into segments.
+// Every segment is decoded by its own AVFrameProvider (file handle, demuxer
+// and codecs) on a thread pool, so one long file scales with the number of
+// cores. A frame belongs to the segment containing its pts.
+//
+// run() hands the frames to a reducer callback, which is called from the
+// pool threads concurrently for different segments but in order within one
+// segment. start() and nextFrame() merge the segments back into file order:
+// at most maxParallelCount segments are in flight, the one being read buffers
+// at most segmentQueueSize frames and the ones after it run to completion so
+// they don't wait for the reader. The buffered frames are decoded and
+// uncompressed, so ordered reading costs up to maxParallelCount - 1 whole
+// segments of memory, about 78 MB per second of 1080p yuv420p at 25 fps;
+// use more segments than cores to keep them short.
+class AVSegmentDecoder final
+{
+public:
+  typedef std::function<void(int iSegment, const AVFrame *pFrame, AVFrameProvider::FrameType type)> FrameCallback;
+
+  struct Segment
+  {
+    double begin;
+    double end;
+  };
+
+  // zero segmentCount picks one segment per core
+  AVSegmentDecoder(const QString &path, bool enableAudio, bool enableVideo, int segmentCount = 0);
+  AVSegmentDecoder(const AVMemorySource &source, bool enableAudio, bool enableVideo, int segmentCount = 0);
+  ~AVSegmentDecoder();
+
+  QString path() const;
+  QVector<Segment> segments() const;
+
+  void setMaxParallelCount(int v);
+  int maxParallelCount() const;
+  void setSegmentQueueSize(int frameCount);
+  int segmentQueueSize() const;
+
+  // blocks until every segment is decoded, false on error or cancel
+  bool run(const FrameCallback &callback);
+
+  void start();
+  bool nextFrame(AVFrameRef *pOut, AVFrameProvider::FrameType *pType = nullptr);
+
+  void cancel();
+  QString errorString() const;
+
+private:
+  class SegmentJob;
+
+  struct QueuedFrame
+  {
+    AVFrame *pFrame;
+    AVFrameProvider::FrameType type;
+  };
+
+  struct SegmentQueue
+  {
+    QQueue<QueuedFrame> frameQueue;
+    bool finished;
+  };
+
+  void _initialize(bool enableAudio, bool enableVideo, int segmentCount);
+  AVFrameProvider *_openProvider() const;
+  void _findSegments(int segmentCount);
+  void _startJobs();
+  void _decodeSegment(int iSegment);
+  bool _enqueueFrame(int iSegment, const AVFrame *pFrame, AVFrameProvider::FrameType type);
+  void _clearQueues();
+
+  QString m_path;
+  AVMemorySource m_memorySource;
+  bool m_enableAudio, m_enableVideo;
+  QVector<Segment> m_segmentList;
+  int m_segmentQueueSize;
+
+  FrameCallback m_callback;
+  QVector<SegmentQueue> m_queueList;
+  int m_iOrderedSegment;
+  std::atomic<bool> m_canceled;
+  QString m_errorString;
+
+  mutable QMutex m_locker;
+  QWaitCondition m_syncer;
+  QThreadPool m_pool;
+};
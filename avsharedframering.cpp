@@ -0,0 +1,450 @@
+#include "avsharedframering.hpp"
+#include <QElapsedTimer>
+#include <atomic>
+#include <cstring>
+
+extern "C"
+{
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/samplefmt.h>
+}
+
+#ifdef Q_OS_LINUX
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <climits>
+#include <ctime>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_GET_SEALS 1034
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#endif
+#endif
+
+IMPL_EXCEPTION(SharedMemoryError, std::runtime_error)
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "Shared memory signaling needs lock-free 32 bit atomics.");
+
+namespace
+{
+  const quint32 g_ringMagic = 0x51464652; // "QFFR"
+  const quint32 g_ringVersion = 1;
+  const qint64 g_alignment = 64;
+  const int g_maxChannelCount = 64;
+
+  qint64 alignUp(qint64 v)
+  { return (v + g_alignment - 1) / g_alignment * g_alignment; }
+}
+
+struct AVSharedFrameRing::RingHeader
+{
+  quint32 magic;
+  quint32 version;
+  quint32 slotCount;
+  quint32 reserved;
+  qint64 slotDataSize;
+  qint64 slotStride;
+  // futex words, written by one side each
+  alignas(64) std::atomic<quint32> writeSeq;
+  alignas(64) std::atomic<quint32> readSeq;
+  std::atomic<quint32> closed;
+};
+
+struct AVSharedFrameRing::SlotHeader
+{
+  qint32 mediaType;
+  qint32 format;
+  qint32 width, height;
+  qint32 samprate, channelCount;
+  quint64 channelLayout;
+  qint32 sampleCount;
+  qint32 planeCount;
+  qint64 pts;
+  qint32 timeBaseNum, timeBaseDen;
+  qint64 planeOffset[MaxPlaneCount];
+  qint32 linesize[MaxPlaneCount];
+};
+
+#ifdef Q_OS_LINUX
+namespace
+{
+  const int g_ringSeals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+
+  // waits while *pWord == expected, wakes up at least every 100ms so a dead peer or a missed close is noticed
+  void futexWait(std::atomic<quint32> *pWord, quint32 expected, int timeout)
+  {
+    if(timeout < 0 || timeout > 100)
+      timeout = 100;
+    timespec ts;
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+    syscall(SYS_futex, reinterpret_cast<quint32*>(pWord), FUTEX_WAIT, expected, &ts, nullptr, 0);
+  }
+
+  void futexWake(std::atomic<quint32> *pWord)
+  { syscall(SYS_futex, reinterpret_cast<quint32*>(pWord), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0); }
+}
+#endif
+
+AVSharedFrameRing *AVSharedFrameRing::create(int slotCount, qint64 slotDataSize)
+{
+  Q_ASSERT(slotCount > 0 && slotDataSize > 0);
+#ifdef Q_OS_LINUX
+  qint64 slotStride = alignUp(sizeof(SlotHeader)) + alignUp(slotDataSize);
+  qint64 mapSize = alignUp(sizeof(RingHeader)) + slotStride * slotCount;
+
+  int fd = static_cast<int>(syscall(SYS_memfd_create, "qfastav-frame-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING));
+  if(fd < 0)
+    throw SharedMemoryError("Cannot create shared memory.");
+  if(ftruncate(fd, mapSize) != 0)
+  {
+    ::close(fd);
+    throw SharedMemoryError("Cannot resize shared memory.");
+  }
+  // fix the size before the fd is handed out, so no peer can truncate the mapping under the other
+  if(fcntl(fd, F_ADD_SEALS, g_ringSeals) != 0)
+  {
+    ::close(fd);
+    throw SharedMemoryError("Cannot seal shared memory.");
+  }
+  void *pMap = mmap(nullptr, static_cast<size_t>(mapSize), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(pMap == MAP_FAILED)
+  {
+    ::close(fd);
+    throw SharedMemoryError("Cannot map shared memory.");
+  }
+
+  auto pHeader = new(pMap) RingHeader;
+  pHeader->slotCount = static_cast<quint32>(slotCount);
+  pHeader->reserved = 0;
+  pHeader->slotDataSize = slotDataSize;
+  pHeader->slotStride = slotStride;
+  pHeader->writeSeq = 0;
+  pHeader->readSeq = 0;
+  pHeader->closed = 0;
+  pHeader->version = g_ringVersion;
+  std::atomic_thread_fence(std::memory_order_release);
+  pHeader->magic = g_ringMagic;
+  return new AVSharedFrameRing(fd, reinterpret_cast<uchar*>(pMap), mapSize, static_cast<quint32>(slotCount), slotDataSize, slotStride);
+#else
+  Q_UNUSED(slotCount);
+  Q_UNUSED(slotDataSize);
+  throw SharedMemoryError("Shared memory frame transport is only supported on Linux.");
+#endif
+}
+
+AVSharedFrameRing *AVSharedFrameRing::attach(int fd)
+{
+#ifdef Q_OS_LINUX
+  // without the size seals the producer could shrink the file and fault our mapping
+  int seals = fcntl(fd, F_GET_SEALS);
+  if(seals < 0 || (seals & g_ringSeals) != g_ringSeals)
+    throw SharedMemoryError("Shared memory is not sealed.");
+
+  struct stat fileStat;
+  if(fstat(fd, &fileStat) != 0 || fileStat.st_size < static_cast<off_t>(sizeof(RingHeader)))
+    throw SharedMemoryError("Invalid shared memory.");
+  qint64 mapSize = fileStat.st_size;
+  void *pMap = mmap(nullptr, static_cast<size_t>(mapSize), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(pMap == MAP_FAILED)
+    throw SharedMemoryError("Cannot map shared memory.");
+
+  // read the geometry once, later changes by the producer are ignored
+  auto pHeader = reinterpret_cast<volatile RingHeader*>(pMap);
+  quint32 magic = pHeader->magic;
+  quint32 version = pHeader->version;
+  quint32 slotCount = pHeader->slotCount;
+  qint64 slotDataSize = pHeader->slotDataSize;
+  qint64 slotStride = pHeader->slotStride;
+  qint64 slotAreaSize = mapSize - alignUp(sizeof(RingHeader));
+  if(magic != g_ringMagic || version != g_ringVersion || slotCount == 0 || slotDataSize <= 0 ||
+     slotStride % g_alignment != 0 || slotStride < alignUp(sizeof(SlotHeader)) + slotDataSize ||
+     slotAreaSize <= 0 || slotStride > slotAreaSize / static_cast<qint64>(slotCount))
+  {
+    munmap(pMap, static_cast<size_t>(mapSize));
+    throw SharedMemoryError("Invalid shared memory.");
+  }
+  return new AVSharedFrameRing(fd, reinterpret_cast<uchar*>(pMap), mapSize, slotCount, slotDataSize, slotStride);
+#else
+  Q_UNUSED(fd);
+  throw SharedMemoryError("Shared memory frame transport is only supported on Linux.");
+#endif
+}
+
+AVSharedFrameRing::AVSharedFrameRing(int fd, uchar *pMap, qint64 mapSize, quint32 slotCount, qint64 slotDataSize, qint64 slotStride)
+{
+  m_fd = fd;
+  m_pMap = pMap;
+  m_mapSize = mapSize;
+  m_pHeader = reinterpret_cast<RingHeader*>(pMap);
+  m_slotCount = slotCount;
+  m_slotDataSize = slotDataSize;
+  m_slotStride = slotStride;
+  m_acquired = false;
+}
+
+AVSharedFrameRing::~AVSharedFrameRing()
+{
+#ifdef Q_OS_LINUX
+  munmap(m_pMap, static_cast<size_t>(m_mapSize));
+  ::close(m_fd);
+#endif
+}
+
+int AVSharedFrameRing::fd() const
+{ return m_fd; }
+
+int AVSharedFrameRing::slotCount() const
+{ return static_cast<int>(m_slotCount); }
+
+qint64 AVSharedFrameRing::slotDataSize() const
+{ return m_slotDataSize; }
+
+bool AVSharedFrameRing::write(const AVFrame *pFrame, AVRational timeBase, int timeout)
+{
+  Q_ASSERT(pFrame);
+#ifdef Q_OS_LINUX
+  bool isAudio = pFrame->nb_samples > 0;
+  int channelCount = av_frame_get_channels(pFrame);
+  uint8_t *dstData[MaxPlaneCount] = {nullptr};
+  int dstLinesize[MaxPlaneCount] = {0};
+  int planeCount;
+  int dataSize;
+  if(isAudio)
+  {
+    auto format = static_cast<AVSampleFormat>(pFrame->format);
+    planeCount = av_sample_fmt_is_planar(format) ? channelCount : 1;
+    dataSize = av_samples_get_buffer_size(nullptr, channelCount, pFrame->nb_samples, format, 1);
+  }
+  else
+  {
+    auto format = static_cast<AVPixelFormat>(pFrame->format);
+    planeCount = av_pix_fmt_count_planes(format);
+    dataSize = av_image_get_buffer_size(format, pFrame->width, pFrame->height, 1);
+  }
+  if(planeCount <= 0 || planeCount > MaxPlaneCount || dataSize < 0)
+  {
+    qWarning("Unsupported frame layout for shared memory transport.");
+    return false;
+  }
+  if(dataSize > m_slotDataSize)
+  {
+    qWarning("Frame of %d bytes does not fit a %lld bytes slot.", dataSize, m_slotDataSize);
+    return false;
+  }
+
+  // wait for a free slot
+  QElapsedTimer timer;
+  timer.start();
+  quint32 writeSeq = m_pHeader->writeSeq.load(std::memory_order_relaxed);
+  while(true)
+  {
+    quint32 readSeq = m_pHeader->readSeq.load(std::memory_order_acquire);
+    if(writeSeq - readSeq < m_slotCount)
+      break;
+    int remaining = -1;
+    if(timeout >= 0)
+    {
+      remaining = timeout - static_cast<int>(timer.elapsed());
+      if(remaining <= 0)
+        return false;
+    }
+    futexWait(&m_pHeader->readSeq, readSeq, remaining);
+  }
+
+  // copy into the slot
+  SlotHeader *pSlot = _slotHeader(writeSeq);
+  uchar *pData = _slotData(writeSeq);
+  if(isAudio)
+  {
+    auto format = static_cast<AVSampleFormat>(pFrame->format);
+    av_samples_fill_arrays(dstData, dstLinesize, pData, channelCount, pFrame->nb_samples, format, 1);
+    av_samples_copy(dstData, pFrame->extended_data, 0, 0, pFrame->nb_samples, channelCount, format);
+    pSlot->mediaType = AVMEDIA_TYPE_AUDIO;
+  }
+  else
+  {
+    auto format = static_cast<AVPixelFormat>(pFrame->format);
+    av_image_fill_arrays(dstData, dstLinesize, pData, format, pFrame->width, pFrame->height, 1);
+    av_image_copy(dstData, dstLinesize, const_cast<const uint8_t**>(pFrame->data), pFrame->linesize, format, pFrame->width, pFrame->height);
+    pSlot->mediaType = AVMEDIA_TYPE_VIDEO;
+  }
+  pSlot->format = pFrame->format;
+  pSlot->width = pFrame->width;
+  pSlot->height = pFrame->height;
+  pSlot->samprate = pFrame->sample_rate;
+  pSlot->channelCount = channelCount;
+  pSlot->channelLayout = pFrame->channel_layout;
+  pSlot->sampleCount = pFrame->nb_samples;
+  pSlot->planeCount = planeCount;
+  pSlot->pts = pFrame->pts != AV_NOPTS_VALUE ? pFrame->pts : av_frame_get_best_effort_timestamp(pFrame);
+  pSlot->timeBaseNum = timeBase.num;
+  pSlot->timeBaseDen = timeBase.den;
+  for(int i = 0; i < MaxPlaneCount; ++i)
+  {
+    pSlot->planeOffset[i] = i < planeCount ? dstData[i] - pData : 0;
+    pSlot->linesize[i] = i < planeCount ? dstLinesize[i] : 0;
+  }
+
+  // publish
+  m_pHeader->writeSeq.store(writeSeq + 1, std::memory_order_release);
+  futexWake(&m_pHeader->writeSeq);
+  return true;
+#else
+  Q_UNUSED(timeBase);
+  Q_UNUSED(timeout);
+  return false;
+#endif
+}
+
+void AVSharedFrameRing::close()
+{
+#ifdef Q_OS_LINUX
+  m_pHeader->closed.store(1, std::memory_order_release);
+  futexWake(&m_pHeader->writeSeq);
+#endif
+}
+
+bool AVSharedFrameRing::acquire(AVSharedFrameRing::FrameView *pOut, int timeout)
+{
+  Q_ASSERT(pOut);
+  Q_ASSERT(!m_acquired);
+#ifdef Q_OS_LINUX
+  QElapsedTimer timer;
+  timer.start();
+  while(true)
+  {
+    quint32 readSeq = m_pHeader->readSeq.load(std::memory_order_relaxed);
+    quint32 writeSeq = m_pHeader->writeSeq.load(std::memory_order_acquire);
+    if(writeSeq != readSeq)
+    {
+      // the header is copied before validation so the producer cannot change it in between
+      SlotHeader slot;
+      std::memcpy(&slot, _slotHeader(readSeq), sizeof(slot));
+      if(_fillView(slot, _slotData(readSeq), pOut))
+      {
+        m_acquired = true;
+        return true;
+      }
+      qWarning("Dropped a shared frame with an invalid layout.");
+      m_pHeader->readSeq.store(readSeq + 1, std::memory_order_release);
+      futexWake(&m_pHeader->readSeq);
+      continue;
+    }
+    if(m_pHeader->closed.load(std::memory_order_acquire))
+      return false;
+    int remaining = -1;
+    if(timeout >= 0)
+    {
+      remaining = timeout - static_cast<int>(timer.elapsed());
+      if(remaining <= 0)
+        return false;
+    }
+    futexWait(&m_pHeader->writeSeq, writeSeq, remaining);
+  }
+#else
+  Q_UNUSED(timeout);
+  return false;
+#endif
+}
+
+void AVSharedFrameRing::release()
+{
+  Q_ASSERT(m_acquired);
+#ifdef Q_OS_LINUX
+  m_pHeader->readSeq.fetch_add(1, std::memory_order_release);
+  futexWake(&m_pHeader->readSeq);
+#endif
+  m_acquired = false;
+}
+
+bool AVSharedFrameRing::isClosed() const
+{ return m_pHeader->closed.load(std::memory_order_acquire) && m_pHeader->writeSeq.load() == m_pHeader->readSeq.load(); }
+
+AVSharedFrameRing::SlotHeader *AVSharedFrameRing::_slotHeader(quint32 seq) const
+{
+  qint64 offset = alignUp(sizeof(RingHeader)) + m_slotStride * (seq % m_slotCount);
+  return reinterpret_cast<SlotHeader*>(m_pMap + offset);
+}
+
+uchar *AVSharedFrameRing::_slotData(quint32 seq) const
+{ return reinterpret_cast<uchar*>(_slotHeader(seq)) + alignUp(sizeof(SlotHeader)); }
+
+bool AVSharedFrameRing::_fillView(const SlotHeader &slot, const uchar *pData, FrameView *pOut) const
+{
+  // plane pointers are derived from the validated format and size, the offsets of the producer must match them
+  uint8_t *data[MaxPlaneCount] = {nullptr};
+  int linesize[MaxPlaneCount] = {0};
+  int planeCount;
+  int dataSize;
+  if(slot.mediaType == AVMEDIA_TYPE_AUDIO)
+  {
+    if(slot.format < 0 || slot.format >= AV_SAMPLE_FMT_NB || slot.channelCount <= 0 || slot.channelCount > g_maxChannelCount || slot.sampleCount <= 0)
+      return false;
+    auto format = static_cast<AVSampleFormat>(slot.format);
+    planeCount = av_sample_fmt_is_planar(format) ? slot.channelCount : 1;
+    if(planeCount > MaxPlaneCount)
+      return false;
+    dataSize = av_samples_get_buffer_size(nullptr, slot.channelCount, slot.sampleCount, format, 1);
+    if(dataSize <= 0 || dataSize > m_slotDataSize)
+      return false;
+    av_samples_fill_arrays(data, linesize, pData, slot.channelCount, slot.sampleCount, format, 1);
+  }
+  else if(slot.mediaType == AVMEDIA_TYPE_VIDEO)
+  {
+    auto format = static_cast<AVPixelFormat>(slot.format);
+    const AVPixFmtDescriptor *pDesc = av_pix_fmt_desc_get(format);
+    if(!pDesc || (pDesc->flags & AV_PIX_FMT_FLAG_HWACCEL) || av_image_check_size(static_cast<unsigned>(slot.width), static_cast<unsigned>(slot.height)) < 0)
+      return false;
+    planeCount = av_pix_fmt_count_planes(format);
+    if(planeCount <= 0 || planeCount > MaxPlaneCount)
+      return false;
+    dataSize = av_image_get_buffer_size(format, slot.width, slot.height, 1);
+    if(dataSize <= 0 || dataSize > m_slotDataSize)
+      return false;
+    av_image_fill_arrays(data, linesize, pData, format, slot.width, slot.height, 1);
+  }
+  else
+    return false;
+
+  if(slot.planeCount != planeCount)
+    return false;
+  for(int i = 0; i < planeCount; ++i)
+  {
+    if(slot.planeOffset[i] != data[i] - pData || slot.linesize[i] != linesize[i])
+      return false;
+  }
+
+  pOut->mediaType = static_cast<AVMediaType>(slot.mediaType);
+  pOut->format = slot.format;
+  pOut->width = slot.width;
+  pOut->height = slot.height;
+  pOut->samprate = slot.samprate;
+  pOut->channelCount = slot.channelCount;
+  pOut->channelLayout = slot.channelLayout;
+  pOut->sampleCount = slot.sampleCount;
+  pOut->pts = slot.pts;
+  pOut->timeBase.num = slot.timeBaseNum;
+  pOut->timeBase.den = slot.timeBaseDen;
+  pOut->planeCount = planeCount;
+  for(int i = 0; i < MaxPlaneCount; ++i)
+  {
+    pOut->data[i] = i < planeCount ? data[i] : nullptr;
+    pOut->linesize[i] = i < planeCount ? linesize[i] : 0;
+  }
+  return true;
+}
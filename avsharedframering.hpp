@@ -0,0 +1,79 @@
+#pragma once
+
+#include <QtGlobal>
+#include <stdexcept>
+#include "publicutil.hpp"
+
+extern "C"
+{
+#include <libavutil/avutil.h>
+#include <libavutil/frame.h>
+}
+
+DEFINE_EXCEPTION(SharedMemoryError, std::runtime_error)
+
+// Single producer, single consumer ring of decoded frames in a memfd backed
+// shared memory region, for handing frames to another process on the same
+// host. The producer creates the ring and passes fd() to the consumer
+// (inherited or over a unix socket), which attaches to it. Readers get
+// views into the shared slots, signaling is lock-free through futexes.
+// The consumer does not trust the producer: the ring geometry is copied
+// and validated once at attach, and every slot's layout is recomputed
+// from its validated format before pointers are handed out. The memfd is
+// sealed against resizing, and attach() rejects an fd without those seals.
+// Only supported on Linux.
+class AVSharedFrameRing final
+{
+public:
+  enum { MaxPlaneCount = 8 };
+
+  struct FrameView
+  {
+    AVMediaType mediaType;
+    int format;
+    int width, height;
+    int samprate, channelCount;
+    quint64 channelLayout;
+    int sampleCount;
+    qint64 pts;
+    AVRational timeBase;
+    int planeCount;
+    const uint8_t *data[MaxPlaneCount];
+    int linesize[MaxPlaneCount];
+  };
+
+  static AVSharedFrameRing *create(int slotCount, qint64 slotDataSize);
+  static AVSharedFrameRing *attach(int fd);
+  ~AVSharedFrameRing();
+
+  int fd() const;
+  int slotCount() const;
+  qint64 slotDataSize() const;
+
+  // producer side
+  bool write(const AVFrame *pFrame, AVRational timeBase, int timeout = -1);
+  void close();
+
+  // consumer side, a view stays valid until release()
+  bool acquire(FrameView *pOut, int timeout = -1);
+  void release();
+  bool isClosed() const;
+
+private:
+  struct RingHeader;
+  struct SlotHeader;
+
+  AVSharedFrameRing(int fd, uchar *pMap, qint64 mapSize, quint32 slotCount, qint64 slotDataSize, qint64 slotStride);
+  SlotHeader *_slotHeader(quint32 seq) const;
+  uchar *_slotData(quint32 seq) const;
+  bool _fillView(const SlotHeader &slot, const uchar *pData, FrameView *pOut) const;
+
+  int m_fd;
+  uchar *m_pMap;
+  qint64 m_mapSize;
+  RingHeader *m_pHeader;
+  // private copy of the geometry, the shared header may change after attach
+  quint32 m_slotCount;
+  qint64 m_slotDataSize, m_slotStride;
+  bool m_acquired;
+};
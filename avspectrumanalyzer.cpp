@@ -0,0 +1,331 @@
+#include "avspectrumanalyzer.hpp"
+#include "privateutil.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace
+{
+  const float g_floorDb = -120.0f;
+  const int g_freshFlag = 0x4;
+  const int g_frameRingSize = 64;
+
+  int nextPowerOfTwo(int v)
+  {
+    int result = 1;
+    while(result < v)
+      result *= 2;
+    return result;
+  }
+}
+
+AVSpectrumAnalyzer::AVSpectrumAnalyzer(int samprate, int fftSize, int bandCount, int hopSize, QObject *parent) : QThread(parent)
+{
+  Q_ASSERT(samprate > 0);
+  Q_ASSERT(fftSize >= 16 && (fftSize & (fftSize - 1)) == 0);
+  Q_ASSERT(bandCount > 0);
+  Q_ASSERT(hopSize >= 0 && hopSize <= fftSize);
+  m_samprate = samprate;
+  m_fftSize = fftSize;
+  m_bandCount = bandCount;
+  m_hopSize = hopSize > 0 ? hopSize : fftSize / 2;
+  m_minFrequency = 20.0;
+
+  m_frameRing.resize(g_frameRingSize);
+  for(AVFrame *&pFrame:m_frameRing)
+    pFrame = av_frame_alloc();
+  m_writeIndex = 0;
+  m_readIndex = 0;
+  m_droppedSampleCount = 0;
+  m_resetRequested = false;
+  m_sampleBuffer.resize(nextPowerOfTwo(std::max(8192, 2 * fftSize)));
+  m_channelBuffer.resize(8192);
+  m_sampleCount = 0;
+
+  m_window.fill(0.0f, fftSize);
+  m_hann.resize(fftSize);
+  float hannSum = 0.0f;
+  for(int i = 0; i < fftSize; ++i)
+  {
+    m_hann[i] = 0.5f - 0.5f * static_cast<float>(std::cos(2.0 * M_PI * i / fftSize));
+    hannSum += m_hann[i];
+  }
+  // single sided amplitude of a full scale sine is 1
+  m_amplitudeScale = 2.0f / hannSum;
+  m_real.resize(fftSize);
+  m_imag.resize(fftSize);
+  m_magnitude.resize(fftSize / 2 + 1);
+
+  m_cos.resize(fftSize / 2);
+  m_sin.resize(fftSize / 2);
+  for(int i = 0; i < fftSize / 2; ++i)
+  {
+    m_cos[i] = static_cast<float>(std::cos(2.0 * M_PI * i / fftSize));
+    m_sin[i] = static_cast<float>(std::sin(2.0 * M_PI * i / fftSize));
+  }
+  m_bitReverse.resize(fftSize);
+  int nBit = 0;
+  while((1 << nBit) < fftSize)
+    ++nBit;
+  for(int i = 0; i < fftSize; ++i)
+  {
+    int reversed = 0;
+    for(int iBit = 0; iBit < nBit; ++iBit)
+    {
+      if(i & (1 << iBit))
+        reversed |= 1 << (nBit - 1 - iBit);
+    }
+    m_bitReverse[i] = reversed;
+  }
+  _planBands();
+  m_sequence = 0;
+
+  for(Spectrum &slot:m_slot)
+  {
+    slot.bandList.fill(g_floorDb, bandCount);
+    slot.peak = 0.0f;
+    slot.rms = 0.0f;
+    slot.sequence = -1;
+  }
+  m_backSlot = 0;
+  m_middleSlot = 1;
+  m_frontSlot = 2;
+}
+
+AVSpectrumAnalyzer::~AVSpectrumAnalyzer()
+{
+  requestStop(false);
+  for(AVFrame *&pFrame:m_frameRing)
+    av_frame_free(&pFrame);
+}
+
+int AVSpectrumAnalyzer::samprate() const
+{ return m_samprate; }
+
+int AVSpectrumAnalyzer::fftSize() const
+{ return m_fftSize; }
+
+int AVSpectrumAnalyzer::bandCount() const
+{ return m_bandCount; }
+
+int AVSpectrumAnalyzer::hopSize() const
+{ return m_hopSize; }
+
+void AVSpectrumAnalyzer::setMinFrequency(double v)
+{
+  Q_ASSERT(!isRunning());
+  Q_ASSERT(v > 0.0);
+  m_minFrequency = v;
+  _planBands();
+}
+
+double AVSpectrumAnalyzer::minFrequency() const
+{ return m_minFrequency; }
+
+void AVSpectrumAnalyzer::push(const AVFrame *pFrame)
+{
+  Q_ASSERT(pFrame);
+  Q_ASSERT(pFrame->sample_rate == m_samprate);
+  if(pFrame->nb_samples <= 0 || av_frame_get_channels(pFrame) <= 0)
+    return;
+
+  // a full ring means the worker is behind, the newest frame is dropped
+  quint64 writeIndex = m_writeIndex.load(std::memory_order_relaxed);
+  quint64 readIndex = m_readIndex.load(std::memory_order_acquire);
+  if(writeIndex - readIndex >= static_cast<quint64>(g_frameRingSize) ||
+     av_frame_ref(m_frameRing[static_cast<int>(writeIndex % g_frameRingSize)], pFrame) < 0)
+  {
+    m_droppedSampleCount += pFrame->nb_samples;
+    return;
+  }
+  m_writeIndex.store(writeIndex + 1, std::memory_order_release);
+}
+
+void AVSpectrumAnalyzer::reset()
+{ m_resetRequested = true; }
+
+qint64 AVSpectrumAnalyzer::droppedSampleCount() const
+{ return m_droppedSampleCount; }
+
+bool AVSpectrumAnalyzer::latest(Spectrum *pOut)
+{
+  Q_ASSERT(pOut);
+  if(!(m_middleSlot.load(std::memory_order_acquire) & g_freshFlag))
+    return false;
+  m_frontSlot = m_middleSlot.exchange(m_frontSlot, std::memory_order_acq_rel) & ~g_freshFlag;
+
+  // copied element wise, sharing the slot's vector would make the worker allocate on its next write
+  const Spectrum &slot = m_slot[m_frontSlot];
+  pOut->bandList.resize(slot.bandList.size());
+  std::copy(slot.bandList.constBegin(), slot.bandList.constEnd(), pOut->bandList.begin());
+  pOut->peak = slot.peak;
+  pOut->rms = slot.rms;
+  pOut->sequence = slot.sequence;
+  return true;
+}
+
+void AVSpectrumAnalyzer::requestStop(bool async)
+{
+  requestInterruption();
+  if(!async)
+    wait();
+}
+
+void AVSpectrumAnalyzer::run()
+{
+  // polling at about half the hop keeps push() free of any signaling
+  unsigned long pollInterval = static_cast<unsigned long>(std::max(1, m_hopSize * 500 / m_samprate));
+  while(!isInterruptionRequested())
+  {
+    if(m_resetRequested.exchange(false))
+    {
+      _clearFrames();
+      m_sampleCount = 0;
+      std::fill(m_window.begin(), m_window.end(), 0.0f);
+    }
+    if(!_readHop())
+    {
+      quint64 readIndex = m_readIndex.load(std::memory_order_relaxed);
+      if(readIndex == m_writeIndex.load(std::memory_order_acquire))
+      {
+        msleep(pollInterval);
+        continue;
+      }
+      AVFrame *pFrame = m_frameRing[static_cast<int>(readIndex % g_frameRingSize)];
+      _downmixFrame(pFrame);
+      av_frame_unref(pFrame);
+      m_readIndex.store(readIndex + 1, std::memory_order_release);
+      continue;
+    }
+    _analyze(&m_slot[m_backSlot]);
+    m_backSlot = m_middleSlot.exchange(m_backSlot | g_freshFlag, std::memory_order_acq_rel) & ~g_freshFlag;
+  }
+  _clearFrames();
+}
+
+void AVSpectrumAnalyzer::_planBands()
+{
+  // band edges are spaced logarithmically, a band narrower than a bin still gets one bin
+  int nBin = m_fftSize / 2 + 1;
+  double nyquist = static_cast<double>(m_samprate) / 2.0;
+  double minFrequency = std::min(m_minFrequency, nyquist / 2.0);
+  m_bandBeginList.resize(m_bandCount + 1);
+  for(int iBand = 0; iBand <= m_bandCount; ++iBand)
+  {
+    double frequency = minFrequency * std::pow(nyquist / minFrequency, static_cast<double>(iBand) / static_cast<double>(m_bandCount));
+    int iBin = static_cast<int>(std::round(frequency * m_fftSize / m_samprate));
+    m_bandBeginList[iBand] = std::max(1, std::min(iBin, nBin));
+  }
+}
+
+void AVSpectrumAnalyzer::_clearFrames()
+{
+  quint64 writeIndex = m_writeIndex.load(std::memory_order_acquire);
+  for(quint64 readIndex = m_readIndex.load(std::memory_order_relaxed); readIndex != writeIndex; ++readIndex)
+    av_frame_unref(m_frameRing[static_cast<int>(readIndex % g_frameRingSize)]);
+  m_readIndex.store(writeIndex, std::memory_order_release);
+}
+
+void AVSpectrumAnalyzer::_downmixFrame(const AVFrame *pFrame)
+{
+  int n = pFrame->nb_samples;
+  int nChannel = av_frame_get_channels(pFrame);
+  if(m_sampleBuffer.size() < m_sampleCount + n)
+    m_sampleBuffer.resize(nextPowerOfTwo(m_sampleCount + n));
+  if(m_channelBuffer.size() < n)
+    m_channelBuffer.resize(n);
+
+  float *pMono = m_sampleBuffer.data() + m_sampleCount;
+  readAudioFrameAsFloat(pFrame, 0, pMono);
+  for(int iChannel = 1; iChannel < nChannel; ++iChannel)
+  {
+    readAudioFrameAsFloat(pFrame, iChannel, m_channelBuffer.data());
+    for(int i = 0; i < n; ++i)
+      pMono[i] += m_channelBuffer.at(i);
+  }
+  if(nChannel > 1)
+  {
+    float scale = 1.0f / static_cast<float>(nChannel);
+    for(int i = 0; i < n; ++i)
+      pMono[i] *= scale;
+  }
+  m_sampleCount += n;
+}
+
+bool AVSpectrumAnalyzer::_readHop()
+{
+  if(m_sampleCount < m_hopSize)
+    return false;
+
+  std::memmove(m_window.data(), m_window.constData() + m_hopSize, sizeof(float) * static_cast<size_t>(m_fftSize - m_hopSize));
+  std::memcpy(m_window.data() + m_fftSize - m_hopSize, m_sampleBuffer.constData(), sizeof(float) * static_cast<size_t>(m_hopSize));
+  m_sampleCount -= m_hopSize;
+  std::memmove(m_sampleBuffer.data(), m_sampleBuffer.constData() + m_hopSize, sizeof(float) * static_cast<size_t>(m_sampleCount));
+  return true;
+}
+
+void AVSpectrumAnalyzer::_analyze(Spectrum *pOut)
+{
+  float peak = 0.0f;
+  double energy = 0.0;
+  for(int i = 0; i < m_fftSize; ++i)
+  {
+    float v = m_window.at(i);
+    peak = std::max(peak, std::abs(v));
+    energy += static_cast<double>(v) * static_cast<double>(v);
+    m_real[i] = v * m_hann.at(i);
+    m_imag[i] = 0.0f;
+  }
+  _transform();
+
+  int nBin = m_fftSize / 2 + 1;
+  for(int iBin = 0; iBin < nBin; ++iBin)
+    m_magnitude[iBin] = std::sqrt(m_real.at(iBin) * m_real.at(iBin) + m_imag.at(iBin) * m_imag.at(iBin)) * m_amplitudeScale;
+
+  float *pBand = pOut->bandList.data();
+  for(int iBand = 0; iBand < m_bandCount; ++iBand)
+  {
+    int begin = std::min(m_bandBeginList.at(iBand), nBin - 1);
+    int end = std::min(std::max(begin + 1, m_bandBeginList.at(iBand + 1)), nBin);
+    float magnitude = *std::max_element(m_magnitude.constBegin() + begin, m_magnitude.constBegin() + end);
+    pBand[iBand] = magnitude > 0.0f ? std::max(g_floorDb, 20.0f * std::log10(magnitude)) : g_floorDb;
+  }
+  pOut->peak = peak;
+  pOut->rms = static_cast<float>(std::sqrt(energy / m_fftSize));
+  pOut->sequence = m_sequence++;
+}
+
+void AVSpectrumAnalyzer::_transform()
+{
+  // iterative radix-2 decimation in time
+  float *pReal = m_real.data();
+  float *pImag = m_imag.data();
+  for(int i = 0; i < m_fftSize; ++i)
+  {
+    int j = m_bitReverse.at(i);
+    if(j > i)
+    {
+      std::swap(pReal[i], pReal[j]);
+      std::swap(pImag[i], pImag[j]);
+    }
+  }
+  for(int size = 2; size <= m_fftSize; size *= 2)
+  {
+    int half = size / 2;
+    int step = m_fftSize / size;
+    for(int start = 0; start < m_fftSize; start += size)
+    {
+      for(int k = 0; k < half; ++k)
+      {
+        float c = m_cos.at(k * step), s = m_sin.at(k * step);
+        int a = start + k, b = a + half;
+        float tReal = pReal[b] * c + pImag[b] * s;
+        float tImag = pImag[b] * c - pReal[b] * s;
+        pReal[b] = pReal[a] - tReal;
+        pImag[b] = pImag[a] - tImag;
+        pReal[a] += tReal;
+        pImag[a] += tImag;
+      }
+    }
+  }
+}
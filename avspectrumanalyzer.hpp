@@ -0,0 +1,89 @@
+#pragma once
+
+#include <QThread>
+#include <QVector>
+#include <atomic>
+
+extern "C"
+{
+#include <libavutil/avutil.h>
+#include <libavutil/frame.h>
+}
+
+// Spectrum of the audio a provider hands out, computed off the playback
+// thread. push() only references the frame into a lock-free single
+// producer ring of preallocated frames, the worker converts and downmixes
+// it, runs Hann windowed FFTs every hopSize samples with tables planned up
+// front, and publishes band levels, peak and RMS through a triple buffer.
+// latest() never blocks the worker. push(), reset() and latest() may each
+// be used by a single thread.
+class AVSpectrumAnalyzer final : public QThread
+{
+  Q_OBJECT
+public:
+  struct Spectrum
+  {
+    QVector<float> bandList;  // dBFS, logarithmically spaced from minFrequency up to nyquist
+    float peak;               // linear sample peak of the window
+    float rms;                // linear RMS of the window
+    qint64 sequence;          // windows analyzed before this one
+  };
+
+  // fftSize must be a power of two, zero hopSize means half a window
+  AVSpectrumAnalyzer(int samprate, int fftSize = 2048, int bandCount = 32, int hopSize = 0, QObject *parent = nullptr);
+  ~AVSpectrumAnalyzer();
+
+  int samprate() const;
+  int fftSize() const;
+  int bandCount() const;
+  int hopSize() const;
+  void setMinFrequency(double v);  // before start()
+  double minFrequency() const;
+
+  void push(const AVFrame *pFrame);
+  void reset();
+  qint64 droppedSampleCount() const;
+
+  // true if a newer spectrum than the previous call was published
+  bool latest(Spectrum *pOut);
+
+  void requestStop(bool async = true);
+
+protected:
+  void run() override;
+
+private:
+  void _planBands();
+  void _clearFrames();
+  void _downmixFrame(const AVFrame *pFrame);
+  bool _readHop();
+  void _analyze(Spectrum *pOut);
+  void _transform();
+
+  int m_samprate, m_fftSize, m_bandCount, m_hopSize;
+  double m_minFrequency;
+
+  // single producer single consumer ring of referenced frames
+  QVector<AVFrame*> m_frameRing;
+  std::atomic<quint64> m_writeIndex, m_readIndex;
+  std::atomic<qint64> m_droppedSampleCount;
+  std::atomic<bool> m_resetRequested;
+  // worker side mono samples not yet analyzed, only ever grown
+  QVector<float> m_sampleBuffer, m_channelBuffer;
+  int m_sampleCount;
+
+  // worker state, planned in the constructor
+  QVector<float> m_window, m_hann;
+  QVector<float> m_magnitude;
+  QVector<float> m_real, m_imag;
+  QVector<float> m_cos, m_sin;
+  QVector<int> m_bitReverse;
+  QVector<int> m_bandBeginList;  // first bin of each band, plus the end
+  float m_amplitudeScale;
+  qint64 m_sequence;
+
+  // triple buffer, the middle index carries a fresh flag
+  Spectrum m_slot[3];
+  int m_backSlot, m_frontSlot;
+  std::atomic<int> m_middleSlot;
+};
@@ -0,0 +1,87 @@
+#include "avtailwatcher.hpp"
+#include <QFile>
+#include <QFileInfo>
+#include <QElapsedTimer>
+#include <QThread>
+#include <algorithm>
+
+#ifdef Q_OS_LINUX
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+AVTailWatcher::AVTailWatcher(const QString &path)
+{
+  m_path = path;
+  m_inotifyFd = -1;
+#ifdef Q_OS_LINUX
+  m_inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if(m_inotifyFd >= 0)
+  {
+    QByteArray nativePath = QFile::encodeName(path);
+    if(inotify_add_watch(m_inotifyFd, nativePath.constData(), IN_MODIFY | IN_CLOSE_WRITE) < 0)
+    {
+      qWarning("Failed to watch file, fall back to polling.");
+      close(m_inotifyFd);
+      m_inotifyFd = -1;
+    }
+  }
+#endif
+}
+
+AVTailWatcher::~AVTailWatcher()
+{
+#ifdef Q_OS_LINUX
+  if(m_inotifyFd >= 0)
+    close(m_inotifyFd);
+#endif
+}
+
+bool AVTailWatcher::waitForGrowth(qint64 knownSize, int idleTimeout, const std::atomic<bool> *pAbort)
+{
+  QElapsedTimer timer;
+  timer.start();
+  while(true)
+  {
+    if(_currentSize() > knownSize)
+      return true;
+    if(pAbort && *pAbort)
+      return false;
+
+    // wake up regularly so an abort request is seen even if the writer stalls
+    int timeout = 50;
+    if(idleTimeout >= 0)
+    {
+      qint64 remaining = idleTimeout - timer.elapsed();
+      if(remaining <= 0)
+        return false;
+      timeout = static_cast<int>(std::min<qint64>(timeout, remaining));
+    }
+    _waitForEvent(timeout);
+  }
+}
+
+qint64 AVTailWatcher::_currentSize() const
+{ return QFileInfo(m_path).size(); }
+
+void AVTailWatcher::_waitForEvent(int timeout)
+{
+#ifdef Q_OS_LINUX
+  if(m_inotifyFd >= 0)
+  {
+    pollfd fd;
+    fd.fd = m_inotifyFd;
+    fd.events = POLLIN;
+    fd.revents = 0;
+    if(poll(&fd, 1, timeout) > 0)
+    {
+      char buf[4096];
+      while(read(m_inotifyFd, buf, sizeof(buf)) > 0)
+        (void)0;
+    }
+    return;
+  }
+#endif
+  QThread::msleep(static_cast<unsigned long>(std::min(timeout, 10)));
+}
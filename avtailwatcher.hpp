@@ -0,0 +1,24 @@
+#pragma once
+
+#include <QString>
+#include <atomic>
+
+// Waits for a file to grow. Uses inotify on Linux and falls back to polling
+// the file size elsewhere or when inotify is unavailable.
+class AVTailWatcher final
+{
+public:
+  AVTailWatcher(const QString &path);
+  ~AVTailWatcher();
+
+  // Returns true as soon as the file is larger than knownSize, false when
+  // idleTimeout (ms, negative for infinite) expires or pAbort becomes true.
+  bool waitForGrowth(qint64 knownSize, int idleTimeout, const std::atomic<bool> *pAbort);
+
+private:
+  qint64 _currentSize() const;
+  void _waitForEvent(int timeout);
+
+  QString m_path;
+  int m_inotifyFd;
+};
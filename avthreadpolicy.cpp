@@ -0,0 +1,155 @@
+#include "avthreadpolicy.hpp"
+#include <QMutex>
+#include <QThread>
+
+#ifdef Q_OS_LINUX
+#include <cerrno>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+  struct PolicyTable
+  {
+    PolicyTable()
+    {
+      for(AVThreadPolicy::Policy &policy:policyList)
+      {
+        policy.niceValue = 0;
+        policy.realtimePriority = 0;
+      }
+      // opening keeps the default class, the codec threads it creates inherit it and later decode for playback
+      policyList[AVThreadPolicy::PreloadRole].niceValue = 5;
+      policyList[AVThreadPolicy::TeardownRole].niceValue = 10;
+    }
+
+    QMutex locker;
+    AVThreadPolicy::Policy policyList[AVThreadPolicy::RoleCount];
+  };
+
+  PolicyTable *policyTable()
+  {
+    static PolicyTable table;
+    return &table;
+  }
+}
+
+void AVThreadPolicy::setPolicy(AVThreadPolicy::Role role, const AVThreadPolicy::Policy &policy)
+{
+  Q_ASSERT(role >= 0 && role < RoleCount);
+  PolicyTable *table = policyTable();
+  table->locker.lock();
+  table->policyList[role] = policy;
+  table->locker.unlock();
+}
+
+AVThreadPolicy::Policy AVThreadPolicy::policy(AVThreadPolicy::Role role)
+{
+  Q_ASSERT(role >= 0 && role < RoleCount);
+  PolicyTable *table = policyTable();
+  QMutexLocker locker(&table->locker);
+  return table->policyList[role];
+}
+
+bool AVThreadPolicy::applyToCurrentThread(AVThreadPolicy::Role role)
+{
+  Policy threadPolicy = policy(role);
+  bool ok = true;
+#ifdef Q_OS_LINUX
+  // state of the thread before the first policy, restored when a role no longer asks for a change
+  struct ThreadState
+  {
+    bool captured = false;
+    int baseNice = 0;
+    bool pinned = false;
+    cpu_set_t baseCpuSet;
+  };
+  static thread_local ThreadState state;
+  pid_t tid = static_cast<pid_t>(syscall(SYS_gettid));
+  if(!state.captured)
+  {
+    errno = 0;
+    int niceValue = getpriority(PRIO_PROCESS, static_cast<id_t>(tid));
+    state.baseNice = errno == 0 ? niceValue : 0;
+    state.captured = true;
+  }
+
+  // scheduling class, SCHED_FIFO and SCHED_BATCH can both be left again without privileges
+  {
+    sched_param param;
+    param.sched_priority = threadPolicy.realtimePriority > 0 ? threadPolicy.realtimePriority : 0;
+    int schedPolicy = SCHED_OTHER;
+    if(threadPolicy.realtimePriority > 0)
+      schedPolicy = SCHED_FIFO;
+    else if(threadPolicy.niceValue > 0)
+      schedPolicy = SCHED_BATCH;
+    if(pthread_setschedparam(pthread_self(), schedPolicy, &param) != 0)
+    {
+      qWarning("Failed to set scheduling policy of thread for role %d.", role);
+      ok = false;
+    }
+  }
+
+  // nice value is per thread on Linux, it is only ever lowered below the base and raised back to it
+  if(threadPolicy.realtimePriority <= 0)
+  {
+    int targetNice = state.baseNice + qMin(threadPolicy.niceValue, 0);
+    errno = 0;
+    int currentNice = getpriority(PRIO_PROCESS, static_cast<id_t>(tid));
+    if((errno != 0 || currentNice != targetNice) && setpriority(PRIO_PROCESS, static_cast<id_t>(tid), targetNice) != 0)
+    {
+      qWarning("Failed to set nice value %d of thread for role %d.", targetNice, role);
+      ok = false;
+    }
+  }
+
+  // affinity, an empty list leaves it alone unless an earlier role pinned the thread
+  if(!threadPolicy.cpuList.isEmpty())
+  {
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    for(int iCpu:threadPolicy.cpuList)
+    {
+      if(iCpu >= 0 && iCpu < CPU_SETSIZE)
+        CPU_SET(iCpu, &cpuSet);
+    }
+    if(!state.pinned && sched_getaffinity(0, sizeof(state.baseCpuSet), &state.baseCpuSet) == 0)
+      state.pinned = true;
+    if(sched_setaffinity(0, sizeof(cpuSet), &cpuSet) != 0)
+    {
+      qWarning("Failed to set cpu affinity of thread for role %d.", role);
+      ok = false;
+    }
+  }
+  else if(state.pinned)
+  {
+    if(sched_setaffinity(0, sizeof(state.baseCpuSet), &state.baseCpuSet) != 0)
+    {
+      qWarning("Failed to restore cpu affinity of thread for role %d.", role);
+      ok = false;
+    }
+    state.pinned = false;
+  }
+#else
+  QThread::Priority priority = QThread::NormalPriority;
+  if(threadPolicy.realtimePriority > 0)
+    priority = QThread::TimeCriticalPriority;
+  else if(threadPolicy.niceValue < 0)
+    priority = QThread::HighPriority;
+  else if(threadPolicy.niceValue >= 10)
+    priority = QThread::LowestPriority;
+  else if(threadPolicy.niceValue > 0)
+    priority = QThread::LowPriority;
+  QThread::currentThread()->setPriority(priority);
+  if(!threadPolicy.cpuList.isEmpty())
+  {
+    qWarning("Cpu pinning is only supported on Linux.");
+    ok = false;
+  }
+#endif
+  return ok;
+}
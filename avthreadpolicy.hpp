@@ -0,0 +1,36 @@
+#pragma once
+
+#include <QVector>
+
+// Scheduling policy of the pipeline threads, by the role they currently play.
+// Codec worker threads are created while opening and inherit the policy of OpenRole.
+// Threads move between roles, so every change a policy makes must be reversible
+// without privileges: positive nice values demote to SCHED_BATCH instead of
+// raising the nice value, which an unprivileged thread could never lower again.
+class AVThreadPolicy final
+{
+public:
+  enum Role
+  {
+    PlaybackRole = 0,
+    PreloadRole,
+    OpenRole,
+    TeardownRole,
+    SeekRole,
+    RoleCount
+  };
+
+  struct Policy
+  {
+    int niceValue;         // 0 keeps the default priority, > 0 demotes to SCHED_BATCH, < 0 usually needs privileges
+    int realtimePriority;  // > 0 switches to SCHED_FIFO with this priority
+    QVector<int> cpuList;  // empty leaves the affinity of the thread as it was before any pinning
+  };
+
+  static void setPolicy(Role role, const Policy &policy);
+  static Policy policy(Role role);
+  static bool applyToCurrentThread(Role role);
+
+private:
+  AVThreadPolicy() = delete;
+};
@@ -0,0 +1,316 @@
+#include "avvideoitem.hpp"
+#include "avframeprovider.hpp"
+#include "avprovider.hpp"
+#include <QThread>
+#include <QQuickWindow>
+#include <QSGSimpleTextureNode>
+#include <QSGRendererInterface>
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+#include <QDebug>
+#include <algorithm>
+
+extern "C"
+{
+#include <libswscale/swscale.h>
+}
+
+class AVVideoDecodeThread final : public QThread
+{
+public:
+  AVVideoDecodeThread(AVVideoItem *item, QObject *parent = nullptr) : QThread(parent)
+  { m_item = item; }
+
+protected:
+  void run() override
+  {
+    SwsContext *pSwsCtx = nullptr;
+    try
+    {
+      _decodeLoop(&pSwsCtx);
+    }
+    catch(const std::exception &e)
+    {
+      qWarning("Video decoding stopped: %s", e.what());
+    }
+    sws_freeContext(pSwsCtx);
+  }
+
+private:
+  void _decodeLoop(SwsContext **ppSwsCtx)
+  {
+    SwsContext *&pSwsCtx = *ppSwsCtx;
+    double lastPts = 0.0;
+    while(!isInterruptionRequested())
+    {
+      // paused
+      if(m_item->m_clockStarted && !m_item->m_clock.isRunning())
+      {
+        msleep(5);
+        continue;
+      }
+
+      const AVFrame *pFrame = nullptr;
+      double pts = 0.0;
+      if(m_item->m_frameProvider)
+      {
+        if(!m_item->m_frameProvider->nextVideoFrame())
+          break;
+        pFrame = m_item->m_frameProvider->currentVideoFrame();
+        pts = m_item->m_frameProvider->videoPts();
+      }
+      else
+      {
+        // a finished item makes AVProvider move on to the next one
+        if(!m_item->m_provider->nextFrame())
+          continue;
+        AVFrameProvider *provider = m_item->m_provider->currentFrameProvider();
+        if(provider->currentFrameType() != AVFrameProvider::VideoFrame)
+          continue;
+        pFrame = provider->currentVideoFrame();
+        pts = provider->videoPts();
+      }
+
+      // convert
+      AVVideoItem::FrameBox *box = m_item->_takeRecycledBox();
+      // byte order matches GL_RGBA, so the render thread can upload it as is
+      if(box->image.width() != pFrame->width || box->image.height() != pFrame->height)
+        box->image = QImage(pFrame->width, pFrame->height, QImage::Format_RGBX8888);
+      pSwsCtx = sws_getCachedContext(pSwsCtx, pFrame->width, pFrame->height, static_cast<AVPixelFormat>(pFrame->format),
+                                     pFrame->width, pFrame->height, AV_PIX_FMT_RGBA, SWS_BILINEAR, nullptr, nullptr, nullptr);
+      if(!pSwsCtx)
+      {
+        qWarning("Cannot convert video frame.");
+        delete box;
+        continue;
+      }
+      uint8_t *dstData[1] = {box->image.bits()};
+      int dstLinesize[1] = {box->image.bytesPerLine()};
+      sws_scale(pSwsCtx, pFrame->data, pFrame->linesize, 0, pFrame->height, dstData, dstLinesize);
+      box->pts = pts;
+
+      // the clock starts at the first frame and restarts when the timeline jumps back, e.g. on the next item
+      // a pause requested before the clock started holds it right at the first frame
+      if(!m_item->m_clockStarted || pts < lastPts - 0.5)
+      {
+        QMutexLocker locker(&m_item->m_clockLocker);
+        m_item->m_clock.start(pts);
+        m_item->m_clockStarted = true;
+        if(!m_item->m_playing)
+          m_item->m_clock.pause();
+      }
+      lastPts = pts;
+
+      // pace
+      while(!isInterruptionRequested())
+      {
+        double wait = pts - m_item->m_clock.time();
+        if(wait <= 0.004)
+          break;
+        msleep(static_cast<unsigned long>(std::min(wait * 1000.0, 10.0)));
+      }
+      m_item->_post(box);
+    }
+  }
+
+  AVVideoItem *m_item;
+};
+
+// texture node owning a GL texture that is refilled while the frame size stays the same
+class AVVideoNode final : public QSGSimpleTextureNode
+{
+public:
+  AVVideoNode()
+  {
+    setOwnsTexture(true);
+    setFiltering(QSGTexture::Linear);
+    m_textureId = 0;
+  }
+
+  void setImage(QQuickWindow *window, const QImage &image)
+  {
+    QOpenGLContext *context = QOpenGLContext::currentContext();
+    if(!context || window->rendererInterface()->graphicsApi() != QSGRendererInterface::OpenGL)
+    {
+      m_textureId = 0;
+      setTexture(window->createTextureFromImage(image));
+      return;
+    }
+
+    QOpenGLFunctions *gl = context->functions();
+    if(m_textureId && texture()->textureSize() == image.size())
+    {
+      gl->glBindTexture(GL_TEXTURE_2D, m_textureId);
+      gl->glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, image.width(), image.height(), GL_RGBA, GL_UNSIGNED_BYTE, image.constBits());
+      markDirty(DirtyMaterial);
+      return;
+    }
+
+    // the previous texture, and its GL texture, is deleted by setTexture()
+    gl->glGenTextures(1, &m_textureId);
+    gl->glBindTexture(GL_TEXTURE_2D, m_textureId);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image.width(), image.height(), 0, GL_RGBA, GL_UNSIGNED_BYTE, image.constBits());
+    setTexture(window->createTextureFromId(m_textureId, image.size(), QQuickWindow::TextureOwnsGLTexture));
+  }
+
+private:
+  GLuint m_textureId;
+};
+
+AVVideoItem::AVVideoItem(QQuickItem *parent) : QQuickItem(parent)
+{
+  setFlag(ItemHasContents, true);
+  m_ownedProvider = nullptr;
+  m_frameProvider = nullptr;
+  m_provider = nullptr;
+  m_decodeThread = new AVVideoDecodeThread(this);
+  m_clockStarted = false;
+  m_playing = false;
+  m_mailbox = nullptr;
+  m_recycled = nullptr;
+}
+
+AVVideoItem::~AVVideoItem()
+{
+  _stop();
+  delete m_decodeThread;
+  delete m_mailbox.exchange(nullptr);
+  delete m_recycled.exchange(nullptr);
+  if(m_ownedProvider)
+    delete m_ownedProvider;
+}
+
+QString AVVideoItem::source() const
+{ return m_source; }
+
+void AVVideoItem::setSource(const QString &v)
+{
+  if(m_source == v)
+    return;
+  _stop();
+  m_frameProvider = nullptr;
+  m_provider = nullptr;
+  if(m_ownedProvider)
+  {
+    delete m_ownedProvider;
+    m_ownedProvider = nullptr;
+  }
+  m_source = v;
+  if(!v.isEmpty())
+  {
+    try
+    {
+      m_ownedProvider = new AVFrameProvider(v, false, true);
+      m_ownedProvider->setPresentationClock(&m_clock);
+      m_ownedProvider->startDecoder(true);
+      m_frameProvider = m_ownedProvider;
+    }
+    catch(const std::exception &e)
+    {
+      qWarning()<<"Cannot open video source"<<v<<e.what();
+    }
+  }
+  emit sourceChanged();
+  if(m_playing)
+    _start();
+}
+
+void AVVideoItem::setFrameProvider(AVFrameProvider *provider)
+{
+  _stop();
+  m_frameProvider = provider;
+  m_provider = nullptr;
+  if(m_playing)
+    _start();
+}
+
+void AVVideoItem::setProvider(AVProvider *provider)
+{
+  _stop();
+  m_frameProvider = nullptr;
+  m_provider = provider;
+  if(m_playing)
+    _start();
+}
+
+bool AVVideoItem::isPlaying() const
+{ return m_playing; }
+
+void AVVideoItem::setPlaying(bool v)
+{
+  if(m_playing == v)
+    return;
+  m_clockLocker.lock();
+  m_playing = v;
+  if(!v && m_clockStarted)
+    m_clock.pause();
+  m_clockLocker.unlock();
+  if(v)
+    _start();
+  emit playingChanged();
+}
+
+AVPresentationClock *AVVideoItem::presentationClock()
+{ return &m_clock; }
+
+QSGNode *AVVideoItem::updatePaintNode(QSGNode *oldNode, QQuickItem::UpdatePaintNodeData *)
+{
+  auto node = static_cast<AVVideoNode*>(oldNode);
+  FrameBox *box = m_mailbox.exchange(nullptr);
+  if(box)
+  {
+    if(!node)
+      node = new AVVideoNode;
+    node->setImage(window(), box->image);
+    delete m_recycled.exchange(box);
+  }
+
+  if(node)
+  {
+    // letterbox
+    QSizeF frameSize = node->texture()->textureSize();
+    frameSize.scale(width(), height(), Qt::KeepAspectRatio);
+    node->setRect((width() - frameSize.width()) / 2.0, (height() - frameSize.height()) / 2.0, frameSize.width(), frameSize.height());
+  }
+  return node;
+}
+
+void AVVideoItem::_stop()
+{
+  m_decodeThread->requestInterruption();
+  m_decodeThread->wait();
+  m_clockStarted = false;
+}
+
+void AVVideoItem::_start()
+{
+  if(!m_frameProvider && !m_provider)
+    return;
+  m_clockLocker.lock();
+  if(m_clockStarted)
+    m_clock.resume();
+  m_clockLocker.unlock();
+  if(!m_decodeThread->isRunning())
+    m_decodeThread->start();
+  update();
+}
+
+AVVideoItem::FrameBox *AVVideoItem::_takeRecycledBox()
+{
+  FrameBox *box = m_recycled.exchange(nullptr);
+  return box ? box : new FrameBox;
+}
+
+void AVVideoItem::_post(AVVideoItem::FrameBox *box)
+{
+  // a frame the render thread did not pick up in time is replaced, its update is still pending
+  FrameBox *old = m_mailbox.exchange(box);
+  if(old)
+    delete m_recycled.exchange(old);
+  else
+    QMetaObject::invokeMethod(this, "update", Qt::QueuedConnection);
+}
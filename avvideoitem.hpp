@@ -0,0 +1,77 @@
+#pragma once
+
+#include <QQuickItem>
+#include <QImage>
+#include <QMutex>
+#include <atomic>
+#include "avpresentationclock.hpp"
+
+class AVFrameProvider;
+class AVProvider;
+class AVVideoDecodeThread;
+
+// Shows the video of an AVFrameProvider or AVProvider. A decode thread
+// converts frames, paces them against a presentation clock and drops the
+// latest one into a lock-free mailbox, which the render thread picks up in
+// updatePaintNode(), at most once per frame. A frame landing in an empty
+// mailbox queues one update(), so nothing is rendered while no new frame
+// comes. With OpenGL the texture is refilled in place while the frame size
+// stays, other backends such as software get an image texture per frame.
+class AVVideoItem : public QQuickItem
+{
+  Q_OBJECT
+  Q_PROPERTY(QString source READ source WRITE setSource NOTIFY sourceChanged)
+  Q_PROPERTY(bool playing READ isPlaying WRITE setPlaying NOTIFY playingChanged)
+
+public:
+  AVVideoItem(QQuickItem *parent = nullptr);
+  ~AVVideoItem();
+
+  // source opens an own video only provider, the other two are not owned
+  QString source() const;
+  void setSource(const QString &v);
+  void setFrameProvider(AVFrameProvider *provider);
+  void setProvider(AVProvider *provider);
+
+  bool isPlaying() const;
+  void setPlaying(bool v);
+
+  AVPresentationClock *presentationClock();
+
+signals:
+  void sourceChanged();
+  void playingChanged();
+
+protected:
+  QSGNode *updatePaintNode(QSGNode *oldNode, UpdatePaintNodeData *) override;
+
+private:
+  friend class AVVideoDecodeThread;
+
+  struct FrameBox
+  {
+    QImage image;
+    double pts;
+  };
+
+  void _stop();
+  void _start();
+  FrameBox *_takeRecycledBox();
+  void _post(FrameBox *box);
+
+  QString m_source;
+  AVFrameProvider *m_ownedProvider;
+  AVFrameProvider *m_frameProvider;
+  AVProvider *m_provider;
+  AVVideoDecodeThread *m_decodeThread;
+
+  AVPresentationClock m_clock;
+  // orders starting the clock on the decode thread against pausing it from setPlaying()
+  QMutex m_clockLocker;
+  std::atomic<bool> m_clockStarted;
+  std::atomic<bool> m_playing;
+
+  // single slot handoff from the decode thread to the render thread and back
+  std::atomic<FrameBox*> m_mailbox;
+  std::atomic<FrameBox*> m_recycled;
+};
@@ -2,8 +2,12 @@
 #include <QQmlApplicationEngine>
 #include <QElapsedTimer>
 #include <QThread>
+#include <QStringList>
+#include <algorithm>
+#include <QtQml>
 #include "avframeprovider.hpp"
 #include "avprovider.hpp"
+#include "avvideoitem.hpp"
 extern "C"
 {
   #include <libavutil/avutil.h>
@@ -11,10 +15,48 @@ extern "C"
   #include <libavcodec/avcodec.h>
 }
 
+// queues 100 files (repeating the given ones) and times how fast the queue moves from item to item
+static void benchmarkPlayQueue(const QStringList &pathList)
+{
+  const int itemCount = 100;
+  QElapsedTimer t;
+  t.start();
+  AVProvider provider(true, true);
+  for(int i = 0; i < itemCount; ++i)
+    provider.addToPlayQueue(pathList.at(i % pathList.size()));
+  double queued = static_cast<double>(t.nsecsElapsed()) / 1e9;
+
+  double total = 0.0;
+  double peak = 0.0;
+  int failed = 0;
+  for(int i = 0; i < itemCount; ++i)
+  {
+    t.start();
+    bool decoded = provider.currentFrameProvider() && provider.nextFrame();
+    double e = static_cast<double>(t.nsecsElapsed()) / 1e9;
+    total += e;
+    peak = std::max(peak, e);
+    // a failed nextFrame() has already moved on to the next item
+    if(decoded)
+      provider.nextItem();
+    else
+      ++failed;
+  }
+  qDebug("Queue:%lf Switch mean:%lf peak:%lf total:%lf failed:%d", queued, total / itemCount, peak, total, failed);
+}
+
 int main(int argc, char *argv[])
 {
   av_register_all();
   QGuiApplication app(argc, argv);
+  qmlRegisterType<AVVideoItem>("QFastAV", 1, 0, "AVVideoItem");
+
+  QStringList args = app.arguments();
+  if(args.size() > 2 && args.at(1) == "--bench-queue")
+  {
+    benchmarkPlayQueue(args.mid(2));
+    return 0;
+  }
 
   AVProvider provider(true, true);
   provider.addToPlayQueue("D:/muz/muz0/例大祭11 Rebirth Story Ⅱ/Disc 1/05.Once Upon a Love.flac");
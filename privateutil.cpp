@@ -1,7 +1,17 @@
 #include "privateutil.hpp"
 #include <QMutex>
+extern "C"
+{
+#include <libavutil/frame.h>
+#include <libavutil/samplefmt.h>
+#include <libavcodec/avcodec.h>
+}
 
 IMPL_EXCEPTION(FFmpegError, std::runtime_error)
+
+// libavcodec serializes codec initialization internally since 58.9.100 (FFmpeg 4.0),
+// older versions rely on the caller to do it.
+#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 9, 100)
 static QMutex g_ffmpegLocker;
 
 void lockFFmpeg()
@@ -9,3 +19,53 @@ void lockFFmpeg()
 
 void unlockFFmpeg()
 { g_ffmpegLocker.unlock(); }
+#else
+void lockFFmpeg()
+{}
+
+void unlockFFmpeg()
+{}
+#endif
+
+template<typename T>
+static void _readSamples(const uint8_t *pData, int nSample, int step, float scale, float bias, float *pOut)
+{
+  const T *pSample = reinterpret_cast<const T*>(pData);
+  for(int i = 0; i < nSample; ++i)
+    pOut[i] = (static_cast<float>(pSample[i * step]) + bias) * scale;
+}
+
+void readAudioFrameAsFloat(const AVFrame *pFrame, int iChannel, float *pOut)
+{
+  auto format = static_cast<AVSampleFormat>(pFrame->format);
+  int nChannel = av_frame_get_channels(pFrame);
+  Q_ASSERT(iChannel >= 0 && iChannel < nChannel);
+
+  bool planar = av_sample_fmt_is_planar(format);
+  const uint8_t *pData = planar ? pFrame->extended_data[iChannel] : pFrame->extended_data[0];
+  int step = planar ? 1 : nChannel;
+  if(!planar)
+    pData += av_get_bytes_per_sample(format) * iChannel;
+
+  switch(av_get_packed_sample_fmt(format))
+  {
+  case AV_SAMPLE_FMT_U8:
+    _readSamples<uint8_t>(pData, pFrame->nb_samples, step, 1.0f / 128.0f, -128.0f, pOut);
+    break;
+  case AV_SAMPLE_FMT_S16:
+    _readSamples<int16_t>(pData, pFrame->nb_samples, step, 1.0f / 32768.0f, 0.0f, pOut);
+    break;
+  case AV_SAMPLE_FMT_S32:
+    _readSamples<int32_t>(pData, pFrame->nb_samples, step, 1.0f / 2147483648.0f, 0.0f, pOut);
+    break;
+  case AV_SAMPLE_FMT_FLT:
+    _readSamples<float>(pData, pFrame->nb_samples, step, 1.0f, 0.0f, pOut);
+    break;
+  case AV_SAMPLE_FMT_DBL:
+    _readSamples<double>(pData, pFrame->nb_samples, step, 1.0f, 0.0f, pOut);
+    break;
+  default:
+    qCritical("Unsupported sample format %d.", pFrame->format);
+    throw FFmpegError("Unsupported sample format.");
+  }
+}
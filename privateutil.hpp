@@ -15,3 +15,8 @@ if(!(successCond)) \
 
 void lockFFmpeg();
 void unlockFFmpeg();
+
+struct AVFrame;
+
+// Writes nb_samples of one channel of an audio frame as float in [-1, 1].
+void readAudioFrameAsFloat(const AVFrame *pFrame, int iChannel, float *pOut);